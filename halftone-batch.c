@@ -0,0 +1,1102 @@
+/* Printable Halftone batch renderer
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* Halftones many PNM files (PGM or PPM, 8 or 16 bits) to PBM files
+ * on all processors.
+ *
+ * The images are cut into tiles which are rendered separately with
+ * halftone_context_render_region(). Each worker thread has a deque of
+ * tiles: it takes work from the head of its own deque and, when that
+ * is empty, steals from the tail of another one. A worker without
+ * tiles loads the next file and queues its tiles to itself, so pages
+ * of very different sizes mix without leaving processors idle.
+ *
+ * Files are loaded only while the loaded inputs and their 1-bit results
+ * fit in --memory; one file at a time is always allowed. Dot tables come
+ * from the shared cache, so each size is prepared once.
+ *
+ * A file that does not fit in --memory by itself is not loaded but
+ * memory-mapped, and its result is written into a mapping of the
+ * preallocated PBM file. One worker renders it from the top in stripes
+ * of TILE_SIZE rows, converting samples straight from the input
+ * mapping. The pages of the rows done are dropped from both mappings
+ * after each stripe, so posters larger than the memory of the machine
+ * take a few stripes of it.
+ *
+ * JPEG files are rendered in stripes too, by one worker, with rows
+ * decoded just before the stripe that needs them. Only the luminance
+ * is decoded, and the renderer only samples the dot centers, so a
+ * JPEG is decoded at 1/2, 1/4 or 1/8 scale when the dots are at least
+ * twice as far apart. Memory then holds a stripe and a few MCU rows of
+ * the scaled image. JPEG support needs libjpeg; see the Makefile.
+ *
+ * Usage: halftone-batch [--size N] [--threads N] [--memory MB]
+ *                       [--output-dir DIR] FILE[:SIZE]...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "halftone.h"
+#ifdef G_OS_UNIX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_JPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+/* A multiple of 8, so that tiles pack to whole bytes */
+#define TILE_SIZE 256
+
+struct JpegInput;
+
+struct BatchFile {
+	gchar * path;
+	gchar * output_path;
+	gint number;        /* 1 .. file_count */
+	gint dot_spacing;
+
+	/* From the PNM header */
+	gint width, height, channels, maxval;
+	glong data_offset;
+
+	/* Bytes used while loaded */
+	gsize cost;
+
+	/* Too large to load: rendered between mappings of the files,
+	 * or from the decoder into a mapping of the PBM file */
+	gboolean mapped;
+	struct JpegInput * jpeg;    /* JPEG files, while loaded */
+	gint jpeg_scale;            /* image pixels per decoded pixel */
+	guchar * input_map;
+	gsize input_map_size;
+	guchar * output_map;
+	gsize output_map_size;
+	gint output_fd;
+
+	/* While loaded */
+	guchar * pixels;    /* host order samples in format, or NULL */
+	const guchar * raster;  /* the samples in the input map, or NULL */
+	gint format;
+	guchar * packed;    /* the result, 1 bit per pixel */
+	gsize packed_row_bytes;
+	HalftoneDots * dots;
+	gint tiles_left;
+	gint failed;
+	gint64 start_time;
+};
+
+#ifdef HAVE_JPEG
+struct JpegError {
+	struct jpeg_error_mgr manager;
+	jmp_buf jump;
+	const gchar * path;
+};
+
+/* Decoded rows r - window_size + 1 .. r of the scaled image, where r =
+ * rows_decoded - 1, are in window[r % window_size] */
+struct JpegInput {
+	struct jpeg_decompress_struct decoder;
+	struct JpegError error;
+	FILE * stream;
+	JSAMPARRAY window;
+	gint window_size;
+	gint rows_decoded;
+};
+#endif
+
+struct Tile {
+	struct BatchFile * file;
+	gint x, y;
+	gint width, height;
+};
+
+struct Worker {
+	GMutex mutex;       /* guards tiles */
+	GQueue tiles;
+	HalftoneContext * ctx;
+	gint index;
+	GThread * thread;
+};
+
+/* Source rows of a tile grown by the region margin.
+ * x and y may be outside the image, which is white there, so that no
+ * dots are centered outside it, as with halftone_context_render(). */
+struct TileSource {
+	const struct BatchFile * file;
+	gint x, y;
+	gint width;
+};
+
+static gint default_size = 8;
+static gint thread_count = 0;
+static gint memory_megabytes = 1024;
+static gchar * output_dir = NULL;
+static gchar ** file_arguments = NULL;
+
+static GOptionEntry option_entries[] =
+{
+	{ "size", 's', 0, G_OPTION_ARG_INT, &default_size,
+	  "Distance between dots in pixels for files without :SIZE "
+	  "(default 8)", "N" },
+	{ "threads", 't', 0, G_OPTION_ARG_INT, &thread_count,
+	  "Number of worker threads (default: one per processor)", "N" },
+	{ "memory", 'm', 0, G_OPTION_ARG_INT, &memory_megabytes,
+	  "Load files while they fit in MB megabytes (default 1024)", "MB" },
+	{ "output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir,
+	  "Write the PBM files to DIR (default: next to the input)", "DIR" },
+	{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY,
+	  &file_arguments, NULL, "FILE[:SIZE]..." },
+	{ NULL }
+};
+
+static struct Worker * workers;
+static gint worker_count;
+
+/* Scheduler state, guarded by batch_mutex */
+static GMutex batch_mutex;
+static GCond batch_cond;
+static GQueue pending_files = G_QUEUE_INIT;
+static gsize memory_budget;
+static gsize memory_in_use = 0;
+static gint files_loaded = 0;
+static gint files_done = 0;
+static gint files_failed = 0;
+static gint file_count = 0;
+
+static struct BatchFile * new_batch_file(const gchar * argument,
+                                         gint number);
+static gboolean read_pnm_header(struct BatchFile * file);
+static gboolean read_jpeg_header(struct BatchFile * file);
+static gboolean load_file(struct BatchFile * file);
+static gboolean map_input(struct BatchFile * file);
+static gboolean map_output(struct BatchFile * file);
+static void drop_mapped_rows(struct BatchFile * file,
+                             gint input_y, gint output_y);
+static gboolean unmap_file(struct BatchFile * file);
+static void scale_samples(const struct BatchFile * file, const guchar * raw,
+                          guchar * samples, gsize count);
+static gboolean open_jpeg(struct BatchFile * file);
+static gboolean decode_jpeg_rows(struct BatchFile * file, gint y);
+static void read_jpeg_row(const struct BatchFile * file, gint y,
+                          gint x, gint count, guchar * row);
+static void close_jpeg(struct BatchFile * file);
+static gboolean write_pbm(const struct BatchFile * file);
+static void free_batch_file(struct BatchFile * file);
+static gpointer worker_thread(gpointer data);
+static struct Tile * take_tile(struct Worker * worker);
+static gboolean load_next_file(struct Worker * worker);
+static void render_tile(struct Worker * worker, const struct Tile * tile);
+static void render_in_stripes(struct Worker * worker,
+                              struct BatchFile * file);
+static void finish_file(struct BatchFile * file);
+static gboolean get_tile_row(gint y, guchar * row, gpointer user_data);
+
+/*
+ * Parses FILE[:SIZE] and the PNM header of FILE.
+ * Returns NULL if the file cannot be used.
+ */
+static struct BatchFile * new_batch_file(const gchar * argument,
+                                         gint number)
+{
+	struct BatchFile * file = g_new0(struct BatchFile, 1);
+	const gchar * colon = strrchr(argument, ':');
+	gchar * base_name, * dot;
+
+	file->number = number;
+	file->dot_spacing = default_size;
+	file->output_fd = -1;
+	if (colon != NULL && colon[1] != '\0'
+		&& strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+		file->path = g_strndup(argument, colon - argument);
+		file->dot_spacing = atoi(colon + 1);
+	} else {
+		file->path = g_strdup(argument);
+	}
+
+	/* name.pgm -> name.pbm */
+	if (output_dir != NULL) {
+		base_name = g_path_get_basename(file->path);
+	} else {
+		base_name = g_strdup(file->path);
+	}
+	dot = strrchr(base_name, '.');
+	if (dot != NULL && strchr(dot, G_DIR_SEPARATOR) == NULL) {
+		*dot = '\0';
+	}
+	file->output_path = g_strconcat(base_name, ".pbm", NULL);
+	g_free(base_name);
+	if (output_dir != NULL) {
+		base_name = file->output_path;
+		file->output_path = g_build_filename(output_dir, base_name, NULL);
+		g_free(base_name);
+	}
+
+	if (file->dot_spacing < 2 || file->dot_spacing > 1000) {
+		g_printerr("halftone-batch: %s: size must be 2 .. 1000\n",
+		           file->path);
+		free_batch_file(file);
+		return NULL;
+	}
+	if (read_pnm_header(file) == FALSE && read_jpeg_header(file) == FALSE) {
+		g_printerr("halftone-batch: %s: not a PGM, PPM or JPEG file\n",
+		           file->path);
+		free_batch_file(file);
+		return NULL;
+	}
+	file->format = file->maxval > 255
+	               ? HALFTONE_FORMAT_U16 : HALFTONE_FORMAT_U8;
+	file->packed_row_bytes = (file->width + 7) / 8;
+	if (file->jpeg_scale > 0) {
+		/* The window of decoded rows, a dot_spacing margin being the
+		 * most, a stripe of the result and the whole result */
+		file->cost = (gsize) ((TILE_SIZE + 2 * file->dot_spacing)
+		                      / file->jpeg_scale + 2)
+		             * ((file->width + file->jpeg_scale - 1)
+		                / file->jpeg_scale)
+		             + (gsize) TILE_SIZE * file->width
+		             + file->packed_row_bytes * file->height;
+		if (file->cost > memory_budget) {
+			file->mapped = TRUE;
+			file->cost -= file->packed_row_bytes * file->height;
+		}
+		return file;
+	}
+	file->cost = (gsize) file->width * file->height * file->channels
+	             * halftone_sample_size(file->format)
+	             + file->packed_row_bytes * file->height;
+	if (file->cost > memory_budget) {
+		/* A stripe of the result and a source row */
+		file->mapped = TRUE;
+		file->cost = (gsize) TILE_SIZE * file->width
+		             + (gsize) file->width * file->channels
+		               * halftone_sample_size(file->format);
+	}
+	return file;
+}
+
+/* Reads a header number, skipping whitespace and comments */
+static gint read_pnm_number(FILE * stream)
+{
+	gint c, value = 0, digits = 0;
+
+	do {
+		c = getc(stream);
+		if (c == '#') {
+			while (c != '\n' && c != EOF) {
+				c = getc(stream);
+			}
+		}
+	} while (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+	while (c >= '0' && c <= '9' && value < G_MAXINT / 10) {
+		value = value * 10 + c - '0';
+		digits++;
+		c = getc(stream);
+	}
+	/* One whitespace ends the number; after maxval the raster begins */
+	if (digits == 0 || (c != ' ' && c != '\t' && c != '\r' && c != '\n')) {
+		return -1;
+	}
+	return value;
+}
+
+static gboolean read_pnm_header(struct BatchFile * file)
+{
+	FILE * stream = fopen(file->path, "rb");
+	gchar magic[2];
+
+	if (stream == NULL) {
+		return FALSE;
+	}
+	if (fread(magic, 1, 2, stream) != 2 || magic[0] != 'P'
+		|| (magic[1] != '5' && magic[1] != '6')) {
+		fclose(stream);
+		return FALSE;
+	}
+	file->channels = magic[1] == '5' ? 1 : 3;
+	file->width = read_pnm_number(stream);
+	file->height = read_pnm_number(stream);
+	file->maxval = read_pnm_number(stream);
+	file->data_offset = ftell(stream);
+	fclose(stream);
+	return file->width > 0 && file->height > 0
+	       && file->width <= G_MAXINT / 8 / file->channels
+	       && file->maxval > 0 && file->maxval <= 65535;
+}
+
+/*
+ * Reads the raster of file, scaled to the full range of its format,
+ * and allocates the result. Mapped files are mapped instead, and JPEG
+ * files are opened for decoding.
+ */
+static gboolean load_file(struct BatchFile * file)
+{
+	FILE * stream;
+	gsize samples = (gsize) file->width * file->height * file->channels;
+	gsize sample_size = halftone_sample_size(file->format);
+	gboolean ok;
+
+	file->dots = halftone_dots_cache_get(file->dot_spacing);
+	if (file->dots == NULL) {
+		return FALSE;
+	}
+	if (file->jpeg_scale > 0) {
+		if (open_jpeg(file) == FALSE) {
+			return FALSE;
+		}
+		if (file->mapped) {
+			return map_output(file);
+		}
+		file->packed = (guchar *) g_try_malloc(file->packed_row_bytes
+		                                       * file->height);
+		return file->packed != NULL;
+	}
+	if (file->mapped) {
+		return map_input(file) && map_output(file);
+	}
+	file->pixels = (guchar *) g_try_malloc(samples * sample_size);
+	file->packed = (guchar *) g_try_malloc(file->packed_row_bytes
+	                                       * file->height);
+	if (file->pixels == NULL || file->packed == NULL) {
+		return FALSE;
+	}
+
+	stream = fopen(file->path, "rb");
+	if (stream == NULL) {
+		return FALSE;
+	}
+	ok = fseek(stream, file->data_offset, SEEK_SET) == 0
+	     && fread(file->pixels, sample_size, samples, stream) == samples;
+	fclose(stream);
+	if (!ok) {
+		return FALSE;
+	}
+	scale_samples(file, file->pixels, file->pixels, samples);
+	return TRUE;
+}
+
+#ifdef G_OS_UNIX
+/* Maps the input of file for reading */
+static gboolean map_input(struct BatchFile * file)
+{
+	struct stat input_stat;
+	gsize raster_size = (gsize) file->width * file->height * file->channels
+	                    * (file->maxval > 255 ? 2 : 1);
+	gint fd;
+
+	fd = open(file->path, O_RDONLY);
+	if (fd < 0) {
+		return FALSE;
+	}
+	if (fstat(fd, &input_stat) != 0
+		|| (gsize) input_stat.st_size < file->data_offset + raster_size) {
+		close(fd);
+		return FALSE;
+	}
+	file->input_map_size = file->data_offset + raster_size;
+	file->input_map = (guchar *) mmap(NULL, file->input_map_size,
+	                                  PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (file->input_map == MAP_FAILED) {
+		file->input_map = NULL;
+		return FALSE;
+	}
+	madvise(file->input_map, file->input_map_size, MADV_SEQUENTIAL);
+	file->raster = file->input_map + file->data_offset;
+	return TRUE;
+}
+
+/*
+ * Creates the PBM file of file at full size, mapped for writing, as
+ * file->packed. The blocks of the file are allocated now, so that a
+ * full disk fails here and not in the middle of the render.
+ */
+static gboolean map_output(struct BatchFile * file)
+{
+	gchar header[64];
+	gint header_size;
+	gint error;
+
+	header_size = g_snprintf(header, sizeof(header), "P4\n%d %d\n",
+	                         file->width, file->height);
+	file->output_fd = open(file->output_path,
+	                       O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (file->output_fd < 0) {
+		return FALSE;
+	}
+	file->output_map_size = header_size
+	                        + file->packed_row_bytes * file->height;
+	error = posix_fallocate(file->output_fd, 0, file->output_map_size);
+	if (error == EINVAL || error == EOPNOTSUPP) {
+		/* Not supported by the file system; the file is sparse */
+		error = ftruncate(file->output_fd, file->output_map_size);
+	}
+	if (error != 0) {
+		return FALSE;
+	}
+	file->output_map = (guchar *) mmap(NULL, file->output_map_size,
+	                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+	                                   file->output_fd, 0);
+	if (file->output_map == MAP_FAILED) {
+		file->output_map = NULL;
+		return FALSE;
+	}
+	madvise(file->output_map, file->output_map_size, MADV_SEQUENTIAL);
+	memcpy(file->output_map, header, header_size);
+	file->packed = file->output_map + header_size;
+	return TRUE;
+}
+
+/*
+ * Drops the pages of both maps before input row input_y and output
+ * row output_y. They are not read again, and the written ones stay in
+ * the page cache until the kernel writes them out.
+ */
+static void drop_mapped_rows(struct BatchFile * file,
+                             gint input_y, gint output_y)
+{
+	gsize page_size = sysconf(_SC_PAGESIZE);
+	gsize input_end = file->data_offset
+	                  + (gsize) MAX(input_y, 0) * file->width
+	                    * file->channels * (file->maxval > 255 ? 2 : 1);
+	gsize output_end = (file->packed - file->output_map)
+	                   + (gsize) output_y * file->packed_row_bytes;
+
+	if (file->input_map != NULL) {
+		madvise(file->input_map, input_end - input_end % page_size,
+		        MADV_DONTNEED);
+	}
+	madvise(file->output_map, output_end - output_end % page_size,
+	        MADV_DONTNEED);
+}
+
+/* Returns FALSE if the result could not be written */
+static gboolean unmap_file(struct BatchFile * file)
+{
+	gboolean ok = TRUE;
+
+	if (file->input_map != NULL) {
+		munmap(file->input_map, file->input_map_size);
+	}
+	if (file->output_map != NULL) {
+		ok = munmap(file->output_map, file->output_map_size) == 0;
+	}
+	if (file->output_fd >= 0) {
+		ok = (close(file->output_fd) == 0) && ok;
+	}
+	file->input_map = NULL;
+	file->output_map = NULL;
+	file->output_fd = -1;
+	return ok;
+}
+#else
+static gboolean map_input(struct BatchFile * file)
+{
+	return FALSE;
+}
+
+static gboolean map_output(struct BatchFile * file)
+{
+	return FALSE;
+}
+
+static void drop_mapped_rows(struct BatchFile * file,
+                             gint input_y, gint output_y)
+{
+}
+
+static gboolean unmap_file(struct BatchFile * file)
+{
+	return TRUE;
+}
+#endif
+
+/*
+ * Scales count samples of the raster, as in the file, to the full range
+ * of the format of file in samples. raw and samples may be the same.
+ */
+static void scale_samples(const struct BatchFile * file, const guchar * raw,
+                          guchar * samples, gsize count)
+{
+	gsize i;
+
+	if (file->format == HALFTONE_FORMAT_U16) {
+		/* PNM is big-endian */
+		for (i = 0; i < count; i++) {
+			((guint16 *) samples)[i] = (guint32) (raw[2 * i] << 8
+			                                      | raw[2 * i + 1])
+			                           * MAX_LUMINANCE16 / file->maxval;
+		}
+	} else if (file->maxval != WHITE) {
+		for (i = 0; i < count; i++) {
+			samples[i] = MIN(raw[i], file->maxval) * WHITE / file->maxval;
+		}
+	} else if (raw != samples) {
+		memcpy(samples, raw, count);
+	}
+}
+
+static gboolean write_pbm(const struct BatchFile * file)
+{
+	FILE * stream = fopen(file->output_path, "wb");
+	gboolean ok;
+
+	if (stream == NULL) {
+		return FALSE;
+	}
+	ok = fprintf(stream, "P4\n%d %d\n", file->width, file->height) > 0
+	     && fwrite(file->packed, file->packed_row_bytes, file->height,
+	               stream) == (gsize) file->height;
+	return (fclose(stream) == 0) && ok;
+}
+
+#ifdef HAVE_JPEG
+static void print_jpeg_message(j_common_ptr decoder)
+{
+	struct JpegError * error = (struct JpegError *) decoder->err;
+	gchar message[JMSG_LENGTH_MAX];
+
+	decoder->err->format_message(decoder, message);
+	g_printerr("halftone-batch: %s: %s\n", error->path, message);
+}
+
+static void exit_jpeg_error(j_common_ptr decoder)
+{
+	struct JpegError * error = (struct JpegError *) decoder->err;
+
+	print_jpeg_message(decoder);
+	longjmp(error->jump, 1);
+}
+
+/*
+ * Opens file as a JPEG file for decoding into jpeg->decoder, which
+ * must be destroyed whatever the result. Only the luminance of
+ * grayscale and YCbCr images is decoded, at 1 / file->jpeg_scale.
+ * The caller sets the error jump.
+ */
+static gboolean start_jpeg(struct BatchFile * file, struct JpegInput * jpeg)
+{
+	struct jpeg_decompress_struct * decoder = &jpeg->decoder;
+
+	decoder->err = jpeg_std_error(&jpeg->error.manager);
+	jpeg->error.manager.error_exit = exit_jpeg_error;
+	jpeg->error.manager.output_message = print_jpeg_message;
+	jpeg->error.path = file->path;
+	jpeg_create_decompress(decoder);
+	jpeg->stream = fopen(file->path, "rb");
+	if (jpeg->stream == NULL || getc(jpeg->stream) != 0xFF
+		|| getc(jpeg->stream) != 0xD8) {
+		return FALSE;
+	}
+	rewind(jpeg->stream);
+	jpeg_stdio_src(decoder, jpeg->stream);
+	if (jpeg_read_header(decoder, TRUE) != JPEG_HEADER_OK
+		|| (decoder->jpeg_color_space != JCS_GRAYSCALE
+		    && decoder->jpeg_color_space != JCS_YCbCr)) {
+		return FALSE;
+	}
+	decoder->out_color_space = JCS_GRAYSCALE;
+	decoder->scale_num = 1;
+	decoder->scale_denom = file->jpeg_scale;
+	jpeg_calc_output_dimensions(decoder);
+	return TRUE;
+}
+
+static void destroy_jpeg(struct JpegInput * jpeg)
+{
+	jpeg_destroy_decompress(&jpeg->decoder);
+	if (jpeg->stream != NULL) {
+		fclose(jpeg->stream);
+	}
+}
+
+/*
+ * Reads the size of a JPEG file and picks the scale it is decoded at:
+ * 1, 2, 4 or 8, at most half of dot_spacing, so that the two phases of
+ * the lattice still sample different decoded rows.
+ */
+static gboolean read_jpeg_header(struct BatchFile * file)
+{
+	struct JpegInput jpeg;
+	gboolean ok;
+
+	file->jpeg_scale = 8;
+	while (file->jpeg_scale > 1 && file->jpeg_scale > file->dot_spacing / 2) {
+		file->jpeg_scale /= 2;
+	}
+	memset(&jpeg, 0, sizeof(jpeg));
+	if (setjmp(jpeg.error.jump)) {
+		destroy_jpeg(&jpeg);
+		file->jpeg_scale = 0;
+		return FALSE;
+	}
+	ok = start_jpeg(file, &jpeg);
+	if (ok) {
+		file->width = jpeg.decoder.image_width;
+		file->height = jpeg.decoder.image_height;
+		file->channels = 1;
+		file->maxval = WHITE;
+	}
+	destroy_jpeg(&jpeg);
+	if (!ok || file->width <= 0 || file->height <= 0) {
+		file->jpeg_scale = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Starts decoding file and allocates the window of decoded rows, tall
+ * enough for the rows a stripe reads.
+ */
+static gboolean open_jpeg(struct BatchFile * file)
+{
+	struct JpegInput * jpeg = g_new0(struct JpegInput, 1);
+	gint margin = halftone_region_margin(file->dots);
+
+	file->jpeg = jpeg;
+	if (setjmp(jpeg->error.jump)) {
+		return FALSE;
+	}
+	if (start_jpeg(file, jpeg) == FALSE) {
+		return FALSE;
+	}
+	jpeg_start_decompress(&jpeg->decoder);
+	jpeg->window_size = (TILE_SIZE + 2 * margin) / file->jpeg_scale + 2;
+	jpeg->window = jpeg->decoder.mem->alloc_sarray(
+	        (j_common_ptr) &jpeg->decoder, JPOOL_IMAGE,
+	        jpeg->decoder.output_width, jpeg->window_size);
+	return TRUE;
+}
+
+/*
+ * Decodes rows until the window holds the decoded row of image row y.
+ * Returns FALSE if the file is broken.
+ */
+static gboolean decode_jpeg_rows(struct BatchFile * file, gint y)
+{
+	struct JpegInput * jpeg = file->jpeg;
+	gint last = y / file->jpeg_scale;
+	JSAMPROW row;
+
+	if (setjmp(jpeg->error.jump)) {
+		return FALSE;
+	}
+	while (jpeg->rows_decoded <= last) {
+		row = jpeg->window[jpeg->rows_decoded % jpeg->window_size];
+		if (jpeg_read_scanlines(&jpeg->decoder, &row, 1) != 1) {
+			return FALSE;
+		}
+		jpeg->rows_decoded++;
+	}
+	return TRUE;
+}
+
+/* Reads row y of the image, nearest neighbor from the decoded rows */
+static void read_jpeg_row(const struct BatchFile * file, gint y,
+                          gint x, gint count, guchar * row)
+{
+	const struct JpegInput * jpeg = file->jpeg;
+	gint scale = file->jpeg_scale;
+	const guchar * decoded = jpeg->window[(y / scale) % jpeg->window_size];
+	gint i;
+
+	if (scale == 1) {
+		memcpy(row, decoded + x, count);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		row[i] = decoded[(x + i) / scale];
+	}
+}
+
+static void close_jpeg(struct BatchFile * file)
+{
+	if (file->jpeg != NULL) {
+		destroy_jpeg(file->jpeg);
+		g_free(file->jpeg);
+		file->jpeg = NULL;
+	}
+}
+#else
+static gboolean read_jpeg_header(struct BatchFile * file)
+{
+	return FALSE;
+}
+
+static gboolean open_jpeg(struct BatchFile * file)
+{
+	return FALSE;
+}
+
+static gboolean decode_jpeg_rows(struct BatchFile * file, gint y)
+{
+	return FALSE;
+}
+
+static void read_jpeg_row(const struct BatchFile * file, gint y,
+                          gint x, gint count, guchar * row)
+{
+}
+
+static void close_jpeg(struct BatchFile * file)
+{
+}
+#endif
+
+static void free_batch_file(struct BatchFile * file)
+{
+	halftone_dots_unref(file->dots);
+	close_jpeg(file);
+	g_free(file->pixels);
+	if (file->mapped) {
+		unmap_file(file);
+	} else {
+		g_free(file->packed);
+	}
+	g_free(file->path);
+	g_free(file->output_path);
+	g_free(file);
+}
+
+static gpointer worker_thread(gpointer data)
+{
+	struct Worker * worker = (struct Worker *) data;
+	struct Tile * tile;
+
+	for (;;) {
+		tile = take_tile(worker);
+		if (tile != NULL) {
+			render_tile(worker, tile);
+			g_free(tile);
+			continue;
+		}
+		if (load_next_file(worker)) {
+			continue;
+		}
+
+		g_mutex_lock(&batch_mutex);
+		if (files_done + files_failed == file_count) {
+			g_mutex_unlock(&batch_mutex);
+			break;
+		}
+		/* Wait until there are tiles to steal or memory to load more.
+		 * Tiles are queued without the batch mutex, so do not rely
+		 * on the signal alone. */
+		g_cond_wait_until(&batch_cond, &batch_mutex,
+		                  g_get_monotonic_time()
+		                  + 10 * G_TIME_SPAN_MILLISECOND);
+		g_mutex_unlock(&batch_mutex);
+	}
+	return NULL;
+}
+
+/*
+ * Takes a tile from the head of the worker's own deque or,
+ * if it is empty, steals one from the tail of another worker's.
+ */
+static struct Tile * take_tile(struct Worker * worker)
+{
+	struct Worker * victim;
+	struct Tile * tile;
+	gint i;
+
+	g_mutex_lock(&worker->mutex);
+	tile = (struct Tile *) g_queue_pop_head(&worker->tiles);
+	g_mutex_unlock(&worker->mutex);
+
+	for (i = 1; tile == NULL && i < worker_count; i++) {
+		victim = &workers[(worker->index + i) % worker_count];
+		g_mutex_lock(&victim->mutex);
+		tile = (struct Tile *) g_queue_pop_tail(&victim->tiles);
+		g_mutex_unlock(&victim->mutex);
+	}
+	return tile;
+}
+
+/*
+ * Loads the next file if it fits in the memory budget and queues its
+ * tiles to worker. Returns FALSE if no file was taken.
+ */
+static gboolean load_next_file(struct Worker * worker)
+{
+	struct BatchFile * file;
+	struct Tile * tile;
+	gint x, y;
+
+	g_mutex_lock(&batch_mutex);
+	file = (struct BatchFile *) g_queue_peek_head(&pending_files);
+	if (file == NULL
+		|| (files_loaded > 0
+		    && memory_in_use + file->cost > memory_budget)) {
+		g_mutex_unlock(&batch_mutex);
+		return FALSE;
+	}
+	g_queue_pop_head(&pending_files);
+	memory_in_use += file->cost;
+	files_loaded++;
+	g_mutex_unlock(&batch_mutex);
+
+	file->start_time = g_get_monotonic_time();
+	if (load_file(file) == FALSE) {
+		g_printerr("halftone-batch: %s: cannot %s\n", file->path,
+		           file->mapped ? "map" : "read");
+		file->failed = TRUE;
+		finish_file(file);
+		return TRUE;
+	}
+	if (file->mapped || file->jpeg != NULL) {
+		render_in_stripes(worker, file);
+		return TRUE;
+	}
+
+	file->tiles_left = ((file->width + TILE_SIZE - 1) / TILE_SIZE)
+	                   * ((file->height + TILE_SIZE - 1) / TILE_SIZE);
+	g_mutex_lock(&worker->mutex);
+	for (y = 0; y < file->height; y += TILE_SIZE) {
+		for (x = 0; x < file->width; x += TILE_SIZE) {
+			tile = g_new(struct Tile, 1);
+			tile->file = file;
+			tile->x = x;
+			tile->y = y;
+			tile->width = MIN(TILE_SIZE, file->width - x);
+			tile->height = MIN(TILE_SIZE, file->height - y);
+			g_queue_push_tail(&worker->tiles, tile);
+		}
+	}
+	g_mutex_unlock(&worker->mutex);
+
+	g_mutex_lock(&batch_mutex);
+	g_cond_broadcast(&batch_cond);
+	g_mutex_unlock(&batch_mutex);
+	return TRUE;
+}
+
+static void render_tile(struct Worker * worker, const struct Tile * tile)
+{
+	struct BatchFile * file = tile->file;
+	struct BWBitmap * result_image;
+	struct TileSource tile_source;
+	HalftoneSource source;
+	gint margin = halftone_region_margin(file->dots);
+	gint y;
+
+	if (worker->ctx == NULL) {
+		worker->ctx = halftone_context_new_for_dots(file->dots);
+	} else {
+		halftone_context_set_dots(worker->ctx, file->dots);
+	}
+
+	tile_source.file = file;
+	tile_source.x = tile->x - margin;
+	tile_source.y = tile->y - margin;
+	tile_source.width = tile->width + 2 * margin;
+	source.width = tile_source.width;
+	source.height = tile->height + 2 * margin;
+	source.channels = file->channels;
+	source.format = file->format;
+	source.get_row = get_tile_row;
+	source.progress = NULL;
+	source.user_data = &tile_source;
+
+	if (g_atomic_int_get(&file->failed) || worker->ctx == NULL
+		|| halftone_context_render_region(worker->ctx, &source,
+		        tile->x, tile->y, tile->width, tile->height) == FALSE) {
+		g_atomic_int_set(&file->failed, TRUE);
+	} else {
+		result_image = &worker->ctx->result_image;
+		for (y = 0; y < tile->height; y++) {
+			halftone_pack_row(result_image->pixels + y * tile->width,
+			                  tile->width,
+			                  file->packed
+			                  + (gsize) (tile->y + y) * file->packed_row_bytes
+			                  + tile->x / 8);
+		}
+	}
+	if (g_atomic_int_dec_and_test(&file->tiles_left)) {
+		finish_file(file);
+	}
+}
+
+/*
+ * Renders a mapped or JPEG file in stripes of TILE_SIZE rows from the
+ * top, in this thread, and finishes it. Each stripe is a tile of full
+ * width.
+ */
+static void render_in_stripes(struct Worker * worker,
+                              struct BatchFile * file)
+{
+	struct Tile stripe;
+	gint margin = halftone_region_margin(file->dots);
+
+	/* One more, so that the file is not finished in render_tile() */
+	file->tiles_left = (file->height + TILE_SIZE - 1) / TILE_SIZE + 1;
+	stripe.file = file;
+	stripe.x = 0;
+	stripe.width = file->width;
+	for (stripe.y = 0; stripe.y < file->height; stripe.y += TILE_SIZE) {
+		stripe.height = MIN(TILE_SIZE, file->height - stripe.y);
+		if (file->jpeg != NULL
+			&& decode_jpeg_rows(file, MIN(stripe.y + stripe.height + margin,
+			                              file->height) - 1) == FALSE) {
+			file->failed = TRUE;
+			break;
+		}
+		render_tile(worker, &stripe);
+		if (file->failed) {
+			break;
+		}
+		if (file->mapped) {
+			drop_mapped_rows(file, stripe.y + stripe.height - margin,
+			                 stripe.y + stripe.height);
+		}
+	}
+	finish_file(file);
+}
+
+/*
+ * Writes the result of a file whose last tile is done,
+ * reports it and frees its memory for the next files.
+ */
+static void finish_file(struct BatchFile * file)
+{
+	gdouble seconds = (g_get_monotonic_time() - file->start_time) / 1e6;
+	gboolean ok = !file->failed;
+
+	if (file->mapped) {
+		/* The result is in the file already */
+		if (unmap_file(file) == FALSE && ok) {
+			g_printerr("halftone-batch: %s: cannot write\n",
+			           file->output_path);
+			ok = FALSE;
+		}
+		if (!ok && file->output_map_size > 0) {
+			remove(file->output_path);
+		}
+	} else if (ok && write_pbm(file) == FALSE) {
+		g_printerr("halftone-batch: %s: cannot write\n", file->output_path);
+		ok = FALSE;
+	}
+
+	g_mutex_lock(&batch_mutex);
+	if (ok) {
+		files_done++;
+		g_print("[%d/%d] %s -> %s: %d x %d, size %d, %.2f s\n",
+		        files_done + files_failed, file_count, file->path,
+		        file->output_path, file->width, file->height,
+		        file->dot_spacing, seconds);
+	} else {
+		files_failed++;
+	}
+	memory_in_use -= file->cost;
+	files_loaded--;
+	g_cond_broadcast(&batch_cond);
+	g_mutex_unlock(&batch_mutex);
+
+	free_batch_file(file);
+}
+
+static gboolean get_tile_row(gint y, guchar * row, gpointer user_data)
+{
+	struct TileSource * tile = (struct TileSource *) user_data;
+	const struct BatchFile * file = tile->file;
+	gsize pixel_size = file->channels * halftone_sample_size(file->format);
+	gint x1 = MAX(tile->x, 0);
+	gint x2 = MIN(tile->x + tile->width, file->width);
+	gsize offset;
+
+	/* White is all ones in both formats */
+	y += tile->y;
+	if (y < 0 || y >= file->height) {
+		memset(row, 0xFF, tile->width * pixel_size);
+		return TRUE;
+	}
+	memset(row, 0xFF, (x1 - tile->x) * pixel_size);
+	memset(row + (x2 - tile->x) * pixel_size, 0xFF,
+	       (tile->x + tile->width - x2) * pixel_size);
+	offset = (gsize) y * file->width + x1;
+	if (file->pixels != NULL) {
+		memcpy(row + (x1 - tile->x) * pixel_size,
+		       file->pixels + offset * pixel_size, (x2 - x1) * pixel_size);
+	} else if (file->jpeg != NULL) {
+		read_jpeg_row(file, y, x1, x2 - x1, row + (x1 - tile->x));
+	} else {
+		/* Raw samples have the size of the format */
+		scale_samples(file, file->raster + offset * pixel_size,
+		              row + (x1 - tile->x) * pixel_size,
+		              (gsize) (x2 - x1) * file->channels);
+	}
+	return TRUE;
+}
+
+int main(int argc, char ** argv)
+{
+	GOptionContext * options;
+	GError * error = NULL;
+	struct BatchFile * file;
+	gint64 start_time = g_get_monotonic_time();
+	gint i;
+
+	options = g_option_context_new("- Printable Halftone batch renderer");
+	g_option_context_add_main_entries(options, option_entries, NULL);
+	if (!g_option_context_parse(options, &argc, &argv, &error)) {
+		g_printerr("halftone-batch: %s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(options);
+	if (file_arguments == NULL) {
+		g_printerr("halftone-batch: no files\n");
+		return 1;
+	}
+	if (thread_count <= 0) {
+		thread_count = g_get_num_processors();
+	}
+	memory_budget = (gsize) MAX(memory_megabytes, 1) << 20;
+	if (output_dir != NULL && g_mkdir_with_parents(output_dir, 0777) != 0) {
+		g_printerr("halftone-batch: cannot create %s\n", output_dir);
+		return 1;
+	}
+
+	for (i = 0; file_arguments[i] != NULL; i++) {
+		file = new_batch_file(file_arguments[i], i + 1);
+		if (file != NULL) {
+			g_queue_push_tail(&pending_files, file);
+		} else {
+			files_failed++;
+		}
+		file_count++;
+	}
+
+	worker_count = thread_count;
+	workers = g_new0(struct Worker, worker_count);
+	for (i = 0; i < worker_count; i++) {
+		g_mutex_init(&workers[i].mutex);
+		g_queue_init(&workers[i].tiles);
+		workers[i].index = i;
+	}
+	for (i = 0; i < worker_count; i++) {
+		workers[i].thread = g_thread_new("batch", worker_thread,
+		                                 &workers[i]);
+	}
+	for (i = 0; i < worker_count; i++) {
+		g_thread_join(workers[i].thread);
+		halftone_context_free(workers[i].ctx);
+		g_mutex_clear(&workers[i].mutex);
+	}
+	g_free(workers);
+	halftone_dots_cache_clear();
+
+	g_print("halftone-batch: %d files done, %d failed, %.1f s\n",
+	        files_done, files_failed,
+	        (g_get_monotonic_time() - start_time) / 1e6);
+	return files_failed > 0 ? 1 : 0;
+}
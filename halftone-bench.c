@@ -0,0 +1,418 @@
+/* Printable Halftone kernel benchmark
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* Times the inner loops of the renderer one at a time, without the GIMP.
+ * halftone.c is included to reach its static kernels.
+ *
+ * Each kernel is first run to warm up the caches and to find how many
+ * calls take about MIN_RUN_NS; that many calls are then timed --repeats
+ * times and the fastest run is reported. Times are in nanoseconds and,
+ * on x86, in time stamp counter cycles, per pixel and per dot:
+ *
+ *   paint_dot, paint_fine_dot  IMAGE_SIZE x IMAGE_SIZE pixels, one dot
+ *   paint_spans, paint_pixels  per lattice point; paint_dot and these
+ *                              are the HALFTONE_PAINT_* strategies
+ *   paint_dot_fixed            paint_dot specialized for the size, for
+ *                              sizes which have one
+ *   paint_bitboard             the same on the bitboard of sizes 2 .. 5,
+ *                              with the copy to the result bitmap
+ *   precalculate_dots          LUMINANCES bitmaps of max_dot_width^2
+ *                              pixels; a dot is one bitmap
+ *   calibrate_dot_sizes        dot_spacing^2 test image; a dot is one
+ *                              dot size tried
+ *   luminance                  a row of IMAGE_SIZE pixels, sampled once
+ *                              per dot like halftone_context_render()
+ *   expand, expand_mask        SCANLINE_AREA rows of IMAGE_SIZE pixels
+ *                              as in send_to_gimp()
+ *
+ * Usage: halftone-bench [--repeats N] [--sizes N,N,...]
+ */
+#include <stdio.h>
+#include <time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+#include "halftone.c"
+
+#define IMAGE_SIZE 1024
+#define SCANLINE_AREA 64
+#define MIN_RUN_NS 10000000
+
+typedef void (* KernelFunc) (gpointer data);
+
+struct Timing {
+	gdouble nanoseconds;    /* per call */
+	gdouble cycles;         /* per call, 0 without a cycle counter */
+};
+
+struct PaintData {
+	const HalftoneDots * dots;
+	PaintFunc paint;
+	HalftoneContext * ctx;  /* for the bitboard */
+	guchar dot_luminances[2][IMAGE_SIZE];   /* of a row of each phase */
+	struct BWBitmap image;
+	guint16 luminances[IMAGE_SIZE];
+};
+
+struct RowData {
+	const HalftoneDots * dots;
+	guchar * pixels;
+	guchar * out;
+	gint channels;
+};
+
+static gint repeats = 5;
+static gchar * size_list = NULL;
+
+static GOptionEntry option_entries[] =
+{
+	{ "repeats", 'r', 0, G_OPTION_ARG_INT, &repeats,
+	  "Timed runs of each kernel (default 5)", "N" },
+	{ "sizes", 's', 0, G_OPTION_ARG_STRING, &size_list,
+	  "Dot sizes (default 2,3,4,5,6,8,10,14,20,40,100)", "N,N,..." },
+	{ NULL }
+};
+
+/* Keeps the compiler from dropping the luminance loop */
+static volatile guint luminance_sink;
+
+static gint64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static guint64 read_cycles(void)
+{
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void measure(KernelFunc kernel, gpointer data, struct Timing * best)
+{
+	gint64 start, elapsed;
+	guint64 cycles;
+	gint iterations, i, repeat;
+
+	start = now_ns();
+	kernel(data);
+	elapsed = now_ns() - start;
+	iterations = MIN_RUN_NS / MAX(elapsed, 1) + 1;
+	for (i = 0; i < iterations; i++) {
+		kernel(data);
+	}
+
+	best->nanoseconds = G_MAXDOUBLE;
+	best->cycles = G_MAXDOUBLE;
+	for (repeat = 0; repeat < repeats; repeat++) {
+		start = now_ns();
+		cycles = read_cycles();
+		for (i = 0; i < iterations; i++) {
+			kernel(data);
+		}
+		cycles = read_cycles() - cycles;
+		elapsed = now_ns() - start;
+		best->nanoseconds = MIN(best->nanoseconds,
+		                        (gdouble) elapsed / iterations);
+		best->cycles = MIN(best->cycles, (gdouble) cycles / iterations);
+	}
+}
+
+/* size or channels 0 = does not apply, dots 0 = no per dot figure */
+static void report(const gchar * kernel, gint size, gint channels,
+                   const struct Timing * timing, gdouble pixels, gdouble dots)
+{
+	gchar size_text[16], channels_text[16], dot_text[32];
+
+	g_snprintf(size_text, sizeof(size_text), size ? "%d" : "-", size);
+	g_snprintf(channels_text, sizeof(channels_text),
+	           channels ? "%d" : "-", channels);
+	if (dots > 0) {
+		g_snprintf(dot_text, sizeof(dot_text), "%12.2f %12.2f",
+		           timing->nanoseconds / dots, timing->cycles / dots);
+	} else {
+		g_snprintf(dot_text, sizeof(dot_text), "%12s %12s", "-", "-");
+	}
+	g_print("%-20s %5s %3s %12.3f %12.3f %s\n", kernel, size_text,
+	        channels_text, timing->nanoseconds / pixels,
+	        timing->cycles / pixels, dot_text);
+}
+
+/* Dots in one row of a phase of the lattice */
+static gdouble row_dots(gint dot_spacing, gint phase)
+{
+	return (IMAGE_SIZE - phase * dot_spacing / 2 + dot_spacing - 1)
+	       / dot_spacing;
+}
+
+/* Both phases of the lattice over the image */
+static gdouble lattice_dots(gint dot_spacing)
+{
+	return row_dots(dot_spacing, 0) * row_dots(dot_spacing, 0)
+	       + row_dots(dot_spacing, 1) * row_dots(dot_spacing, 1);
+}
+
+static void paint_dot_kernel(gpointer data)
+{
+	struct PaintData * paint = (struct PaintData *) data;
+	gint dot_spacing = paint->dots->dot_spacing;
+	gint x, y, phase;
+
+	for (phase = 0; phase < 2; phase++) {
+		for (y = phase * dot_spacing / 2; y < IMAGE_SIZE; y += dot_spacing) {
+			for (x = phase * dot_spacing / 2; x < IMAGE_SIZE;
+			        x += dot_spacing) {
+				paint->paint(paint->dots, &paint->image, x, y,
+				             paint->luminances[x] >> 8);
+			}
+		}
+	}
+}
+
+static void paint_bitboard_kernel(gpointer data)
+{
+	struct PaintData * paint = (struct PaintData *) data;
+	HalftoneContext * ctx = paint->ctx;
+	gint dot_spacing = paint->dots->dot_spacing;
+	gint y, phase;
+
+	halftone_arena_reset(&ctx->arena);
+	prepare_tiles(ctx, IMAGE_SIZE, IMAGE_SIZE);
+	for (phase = 0; phase < 2; phase++) {
+		for (y = phase * dot_spacing / 2; y < IMAGE_SIZE; y += dot_spacing) {
+			paint_bitboard_row(paint->dots, ctx, y, phase * dot_spacing / 2,
+			                   row_dots(dot_spacing, phase),
+			                   paint->dot_luminances[phase]);
+		}
+	}
+	ctx->result_image = paint->image;
+	tiles_to_bitmap(ctx, 0, IMAGE_SIZE);
+}
+
+static void paint_fine_dot_kernel(gpointer data)
+{
+	struct PaintData * paint = (struct PaintData *) data;
+	gint dot_spacing = paint->dots->dot_spacing;
+	gint x, y, phase;
+
+	for (phase = 0; phase < 2; phase++) {
+		for (y = phase * dot_spacing / 2; y < IMAGE_SIZE; y += dot_spacing) {
+			for (x = phase * dot_spacing / 2; x < IMAGE_SIZE;
+			        x += dot_spacing) {
+				paint_fine_dot(paint->dots, &paint->image, x, y,
+				               halftone_dots_pixel_count16(paint->dots,
+				                       paint->luminances[x]));
+			}
+		}
+	}
+}
+
+static void precalculate_dots_kernel(gpointer data)
+{
+	HalftoneDots * dots = (HalftoneDots *) data;
+
+	halftone_free(dots->precalculated_dots,
+	              (gsize) dots->pixels_in_dot_bitmap * LUMINANCES);
+	halftone_free(dots->pixel_order,
+	              (gsize) dots->pixels_in_dot_bitmap * sizeof(gint));
+	precalculate_dots(dots);
+}
+
+static void calibrate_dot_sizes_kernel(gpointer data)
+{
+	HalftoneDots * dots = (HalftoneDots *) data;
+
+	halftone_free(dots->shade_of_pixel_count,
+	              (dots->max_pixels_in_dot + 1) * sizeof(guint16));
+	calibrate_dot_sizes(dots);
+}
+
+static void luminance_kernel(gpointer data)
+{
+	struct RowData * row = (struct RowData *) data;
+	gint channels = row->channels;
+	gint index_step = row->dots->dot_spacing * channels;
+	gint x, index, phase;
+	guint sum = 0;
+
+	for (phase = 0; phase < 2; phase++) {
+		for (x = phase * row->dots->dot_spacing / 2, index = x * channels;
+		        x < IMAGE_SIZE;
+		        x += row->dots->dot_spacing, index += index_step) {
+			sum += halftone_luminance(row->pixels + index, channels);
+		}
+	}
+	luminance_sink = sum;
+}
+
+static void expand_kernel(gpointer data)
+{
+	struct RowData * row = (struct RowData *) data;
+
+	halftone_expand_row(row->pixels, IMAGE_SIZE * SCANLINE_AREA,
+	                    row->channels, row->out);
+}
+
+static void expand_mask_kernel(gpointer data)
+{
+	struct RowData * row = (struct RowData *) data;
+
+	halftone_expand_mask_row(row->pixels, IMAGE_SIZE * SCANLINE_AREA,
+	                         row->channels, row->out);
+}
+
+static void bench_size(gint dot_spacing)
+{
+	HalftoneDots * dots = halftone_dots_new(dot_spacing);
+	struct PaintData paint;
+	struct RowData row;
+	struct Timing timing;
+	gint x, channels, i, phase;
+	struct {
+		const gchar * name;
+		PaintFunc paint;
+	} painters[] = {
+		{ "paint_dot", paint_dot },
+		{ "paint_dot_fixed", NULL },
+		{ "paint_spans", paint_spans },
+		{ "paint_pixels", paint_pixels }
+	};
+
+	if (dots == NULL) {
+		g_printerr("halftone-bench: out of memory at size %d\n",
+		           dot_spacing);
+		return;
+	}
+
+	paint.dots = dots;
+	paint.image.x_size = IMAGE_SIZE;
+	paint.image.y_size = IMAGE_SIZE;
+	paint.image.pixels = g_malloc((gsize) IMAGE_SIZE * IMAGE_SIZE);
+	memset(paint.image.pixels, WHITE, (gsize) IMAGE_SIZE * IMAGE_SIZE);
+	/* A horizontal gradient, so every dot size is painted */
+	for (x = 0; x < IMAGE_SIZE; x++) {
+		paint.luminances[x] = (guint32) x * MAX_LUMINANCE16 / (IMAGE_SIZE - 1);
+	}
+	for (phase = 0; phase < 2; phase++) {
+		for (i = 0; i < row_dots(dot_spacing, phase); i++) {
+			x = phase * dot_spacing / 2 + i * dot_spacing;
+			paint.dot_luminances[phase][i] = paint.luminances[x] >> 8;
+		}
+	}
+	painters[1].paint = paint_func(dots, HALFTONE_PAINT_MASK);
+	for (i = 0; i < G_N_ELEMENTS(painters); i++) {
+		if (i > 0 && painters[i].paint == paint_dot) {
+			continue;   /* no specialized paint_dot for this size */
+		}
+		paint.paint = painters[i].paint;
+		measure(paint_dot_kernel, &paint, &timing);
+		report(painters[i].name, dot_spacing, 0, &timing,
+		       (gdouble) IMAGE_SIZE * IMAGE_SIZE, lattice_dots(dot_spacing));
+	}
+	if (dots->bitboard_masks != NULL) {
+		paint.ctx = halftone_context_new_for_dots(dots);
+		measure(paint_bitboard_kernel, &paint, &timing);
+		report("paint_bitboard", dot_spacing, 0, &timing,
+		       (gdouble) IMAGE_SIZE * IMAGE_SIZE, lattice_dots(dot_spacing));
+		/* The result bitmap is paint.image, not the context's */
+		paint.ctx->result_image.pixels = NULL;
+		halftone_context_free(paint.ctx);
+	}
+	measure(paint_fine_dot_kernel, &paint, &timing);
+	report("paint_fine_dot", dot_spacing, 0, &timing,
+	       (gdouble) IMAGE_SIZE * IMAGE_SIZE, lattice_dots(dot_spacing));
+	g_free(paint.image.pixels);
+
+	measure(precalculate_dots_kernel, dots, &timing);
+	report("precalculate_dots", dot_spacing, 0, &timing,
+	       (gdouble) dots->pixels_in_dot_bitmap * LUMINANCES, LUMINANCES);
+	measure(calibrate_dot_sizes_kernel, dots, &timing);
+	report("calibrate_dot_sizes", dot_spacing, 0, &timing,
+	       (gdouble) dot_spacing * dot_spacing, dots->max_pixels_in_dot);
+
+	row.dots = dots;
+	row.pixels = g_malloc((gsize) IMAGE_SIZE * 4);
+	for (x = 0; x < IMAGE_SIZE * 4; x++) {
+		row.pixels[x] = g_random_int_range(0, LUMINANCES);
+	}
+	for (channels = 1; channels <= 4; channels++) {
+		row.channels = channels;
+		measure(luminance_kernel, &row, &timing);
+		report("luminance", dot_spacing, channels, &timing, IMAGE_SIZE,
+		       row_dots(dot_spacing, 0) + row_dots(dot_spacing, 1));
+	}
+	g_free(row.pixels);
+
+	halftone_dots_unref(dots);
+}
+
+static void bench_expand(void)
+{
+	struct RowData row;
+	struct Timing timing;
+	gsize size = (gsize) IMAGE_SIZE * SCANLINE_AREA;
+	gsize i;
+
+	row.dots = NULL;
+	row.pixels = g_malloc(size);
+	row.out = g_malloc(size * 4);
+	for (i = 0; i < size; i++) {
+		row.pixels[i] = g_random_boolean() ? WHITE : BLACK;
+	}
+	for (row.channels = 1; row.channels <= 4; row.channels++) {
+		measure(expand_kernel, &row, &timing);
+		report("expand", 0, row.channels, &timing, size, 0);
+		measure(expand_mask_kernel, &row, &timing);
+		report("expand_mask", 0, row.channels, &timing, size, 0);
+	}
+	g_free(row.pixels);
+	g_free(row.out);
+}
+
+int main(int argc, char ** argv)
+{
+	GOptionContext * options;
+	GError * error = NULL;
+	gchar ** sizes;
+	gint i, dot_spacing;
+
+	options = g_option_context_new("- Printable Halftone kernel benchmark");
+	g_option_context_add_main_entries(options, option_entries, NULL);
+	if (!g_option_context_parse(options, &argc, &argv, &error)) {
+		g_printerr("halftone-bench: %s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(options);
+	repeats = MAX(repeats, 1);
+
+	/* Same random images on every run */
+	g_random_set_seed(1);
+
+	g_print("%-20s %5s %3s %12s %12s %12s %12s\n", "kernel", "size", "ch",
+	        "ns/pixel", "cycles/pixel", "ns/dot", "cycles/dot");
+	sizes = g_strsplit(size_list ? size_list : "2,3,4,5,6,8,10,14,20,40,100",
+	                   ",", -1);
+	for (i = 0; sizes[i] != NULL; i++) {
+		dot_spacing = atoi(sizes[i]);
+		if (dot_spacing < 2 || dot_spacing > 1000) {
+			g_printerr("halftone-bench: size must be 2 .. 1000\n");
+			g_strfreev(sizes);
+			return 1;
+		}
+		bench_size(dot_spacing);
+	}
+	g_strfreev(sizes);
+	bench_expand();
+	return 0;
+}
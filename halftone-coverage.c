@@ -0,0 +1,193 @@
+/* Printable Halftone: anti-aliased coverage rendering
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* For screen proofs the bilevel dots moiré badly when scaled. Instead of
+ * painting pixels, each dot is modeled as a disc with the same area as
+ * the bitmap dot, pixel_count_of_luminance[luminance] pixels, so its
+ * radius is sqrt(pixel_count / pi). The darkness of a pixel is the
+ * part of it the disc covers, approximated by
+ *
+ *   coverage = CLAMP(radius - distance + 0.5, 0, 1)
+ *
+ * where distance is from the dot center to the pixel center. Where dots
+ * overlap, the darker one wins, like AND does with the bilevel dots.
+ *
+ * The coverage bitmaps are precalculated per luminance like the bilevel
+ * ones. They are one pixel larger on each side, because the disc of the
+ * largest dot reaches past max_dot_width.
+ */
+#include <math.h>
+#include <string.h>
+#include "halftone.h"
+
+static gboolean precalculate_coverage(HalftoneContext * ctx);
+static void paint_coverage_dot(const HalftoneContext * ctx,
+                               struct BWBitmap * image,
+                               gint x, gint y, gint luminance);
+
+/*
+ * Renders source like halftone_context_render(), but ctx->result_image
+ * gets gray levels: WHITE - 255 * coverage by the dots.
+ * Returns FALSE if out of memory or if source->get_row fails.
+ */
+gboolean halftone_context_render_coverage(HalftoneContext * ctx,
+                                          const HalftoneSource * source)
+{
+	struct BWBitmap * result_image = &ctx->result_image;
+	gint dot_spacing = ctx->dots->dot_spacing;
+	gint channels = source->channels;
+	gint index_step = dot_spacing * channels;
+	gint x, y, index, phase;
+	guchar luminance;
+
+	if (halftone_context_prepare(ctx, source) == FALSE
+		|| precalculate_coverage(ctx) == FALSE) {
+		return FALSE;
+	}
+	memset(result_image->pixels, WHITE,
+	       (gsize) result_image->x_size * result_image->y_size);
+
+	for (phase = 0; phase < 2; phase++) {
+	for (y = phase * dot_spacing / 2;
+			y < result_image->y_size; y += dot_spacing) {
+		if (source->get_row(y, ctx->scanline, source->user_data) == FALSE) {
+			return FALSE;
+		}
+		for (x = phase * dot_spacing / 2, index = x * channels;
+		        x < result_image->x_size;
+		        x += dot_spacing, index += index_step) {
+			if (source->format == HALFTONE_FORMAT_U8) {
+				luminance = halftone_luminance(ctx->scanline + index,
+				                               channels);
+			} else {
+				luminance = halftone_luminance16(ctx->scanline, x, channels,
+				                                 source->format) / 257;
+			}
+			paint_coverage_dot(ctx, result_image, x, y, luminance);
+		}
+		if (source->progress != NULL) {
+			source->progress((gdouble)y / (gdouble)result_image->y_size
+			                 * 0.5 + (gdouble)phase * 0.5,
+			                 source->user_data);
+		}
+	}
+	}
+	return TRUE;
+}
+
+/*
+ * Bytes that halftone_context_render_coverage() takes besides
+ * halftone_render_size() of source in one piece: the coverage bitmaps.
+ */
+gsize halftone_coverage_size(const HalftoneDots * dots)
+{
+	gint width = dots->max_dot_width + 2;
+
+	return (gsize) LUMINANCES * width * width;
+}
+
+/*
+ * Builds ctx->coverage_dots for ctx->dots, unless they are already
+ * built for the same dot_spacing.
+ */
+static gboolean precalculate_coverage(HalftoneContext * ctx)
+{
+	const HalftoneDots * dots = ctx->dots;
+	gint width = dots->max_dot_width + 2;
+	gint center = dots->dot_center + 1;
+	gsize size = (gsize) LUMINANCES * width * width;
+	gdouble radius, distance, coverage;
+	guchar * bitmap;
+	gint luminance, x, y;
+
+	if (ctx->coverage_spacing == dots->dot_spacing) {
+		return TRUE;
+	}
+	if (size > ctx->coverage_allocated) {
+		halftone_free(ctx->coverage_dots, ctx->coverage_allocated);
+		ctx->coverage_dots = (guchar *) halftone_try_malloc(size);
+		ctx->coverage_allocated = ctx->coverage_dots ? size : 0;
+	}
+	if (ctx->coverage_dots == NULL) {
+		ctx->coverage_spacing = 0;
+		return FALSE;
+	}
+
+	bitmap = ctx->coverage_dots;
+	for (luminance = 0; luminance < LUMINANCES; luminance++) {
+		radius = sqrt(dots->pixel_count_of_luminance[luminance] / G_PI);
+		for (y = 0; y < width; y++) {
+			for (x = 0; x < width; x++) {
+				if (radius == 0.0) {
+					*bitmap++ = WHITE;
+					continue;
+				}
+				distance = sqrt((gdouble) ((x - center) * (x - center)
+				                           + (y - center) * (y - center)));
+				coverage = CLAMP(radius - distance + 0.5, 0.0, 1.0);
+				*bitmap++ = WHITE - (guchar) (coverage * WHITE + 0.5);
+			}
+		}
+	}
+	ctx->coverage_spacing = dots->dot_spacing;
+	return TRUE;
+}
+
+/*
+ * Like paint_dot() in halftone.c, but takes the darker of the
+ * gray levels instead of ANDing.
+ */
+static void paint_coverage_dot(const HalftoneContext * ctx,
+                               struct BWBitmap * image,
+                               gint x, gint y, gint luminance)
+{
+	gint width = ctx->dots->max_dot_width + 2;
+	gint center = ctx->dots->dot_center + 1;
+	gint in_x, in_y, out_x;
+
+	/* Beginning and end coordinates for bitmap */
+	gint in_x1 = 0;
+	gint in_y1 = 0;
+	gint in_x2 = width;
+	gint in_y2 = width;
+
+	/* Beginning and end coordinates for image */
+	gint out_x1 = x - center;
+	gint out_y1 = y - center;
+	gint out_x2 = out_x1 + width;
+	gint out_y2 = out_y1 + width;
+
+	if (out_x1 < 0) {
+		in_x1 -= out_x1;
+		out_x1 = 0;
+	}
+	if (out_y1 < 0) {
+		in_y1 -= out_y1;
+		out_y1 = 0;
+	}
+	if (out_x2 > image->x_size) {
+		in_x2 -= out_x2 - image->x_size;
+		out_x2 = image->x_size;
+	}
+	if (out_y2 > image->y_size) {
+		in_y2 -= out_y2 - image->y_size;
+		out_y2 = image->y_size;
+	}
+
+	const guchar * src = ctx->coverage_dots
+	                     + (gsize) luminance * width * width
+	                     + in_y1 * width;
+	guchar * dest = image->pixels + (gsize) out_y1 * image->x_size;
+	for (in_y = in_y1; in_y < in_y2; in_y++) {
+		for (in_x = in_x1, out_x = out_x1; in_x < in_x2; in_x++, out_x++) {
+			dest[out_x] = MIN(dest[out_x], src[in_x]);
+		}
+		src += width;
+		dest += image->x_size;
+	}
+}
@@ -0,0 +1,763 @@
+/* Printable Halftone differential tester
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* Proves that the renderer paints the same pixels as a frozen reference,
+ * bit for bit, so that faster kernels can replace slower ones safely.
+ *
+ * The reference below is the renderer as first written: both lattices
+ * walked separately, the luminance of each dot looked up and the dot
+ * painted pixel by pixel from pixels_of_dot, clipped to the image.
+ * It takes the dot tables from halftone_dots_new() as given, but uses
+ * none of precalculated_dots, pixel_order or the painting kernels,
+ * which are what optimizations change. Do not optimize it.
+ *
+ * Each test case is a random image: dot size 2 .. 100 (every size in
+ * turn), 1 .. 4 channels, 8-bit, 16-bit or float samples, noise,
+ * gradients, flat areas and out-of-range floats. Every engine in
+ * engines[] renders it and is compared with the reference:
+ *
+ *   render   halftone_context_render() of the whole image, with the
+ *            paint strategy picked by the auto-tuner, or the bitboard
+ *            at sizes 2 .. 5
+ *   mask, spans, pixels
+ *            the same with each HALFTONE_PAINT_* strategy, also at the
+ *            sizes of the bitboard
+ *   parallel halftone_context_render_parallel() on 2 .. 8 threads
+ *   region   halftone_context_render_region() of an area at odd
+ *            offsets, like a selection or a tile of a larger image
+ *   stripes  halftone_context_render_stripes() with a random height
+ *   trace    halftone_trace_dots(), painted with the reference painter
+ *
+ * New fast paths are reached through these entry points; an engine
+ * which needs its own entry point gets a line in engines[].
+ *
+ * The first mismatching pixel of a run is reported with the dot nearest
+ * to it, and the command which repeats the case. Exits with 1 if any
+ * run differs.
+ *
+ * Usage: halftone-difftest [--seed N] [--cases N] [--engine NAME]
+ */
+#include <stdio.h>
+#include <string.h>
+#include "halftone.h"
+
+#define MAX_SPACING 100
+#define DEFAULT_CASES (4 * (MAX_SPACING - 1))
+
+struct TestImage {
+	gint width;
+	gint height;
+	gint channels;
+	gint format;
+	guchar * pixels;
+	gsize row_bytes;
+};
+
+/* A rendered area of the image: result pixel (0, 0) is image pixel
+ * (x, y) */
+struct TestResult {
+	gint x;
+	gint y;
+	struct BWBitmap bitmap;
+};
+
+/* Source of width pixels per row from image, starting at image pixel
+ * (x, y). White outside the image. */
+struct WindowSource {
+	const struct TestImage * image;
+	gint x;
+	gint y;
+	gint width;
+};
+
+
+typedef gboolean (* EngineFunc) (HalftoneContext * ctx,
+                                 const struct TestImage * image,
+                                 GRand * rand, struct TestResult * result);
+
+struct Engine {
+	const gchar * name;
+	EngineFunc render;
+};
+
+static gboolean render_whole(HalftoneContext * ctx,
+                             const struct TestImage * image,
+                             GRand * rand, struct TestResult * result);
+static gboolean render_mask(HalftoneContext * ctx,
+                            const struct TestImage * image,
+                            GRand * rand, struct TestResult * result);
+static gboolean render_spans(HalftoneContext * ctx,
+                             const struct TestImage * image,
+                             GRand * rand, struct TestResult * result);
+static gboolean render_pixels(HalftoneContext * ctx,
+                              const struct TestImage * image,
+                              GRand * rand, struct TestResult * result);
+static gboolean render_parallel(HalftoneContext * ctx,
+                                const struct TestImage * image,
+                                GRand * rand, struct TestResult * result);
+static gboolean render_region(HalftoneContext * ctx,
+                              const struct TestImage * image,
+                              GRand * rand, struct TestResult * result);
+static gboolean render_stripes(HalftoneContext * ctx,
+                               const struct TestImage * image,
+                               GRand * rand, struct TestResult * result);
+static gboolean render_trace(HalftoneContext * ctx,
+                             const struct TestImage * image,
+                             GRand * rand, struct TestResult * result);
+
+static const struct Engine engines[] = {
+	{ "render", render_whole },
+	{ "mask", render_mask },
+	{ "spans", render_spans },
+	{ "pixels", render_pixels },
+	{ "parallel", render_parallel },
+	{ "region", render_region },
+	{ "stripes", render_stripes },
+	{ "trace", render_trace },
+	{ NULL, NULL }
+};
+
+static const gchar * format_names[] = { "8-bit", "16-bit", "float" };
+
+static gint base_seed = 1;
+static gint cases = DEFAULT_CASES;
+static gchar * engine_name = NULL;
+
+static GOptionEntry option_entries[] =
+{
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &base_seed,
+	  "Seed of the first case; case n uses seed + n (default 1)", "N" },
+	{ "cases", 'n', 0, G_OPTION_ARG_INT, &cases,
+	  "Number of test cases (default 396)", "N" },
+	{ "engine", 'e', 0, G_OPTION_ARG_STRING, &engine_name,
+	  "Test only this engine", "NAME" },
+	{ NULL }
+};
+
+/* Frozen copies of the luminance formulas in halftone.h */
+static guint reference_luminance(const struct TestImage * image,
+                                 gint x, gint y)
+{
+	const guchar * row = image->pixels + (gsize) y * image->row_bytes;
+	const guint16 * pixel16;
+	const gfloat * pixel_float;
+	gfloat luminance;
+
+	switch (image->format) {
+	case HALFTONE_FORMAT_U16:
+		pixel16 = (const guint16 *) row + x * image->channels;
+		if (image->channels < 3) {
+			return pixel16[0];
+		}
+		return (30 * pixel16[0] + 59 * pixel16[1] + 11 * pixel16[2]) / 100;
+	case HALFTONE_FORMAT_FLOAT:
+		pixel_float = (const gfloat *) row + x * image->channels;
+		if (image->channels < 3) {
+			luminance = pixel_float[0];
+		} else {
+			luminance = 0.30f * pixel_float[0] + 0.59f * pixel_float[1]
+			            + 0.11f * pixel_float[2];
+		}
+		if (!(luminance > 0.0f)) {
+			return 0;
+		}
+		if (luminance >= 1.0f) {
+			return MAX_LUMINANCE16;
+		}
+		return (guint) (luminance * MAX_LUMINANCE16 + 0.5f);
+	default:
+		row += x * image->channels;
+		if (image->channels < 3) {
+			return row[0];
+		}
+		return (30 * row[0] + 59 * row[1] + 11 * row[2]) / 100;
+	}
+}
+
+/* Dot size of the pixel at (x, y). 16-bit and float luminances get the
+ * dot size whose shade is nearest, the darker one of equally near. */
+static gint reference_pixel_count(const HalftoneDots * dots,
+                                  const struct TestImage * image,
+                                  gint x, gint y)
+{
+	guint luminance = reference_luminance(image, x, y);
+	const guint16 * shade = dots->shade_of_pixel_count;
+	gint n;
+
+	if (image->format == HALFTONE_FORMAT_U8) {
+		return dots->pixel_count_of_luminance[luminance];
+	}
+	for (n = 0; n < dots->max_pixels_in_dot; n++) {
+		if (shade[n] <= luminance) {
+			break;
+		}
+	}
+	if (n > 0 && (gint) shade[n - 1] - (gint) luminance
+	             < (gint) luminance - (gint) shade[n]) {
+		n--;
+	}
+	return n;
+}
+
+/* The original paint_dot(): pixel_count nearest pixels of the dot
+ * centered at (x, y), one at a time */
+static void reference_paint_dot(const HalftoneDots * dots,
+                                struct BWBitmap * image,
+                                gint x, gint y, gint pixel_count)
+{
+	gint n, out_x, out_y;
+
+	for (n = 0; n < pixel_count; n++) {
+		out_x = x + dots->pixels_of_dot[n].x_position;
+		out_y = y + dots->pixels_of_dot[n].y_position;
+		if (out_x >= 0 && out_x < image->x_size
+			&& out_y >= 0 && out_y < image->y_size) {
+			image->pixels[out_y * image->x_size + out_x] = BLACK;
+		}
+	}
+}
+
+static void reference_render(const HalftoneDots * dots,
+                             const struct TestImage * image,
+                             struct BWBitmap * result)
+{
+	gint dot_spacing = dots->dot_spacing;
+	gint x, y;
+
+	result->x_size = image->width;
+	result->y_size = image->height;
+	result->pixels = g_malloc((gsize) image->width * image->height);
+	memset(result->pixels, WHITE, (gsize) image->width * image->height);
+
+	for (y = 0; y < image->height; y += dot_spacing) {
+		for (x = 0; x < image->width; x += dot_spacing) {
+			reference_paint_dot(dots, result, x, y,
+			                    reference_pixel_count(dots, image, x, y));
+		}
+	}
+	for (y = dot_spacing / 2; y < image->height; y += dot_spacing) {
+		for (x = dot_spacing / 2; x < image->width; x += dot_spacing) {
+			reference_paint_dot(dots, result, x, y,
+			                    reference_pixel_count(dots, image, x, y));
+		}
+	}
+}
+
+static void set_sample(struct TestImage * image, gint x, gint y, gint c,
+                       gdouble value)
+{
+	guchar * row = image->pixels + (gsize) y * image->row_bytes;
+	gsize index = (gsize) x * image->channels + c;
+
+	switch (image->format) {
+	case HALFTONE_FORMAT_U16:
+		((guint16 *) row)[index] = (guint16) (CLAMP(value, 0.0, 1.0)
+		                                      * MAX_LUMINANCE16 + 0.5);
+		break;
+	case HALFTONE_FORMAT_FLOAT:
+		((gfloat *) row)[index] = (gfloat) value;
+		break;
+	default:
+		row[index] = (guchar) (CLAMP(value, 0.0, 1.0) * WHITE + 0.5);
+		break;
+	}
+}
+
+/* Sample 0.0 .. 1.0 of pattern at (x, y). Floats may also get values
+ * outside the range, and NaN, which the renderer must clamp. */
+static gdouble pattern_sample(GRand * rand, gint pattern,
+                              const struct TestImage * image,
+                              gint x, gint y, gdouble flat)
+{
+	switch (pattern) {
+	case 0:     /* noise */
+		return g_rand_int_range(rand, 0, 65536) / 65535.0;
+	case 1:     /* gradient */
+		return (gdouble) x / MAX(image->width - 1, 1);
+	case 2:     /* gradient */
+		return (gdouble) y / MAX(image->height - 1, 1);
+	case 3:     /* black, white and flat gray */
+		switch (g_rand_int_range(rand, 0, 8)) {
+		case 0:
+			return 0.0;
+		case 1:
+			return 1.0;
+		default:
+			return flat;
+		}
+	default:    /* noise out of range */
+		if (image->format == HALFTONE_FORMAT_FLOAT
+			&& g_rand_int_range(rand, 0, 16) == 0) {
+			return g_rand_int_range(rand, 0, 2) ? 0.0 / 0.0 : -0.5;
+		}
+		return g_rand_int_range(rand, -16384, 65536 + 16384) / 65535.0;
+	}
+}
+
+static void make_image(GRand * rand, gint dot_spacing,
+                       struct TestImage * image)
+{
+	gint pattern = g_rand_int_range(rand, 0, 5);
+	gdouble flat = g_rand_int_range(rand, 0, 65536) / 65535.0;
+	gint x, y, c;
+
+	/* From smaller than one dot to a few dots more than one lattice
+	 * cell, so that images end in every phase of the lattice */
+	image->width = g_rand_int_range(rand, 1, 3 * dot_spacing + 24);
+	image->height = g_rand_int_range(rand, 1, 3 * dot_spacing + 24);
+	image->channels = g_rand_int_range(rand, 1, 5);
+	image->format = g_rand_int_range(rand, HALFTONE_FORMAT_U8,
+	                                  HALFTONE_FORMAT_FLOAT + 1);
+	image->row_bytes = (gsize) image->width * image->channels
+	                   * halftone_sample_size(image->format);
+	image->pixels = g_malloc(image->row_bytes * image->height);
+
+	for (y = 0; y < image->height; y++) {
+		for (x = 0; x < image->width; x++) {
+			for (c = 0; c < image->channels; c++) {
+				set_sample(image, x, y, c,
+				           pattern_sample(rand, pattern, image, x, y, flat));
+			}
+		}
+	}
+}
+
+static void init_source(HalftoneSource * source, HalftoneBuffer * buffer,
+                        const struct TestImage * image)
+{
+	halftone_source_init_buffer(source, buffer, image->pixels,
+	                            image->width, image->height,
+	                            image->channels, image->format);
+}
+
+static gboolean copy_result(HalftoneContext * ctx, struct TestResult * result)
+{
+	gsize size = (gsize) ctx->result_image.x_size * ctx->result_image.y_size;
+
+	result->bitmap.x_size = ctx->result_image.x_size;
+	result->bitmap.y_size = ctx->result_image.y_size;
+	result->bitmap.pixels = g_malloc(size);
+	memcpy(result->bitmap.pixels, ctx->result_image.pixels, size);
+	return TRUE;
+}
+
+static gboolean render_whole(HalftoneContext * ctx,
+                             const struct TestImage * image,
+                             GRand * rand, struct TestResult * result)
+{
+	HalftoneSource source;
+	HalftoneBuffer buffer;
+
+	init_source(&source, &buffer, image);
+	if (halftone_context_render(ctx, &source) == FALSE) {
+		return FALSE;
+	}
+	result->x = 0;
+	result->y = 0;
+	return copy_result(ctx, result);
+}
+
+static gboolean render_parallel(HalftoneContext * ctx,
+                                const struct TestImage * image,
+                                GRand * rand, struct TestResult * result)
+{
+	HalftoneSource source;
+	HalftoneBuffer buffer;
+
+	init_source(&source, &buffer, image);
+	if (halftone_context_render_parallel(ctx, &source,
+	                                     g_rand_int_range(rand, 2, 9))
+	        == FALSE) {
+		return FALSE;
+	}
+	result->x = 0;
+	result->y = 0;
+	return copy_result(ctx, result);
+}
+
+static void write_white(guchar * pixel, gint channels, gint format)
+{
+	gint c;
+
+	for (c = 0; c < channels; c++) {
+		switch (format) {
+		case HALFTONE_FORMAT_U16:
+			((guint16 *) pixel)[c] = MAX_LUMINANCE16;
+			break;
+		case HALFTONE_FORMAT_FLOAT:
+			((gfloat *) pixel)[c] = 1.0f;
+			break;
+		default:
+			pixel[c] = WHITE;
+			break;
+		}
+	}
+}
+
+/* render_whole() with dots painted by strategy, not on the bitboard.
+ * The tables are owned by this program, so changing them for a moment
+ * is safe. */
+static gboolean render_strategy(HalftoneContext * ctx,
+                                const struct TestImage * image,
+                                GRand * rand, struct TestResult * result,
+                                gint strategy)
+{
+	gint tuned = ctx->dots->paint_strategy;
+	guint64 * bitboard_masks = ctx->dots->bitboard_masks;
+	gboolean ok;
+
+	ctx->dots->paint_strategy = strategy;
+	ctx->dots->bitboard_masks = NULL;
+	ok = render_whole(ctx, image, rand, result);
+	ctx->dots->paint_strategy = tuned;
+	ctx->dots->bitboard_masks = bitboard_masks;
+	return ok;
+}
+
+static gboolean render_mask(HalftoneContext * ctx,
+                            const struct TestImage * image,
+                            GRand * rand, struct TestResult * result)
+{
+	return render_strategy(ctx, image, rand, result, HALFTONE_PAINT_MASK);
+}
+
+static gboolean render_spans(HalftoneContext * ctx,
+                             const struct TestImage * image,
+                             GRand * rand, struct TestResult * result)
+{
+	return render_strategy(ctx, image, rand, result, HALFTONE_PAINT_SPANS);
+}
+
+static gboolean render_pixels(HalftoneContext * ctx,
+                              const struct TestImage * image,
+                              GRand * rand, struct TestResult * result)
+{
+	return render_strategy(ctx, image, rand, result, HALFTONE_PAINT_PIXELS);
+}
+
+static gboolean get_window_row(gint y, guchar * row, gpointer user_data)
+{
+	struct WindowSource * window = (struct WindowSource *) user_data;
+	const struct TestImage * image = window->image;
+	gsize pixel_size = image->channels * halftone_sample_size(image->format);
+	gint x, image_x;
+
+	y += window->y;
+	for (x = 0; x < window->width; x++, row += pixel_size) {
+		image_x = window->x + x;
+		if (y < 0 || y >= image->height
+			|| image_x < 0 || image_x >= image->width) {
+			write_white(row, image->channels, image->format);
+		} else {
+			memcpy(row, image->pixels + (gsize) y * image->row_bytes
+			            + image_x * pixel_size, pixel_size);
+		}
+	}
+	return TRUE;
+}
+
+/* An area of one pixel or more inside the image, at odd offsets when
+ * the image has room for them */
+static gboolean render_region(HalftoneContext * ctx,
+                              const struct TestImage * image,
+                              GRand * rand, struct TestResult * result)
+{
+	struct WindowSource window;
+	HalftoneSource source;
+	gint margin = halftone_region_margin(ctx->dots);
+	gint x, y, width, height;
+
+	x = g_rand_int_range(rand, 0, image->width) | 1;
+	y = g_rand_int_range(rand, 0, image->height) | 1;
+	x = MIN(x, image->width - 1);
+	y = MIN(y, image->height - 1);
+	width = g_rand_int_range(rand, 1, image->width - x + 1);
+	height = g_rand_int_range(rand, 1, image->height - y + 1);
+
+	window.image = image;
+	window.x = x - margin;
+	window.y = y - margin;
+	window.width = width + 2 * margin;
+	source.width = width + 2 * margin;
+	source.height = height + 2 * margin;
+	source.channels = image->channels;
+	source.format = image->format;
+	source.get_row = get_window_row;
+	source.progress = NULL;
+	source.user_data = &window;
+
+	if (halftone_context_render_region(ctx, &source, x, y,
+	                                   width, height) == FALSE) {
+		return FALSE;
+	}
+	result->x = x;
+	result->y = y;
+	return copy_result(ctx, result);
+}
+
+static gboolean copy_stripe(gint y, const struct BWBitmap * stripe,
+                            gpointer user_data)
+{
+	struct BWBitmap * bitmap = (struct BWBitmap *) user_data;
+
+	if (stripe->x_size != bitmap->x_size
+		|| y + stripe->y_size > bitmap->y_size) {
+		return FALSE;
+	}
+	memcpy(bitmap->pixels + (gsize) y * bitmap->x_size, stripe->pixels,
+	       (gsize) stripe->x_size * stripe->y_size);
+	return TRUE;
+}
+
+static gboolean render_stripes(HalftoneContext * ctx,
+                               const struct TestImage * image,
+                               GRand * rand, struct TestResult * result)
+{
+	HalftoneSource source;
+	HalftoneBuffer buffer;
+	gint stripe_height = g_rand_int_range(rand, 1, image->height + 1);
+
+	init_source(&source, &buffer, image);
+	result->x = 0;
+	result->y = 0;
+	result->bitmap.x_size = image->width;
+	result->bitmap.y_size = image->height;
+	result->bitmap.pixels = g_malloc((gsize) image->width * image->height);
+	return halftone_context_render_stripes(ctx, &source, stripe_height,
+	                                       copy_stripe, &result->bitmap);
+}
+
+struct TracePaint {
+	const HalftoneDots * dots;
+	struct BWBitmap * bitmap;
+};
+
+static gboolean paint_traced_dot(gint x, gint y, gint pixel_count,
+                                 gpointer user_data)
+{
+	struct TracePaint * paint = (struct TracePaint *) user_data;
+
+	reference_paint_dot(paint->dots, paint->bitmap, x, y, pixel_count);
+	return TRUE;
+}
+
+static gboolean render_trace(HalftoneContext * ctx,
+                             const struct TestImage * image,
+                             GRand * rand, struct TestResult * result)
+{
+	HalftoneSource source;
+	HalftoneBuffer buffer;
+	struct TracePaint paint;
+	gsize size = (gsize) image->width * image->height;
+
+	init_source(&source, &buffer, image);
+	result->x = 0;
+	result->y = 0;
+	result->bitmap.x_size = image->width;
+	result->bitmap.y_size = image->height;
+	result->bitmap.pixels = g_malloc(size);
+	memset(result->bitmap.pixels, WHITE, size);
+	paint.dots = ctx->dots;
+	paint.bitmap = &result->bitmap;
+	return halftone_trace_dots(ctx->dots, &source, paint_traced_dot, &paint);
+}
+
+/* Of the lattice points of both phases, the one nearest to (x, y) */
+static void nearest_dot(gint dot_spacing, gint x, gint y,
+                        gint * dot_x, gint * dot_y)
+{
+	gint phase, offset, cx, cy, distance;
+	gint best = G_MAXINT;
+
+	for (phase = 0; phase < 2; phase++) {
+		offset = phase * dot_spacing / 2;
+		cx = offset + (x - offset + dot_spacing / 2) / dot_spacing
+		     * dot_spacing;
+		cy = offset + (y - offset + dot_spacing / 2) / dot_spacing
+		     * dot_spacing;
+		if (x < offset) {
+			cx = offset;
+		}
+		if (y < offset) {
+			cy = offset;
+		}
+		distance = (cx - x) * (cx - x) + (cy - y) * (cy - y);
+		if (distance < best) {
+			best = distance;
+			*dot_x = cx;
+			*dot_y = cy;
+		}
+	}
+}
+
+/*
+ * Compares result with the same area of expected. Reports the first
+ * differing pixel and the dot nearest to it.
+ * Returns the number of differing pixels.
+ */
+static gsize compare(const HalftoneDots * dots,
+                     const struct TestImage * image,
+                     const struct BWBitmap * expected,
+                     const struct TestResult * result,
+                     const gchar * engine, gint seed)
+{
+	const struct BWBitmap * bitmap = &result->bitmap;
+	gint x, y, dot_x = 0, dot_y = 0;
+	guchar want, got;
+	gsize differing = 0;
+	gint first_x = 0, first_y = 0;
+
+	for (y = 0; y < bitmap->y_size; y++) {
+		for (x = 0; x < bitmap->x_size; x++) {
+			want = expected->pixels[(gsize) (result->y + y) * expected->x_size
+			                        + result->x + x];
+			got = bitmap->pixels[(gsize) y * bitmap->x_size + x];
+			if (want != got) {
+				if (differing == 0) {
+					first_x = result->x + x;
+					first_y = result->y + y;
+				}
+				differing++;
+			}
+		}
+	}
+	if (differing == 0) {
+		return 0;
+	}
+
+	want = expected->pixels[(gsize) first_y * expected->x_size + first_x];
+	got = bitmap->pixels[(gsize) (first_y - result->y) * bitmap->x_size
+	                     + first_x - result->x];
+	g_print("halftone-difftest: %s differs from the reference "
+	        "in %" G_GSIZE_FORMAT " pixels\n", engine, differing);
+	g_print("  size %d, %dx%d, %d channels, %s",
+	        dots->dot_spacing, image->width, image->height,
+	        image->channels, format_names[image->format]);
+	if (bitmap->x_size != image->width || bitmap->y_size != image->height) {
+		g_print(", area %d,%d %dx%d", result->x, result->y,
+		        bitmap->x_size, bitmap->y_size);
+	}
+	g_print("\n  first at pixel %d,%d: expected %d, got %d\n",
+	        first_x, first_y, want, got);
+	nearest_dot(dots->dot_spacing, first_x, first_y, &dot_x, &dot_y);
+	if (dot_x < image->width && dot_y < image->height) {
+		g_print("  nearest dot at %d,%d: luminance %u, %d pixels of %d\n",
+		        dot_x, dot_y, reference_luminance(image, dot_x, dot_y),
+		        reference_pixel_count(dots, image, dot_x, dot_y),
+		        dots->max_pixels_in_dot);
+	} else {
+		g_print("  nearest dot at %d,%d is outside the image\n",
+		        dot_x, dot_y);
+	}
+	g_print("  repeat with: halftone-difftest --seed %d --cases 1 "
+	        "--engine %s\n", seed, engine);
+	return differing;
+}
+
+/*
+ * Renders one random image with every engine.
+ * Returns the number of engines which differ from the reference.
+ */
+static gint run_case(gint seed, gint dot_spacing, gint * runs)
+{
+	GRand * rand = g_rand_new_with_seed(seed);
+	HalftoneDots * dots;
+	HalftoneContext * ctx;
+	struct TestImage image;
+	struct BWBitmap expected;
+	struct TestResult result;
+	const struct Engine * engine;
+	gint failed = 0;
+
+	dots = halftone_dots_cache_get(dot_spacing);
+	if (dots == NULL) {
+		g_printerr("halftone-difftest: out of memory\n");
+		g_rand_free(rand);
+		return 1;
+	}
+	ctx = halftone_context_new_for_dots(dots);
+	make_image(rand, dot_spacing, &image);
+	reference_render(dots, &image, &expected);
+
+	for (engine = engines; engine->name != NULL; engine++) {
+		if (engine_name != NULL && strcmp(engine_name, engine->name) != 0) {
+			continue;
+		}
+		result.bitmap.pixels = NULL;
+		if (ctx == NULL || engine->render(ctx, &image, rand,
+		                                  &result) == FALSE) {
+			g_print("halftone-difftest: %s failed, size %d, seed %d\n",
+			        engine->name, dot_spacing, seed);
+			failed++;
+		} else if (compare(dots, &image, &expected, &result,
+		                   engine->name, seed) > 0) {
+			failed++;
+		}
+		g_free(result.bitmap.pixels);
+		(*runs)++;
+	}
+
+	g_free(expected.pixels);
+	g_free(image.pixels);
+	if (ctx != NULL) {
+		halftone_context_free(ctx);
+	}
+	halftone_dots_unref(dots);
+	g_rand_free(rand);
+	return failed;
+}
+
+int main(int argc, char ** argv)
+{
+	GOptionContext * options;
+	GError * error = NULL;
+	const struct Engine * engine;
+	gint i, dot_spacing, failed = 0, runs = 0;
+
+	options = g_option_context_new("- compare the renderer with a "
+	                               "reference, bit for bit");
+	g_option_context_add_main_entries(options, option_entries, NULL);
+	if (!g_option_context_parse(options, &argc, &argv, &error)) {
+		g_printerr("halftone-difftest: %s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(options);
+	/* Tune in memory only, the user's profile is left alone */
+	halftone_tune_set_profile(NULL);
+	if (engine_name != NULL) {
+		for (engine = engines; engine->name != NULL; engine++) {
+			if (strcmp(engine_name, engine->name) == 0) {
+				break;
+			}
+		}
+		if (engine->name == NULL) {
+			g_printerr("halftone-difftest: unknown engine %s\n",
+			           engine_name);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < cases; i++) {
+		/* Every size in turn, so that a run of 99 cases has them all */
+		dot_spacing = 2 + (base_seed + i - 1) % (MAX_SPACING - 1);
+		if (dot_spacing < 2) {
+			dot_spacing += MAX_SPACING - 1;
+		}
+		failed += run_case(base_seed + i, dot_spacing, &runs);
+	}
+	/* Everything the renderer allocated must be freed by now */
+	halftone_dots_cache_clear();
+	if (halftone_memory_in_use() != 0) {
+		g_print("halftone-difftest: %" G_GSIZE_FORMAT " bytes of renderer "
+		        "memory not freed\n", halftone_memory_in_use());
+		failed++;
+	}
+	g_print("halftone-difftest: %d cases, %d runs, %d differ\n",
+	        cases, runs, failed);
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,264 @@
+/* Printable Halftone: dot diffusion engine
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* Donald E. Knuth. 1987. Digital halftones by dot diffusion.
+ * ACM Trans. Graph. 6, 4 (Oct. 1987), 245-273.
+ *
+ * The image is tiled with an 8x8 class matrix. Pixels are processed
+ * class by class: each pixel is set black or white, and its error is
+ * spread to those of its eight neighbors which have a higher class
+ * (orthogonal neighbors get twice the weight of diagonal ones).
+ *
+ * Pixels of one class are 8 pixels apart, so no two of them share a
+ * neighbor. All pixels of a class are processed in parallel by
+ * splitting the rows of class matrix tiles between the threads;
+ * the threads meet at a barrier between classes.
+ */
+#include <string.h>
+#include "halftone.h"
+
+#define CLASS_SIZE 8
+#define CLASSES (CLASS_SIZE * CLASS_SIZE)
+
+/* Values are luminances in 1/16 units, so that the error
+ * is spread without much rounding loss. */
+#define VALUE_SCALE 16
+#define THRESHOLD (128 * VALUE_SCALE)
+
+/* Knuth's class matrix */
+static const guchar class_matrix[CLASS_SIZE][CLASS_SIZE] = {
+	{ 34, 48, 40, 32, 29, 15, 23, 31 },
+	{ 42, 58, 56, 53, 21,  5,  7, 10 },
+	{ 50, 62, 61, 45, 13,  1,  2, 18 },
+	{ 38, 46, 54, 37, 25, 17,  9, 26 },
+	{ 28, 14, 22, 30, 35, 49, 41, 33 },
+	{ 20,  4,  6, 11, 43, 59, 57, 52 },
+	{ 12,  0,  3, 19, 51, 63, 60, 44 },
+	{ 24, 16,  8, 27, 39, 47, 55, 36 }
+};
+
+/* Where the pixels of one class are and which neighbors
+ * receive their error */
+struct DiffusionClass {
+	gint x;
+	gint y;
+	gint neighbor_count;
+	gint dx[8];
+	gint dy[8];
+	gint weight[8];
+	gint weight_sum;
+};
+
+struct DiffusionJob {
+	gint16 * values;
+	struct BWBitmap * result_image;
+	const HalftoneSource * source;
+	struct DiffusionClass classes[CLASSES];
+};
+
+static void init_classes(struct DiffusionClass * classes);
+static gboolean read_values(HalftoneContext * ctx,
+                            const HalftoneSource * source);
+static void diffuse_class(struct DiffusionJob * job,
+                          const struct DiffusionClass * class,
+                          gint first_tile_row, gint last_tile_row);
+static void diffuse_team(HalftoneTeam * team, gint index, gpointer data);
+
+/*
+ * Renders source with dot diffusion into ctx->result_image.
+ * Returns FALSE if out of memory or if source->get_row fails.
+ */
+gboolean halftone_context_render_diffusion(HalftoneContext * ctx,
+                                           const HalftoneSource * source,
+                                           gint threads)
+{
+	struct DiffusionJob job;
+	gint tile_rows;
+
+	if (halftone_context_prepare(ctx, source) == FALSE
+		|| read_values(ctx, source) == FALSE) {
+		return FALSE;
+	}
+
+	tile_rows = (source->height + CLASS_SIZE - 1) / CLASS_SIZE;
+	if (threads <= 0) {
+		threads = g_get_num_processors();
+	}
+	threads = CLAMP(threads, 1, tile_rows);
+
+	job.values = ctx->diffusion_values;
+	job.result_image = &ctx->result_image;
+	job.source = source;
+	init_classes(job.classes);
+
+	/* The calling thread is member 0 */
+	halftone_team_run(threads, diffuse_team, &job);
+	return TRUE;
+}
+
+/*
+ * Finds the position of each class in the matrix and its neighbors
+ * of higher class.
+ */
+static void init_classes(struct DiffusionClass * classes)
+{
+	struct DiffusionClass * class;
+	gint x, y, dx, dy, neighbor;
+
+	for (y = 0; y < CLASS_SIZE; y++) {
+		for (x = 0; x < CLASS_SIZE; x++) {
+			class = &classes[class_matrix[y][x]];
+			class->x = x;
+			class->y = y;
+			class->neighbor_count = 0;
+			class->weight_sum = 0;
+			for (dy = -1; dy <= 1; dy++) {
+				for (dx = -1; dx <= 1; dx++) {
+					neighbor = class_matrix[(y + dy) & (CLASS_SIZE - 1)]
+					                       [(x + dx) & (CLASS_SIZE - 1)];
+					if (neighbor <= class_matrix[y][x]) {
+						continue;
+					}
+					class->dx[class->neighbor_count] = dx;
+					class->dy[class->neighbor_count] = dy;
+					class->weight[class->neighbor_count] =
+						(dx == 0 || dy == 0) ? 2 : 1;
+					class->weight_sum += class->weight[class->neighbor_count];
+					class->neighbor_count++;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Bytes that halftone_context_render_diffusion() takes besides
+ * halftone_render_size() of source in one piece: a value per pixel.
+ */
+gsize halftone_diffusion_size(const HalftoneSource * source)
+{
+	return (gsize) source->width * source->height * sizeof(gint16)
+	       + HALFTONE_ARENA_ALIGNMENT;
+}
+
+/*
+ * Reads the luminances of source into ctx->diffusion_values.
+ */
+static gboolean read_values(HalftoneContext * ctx,
+                            const HalftoneSource * source)
+{
+	gsize size = (gsize) source->width * source->height;
+	gint16 * values;
+	gint x, y, index;
+
+	ctx->diffusion_values = (gint16 *) halftone_arena_alloc(&ctx->arena,
+	        size * sizeof(gint16));
+	if (ctx->diffusion_values == NULL) {
+		return FALSE;
+	}
+	values = ctx->diffusion_values;
+	for (y = 0; y < source->height; y++) {
+		if (source->get_row(y, ctx->scanline, source->user_data) == FALSE) {
+			return FALSE;
+		}
+		for (x = 0, index = 0; x < source->width;
+		        x++, index += source->channels) {
+			if (source->format == HALFTONE_FORMAT_U8) {
+				*values++ = VALUE_SCALE
+				            * halftone_luminance(ctx->scanline + index,
+				                                 source->channels);
+			} else {
+				*values++ = WHITE * VALUE_SCALE
+				            * halftone_luminance16(ctx->scanline, x,
+				                                   source->channels,
+				                                   source->format)
+				            / MAX_LUMINANCE16;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Processes the pixels of one class in class matrix tile rows
+ * first_tile_row .. last_tile_row - 1.
+ */
+static void diffuse_class(struct DiffusionJob * job,
+                          const struct DiffusionClass * class,
+                          gint first_tile_row, gint last_tile_row)
+{
+	gint width = job->result_image->x_size;
+	gint height = job->result_image->y_size;
+	gint16 * values = job->values;
+	guchar * pixels = job->result_image->pixels;
+	gint x, y, n, nx, ny, value, error, weight_sum;
+	gsize index;
+
+	for (y = first_tile_row * CLASS_SIZE + class->y;
+	        y < last_tile_row * CLASS_SIZE && y < height; y += CLASS_SIZE) {
+		for (x = class->x; x < width; x += CLASS_SIZE) {
+			index = (gsize) y * width + x;
+			value = values[index];
+			if (value < THRESHOLD) {
+				pixels[index] = BLACK;
+				error = value;
+			} else {
+				pixels[index] = WHITE;
+				error = value - WHITE * VALUE_SCALE;
+			}
+			if (error == 0 || class->neighbor_count == 0) {
+				continue;
+			}
+
+			if (x > 0 && y > 0 && x < width - 1 && y < height - 1) {
+				for (n = 0; n < class->neighbor_count; n++) {
+					values[index + class->dy[n] * width + class->dx[n]] +=
+						error * class->weight[n] / class->weight_sum;
+				}
+				continue;
+			}
+
+			/* At the image edges, only neighbors inside the image count */
+			weight_sum = 0;
+			for (n = 0; n < class->neighbor_count; n++) {
+				nx = x + class->dx[n];
+				ny = y + class->dy[n];
+				if (nx >= 0 && ny >= 0 && nx < width && ny < height) {
+					weight_sum += class->weight[n];
+				}
+			}
+			for (n = 0; n < class->neighbor_count && weight_sum > 0; n++) {
+				nx = x + class->dx[n];
+				ny = y + class->dy[n];
+				if (nx >= 0 && ny >= 0 && nx < width && ny < height) {
+					values[index + class->dy[n] * width + class->dx[n]] +=
+						error * class->weight[n] / weight_sum;
+				}
+			}
+		}
+	}
+}
+
+static void diffuse_team(HalftoneTeam * team, gint index, gpointer data)
+{
+	struct DiffusionJob * job = (struct DiffusionJob *) data;
+	gint tile_rows = (job->result_image->y_size + CLASS_SIZE - 1)
+	                 / CLASS_SIZE;
+	gint first = tile_rows * index / team->thread_count;
+	gint last = tile_rows * (index + 1) / team->thread_count;
+	gint class;
+
+	for (class = 0; class < CLASSES; class++) {
+		diffuse_class(job, &job->classes[class], first, last);
+		halftone_team_barrier(team);
+		if (index == 0 && job->source->progress != NULL) {
+			job->source->progress((gdouble) (class + 1) / CLASSES,
+			                      job->source->user_data);
+		}
+	}
+}
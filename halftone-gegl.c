@@ -0,0 +1,142 @@
+/* Printable Halftone: GEGL operation for GIMP 2.10 and newer
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* An area filter: GEGL asks for one rectangle of the result at a time,
+ * possibly from several threads, and hands in the input grown by the
+ * area margins. The margins are dot_center, the farthest a dot reaches
+ * from its center. The dot lattice is anchored at the buffer origin
+ * (see halftone_context_render_region()), so the rectangles fit
+ * together without seams.
+ *
+ * The input is read as Y' float, which babl converts from any format
+ * the graph has, so high bit depth images keep every dot size.
+ * GIMP lists it in Tools > GEGL Operation... as "printable-halftone:dots".
+ */
+#ifdef GEGL_PROPERTIES
+
+property_int (size, "Size", 8)
+    description ("Distance between dots in pixels")
+    value_range (2, 1000)
+    ui_range    (2, 100)
+
+#else
+
+#define GEGL_OP_AREA_FILTER
+#define GEGL_OP_NAME     printable_halftone
+#define GEGL_OP_C_SOURCE halftone-gegl.c
+
+#include "gegl-op.h"
+#include "halftone.h"
+
+static void prepare (GeglOperation *operation)
+{
+  GeglOperationAreaFilter *area = GEGL_OPERATION_AREA_FILTER (operation);
+  GeglProperties          *o    = GEGL_PROPERTIES (operation);
+  HalftoneDots            *dots;
+  gint                     margin = 0;
+
+  /* process() needs the tables anyway; if out of memory, it fails */
+  dots = halftone_dots_cache_get (o->size);
+  if (dots != NULL)
+    {
+      margin = halftone_region_margin (dots);
+      halftone_dots_unref (dots);
+    }
+  area->left = area->right = area->top = area->bottom = margin;
+
+  gegl_operation_set_format (operation, "input",
+                             babl_format ("Y' float"));
+  gegl_operation_set_format (operation, "output",
+                             babl_format ("Y' u8"));
+}
+
+/* Dots centered near the edges would grow the image; keep its size */
+static GeglRectangle get_bounding_box (GeglOperation *operation)
+{
+  GeglRectangle *in_rect;
+
+  in_rect = gegl_operation_source_get_bounding_box (operation, "input");
+  if (in_rect != NULL)
+    return *in_rect;
+  return *GEGL_RECTANGLE (0, 0, 0, 0);
+}
+
+static gboolean process (GeglOperation       *operation,
+                         GeglBuffer          *input,
+                         GeglBuffer          *output,
+                         const GeglRectangle *result,
+                         gint                 level)
+{
+  GeglProperties  *o = GEGL_PROPERTIES (operation);
+  HalftoneDots    *dots;
+  HalftoneContext *ctx = NULL;
+  HalftoneSource   source;
+  HalftoneBuffer   buffer;
+  GeglRectangle    source_rect;
+  gfloat          *pixels = NULL;
+  gint             margin;
+  gboolean         ok = FALSE;
+
+  dots = halftone_dots_cache_get (o->size);
+  if (dots == NULL)
+    return FALSE;
+  margin = halftone_region_margin (dots);
+
+  gegl_rectangle_set (&source_rect,
+                      result->x - margin, result->y - margin,
+                      result->width + 2 * margin,
+                      result->height + 2 * margin);
+  pixels = g_try_new (gfloat, (gsize) source_rect.width * source_rect.height);
+  ctx = halftone_context_new_for_dots (dots);
+  halftone_dots_unref (dots);
+  if (pixels == NULL || ctx == NULL)
+    goto out;
+
+  /* White outside the image, so that no dots are centered there,
+   * as in the plug-in */
+  gegl_buffer_get (input, &source_rect, 1.0, babl_format ("Y' float"),
+                   pixels, GEGL_AUTO_ROWSTRIDE, GEGL_ABYSS_WHITE);
+
+  halftone_source_init_buffer (&source, &buffer, (const guchar *) pixels,
+                               source_rect.width, source_rect.height, 1,
+                               HALFTONE_FORMAT_FLOAT);
+  ok = halftone_context_render_region (ctx, &source,
+                                       result->x, result->y,
+                                       result->width, result->height);
+  if (ok)
+    gegl_buffer_set (output, result, 0, babl_format ("Y' u8"),
+                     ctx->result_image.pixels, GEGL_AUTO_ROWSTRIDE);
+
+out:
+  halftone_context_free (ctx);
+  g_free (pixels);
+  return ok;
+}
+
+static void gegl_op_class_init (GeglOpClass *klass)
+{
+  GeglOperationClass       *operation_class;
+  GeglOperationFilterClass *filter_class;
+
+  operation_class = GEGL_OPERATION_CLASS (klass);
+  filter_class    = GEGL_OPERATION_FILTER_CLASS (klass);
+
+  operation_class->prepare          = prepare;
+  operation_class->get_bounding_box = get_bounding_box;
+  operation_class->threaded         = TRUE;
+  filter_class->process             = process;
+
+  gegl_operation_class_set_keys (operation_class,
+    "name",        "printable-halftone:dots",
+    "title",       "Printable Halftone",
+    "categories",  "distort",
+    "description", "Black and white halftone dots for printing",
+    NULL);
+}
+
+#endif
@@ -0,0 +1,666 @@
+/* Printable Halftone: writing the result to files
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+#include "halftone-output.h"
+
+#define OUTPUT_STRIPE_HEIGHT 64
+
+/* Bytes of encoded data collected before fwrite() */
+#define BIT_WRITER_BUFFER 65536
+
+/* Run lengths longer than this are split */
+#define MAX_MAKEUP_RUN 2560
+
+/* TIFF tags and field types */
+#define TIFF_SHORT    3
+#define TIFF_LONG     4
+#define TIFF_RATIONAL 5
+#define TIFF_TAG_COUNT 12
+
+/* Vector output uses half pixels as units, so that dot centers
+ * (pixel centers) have integer coordinates. */
+#define HALF_PIXELS 2
+
+/* PDF objects: catalog, pages, page, content stream, stream length */
+#define PDF_OBJECTS 5
+
+struct VectorWriter {
+	FILE * file;
+	gsize offset;            /* bytes written, for the PDF xref table */
+	gsize object_offsets[PDF_OBJECTS + 1];
+	gint last_pixel_count;
+	gboolean ok;
+};
+
+struct RunCode {
+	guint16 code;
+	guint16 length;
+};
+
+struct BitWriter {
+	FILE * file;
+	guint32 bits;     /* pending bits, right aligned */
+	gint bit_count;
+	guchar buffer[BIT_WRITER_BUFFER];
+	gsize buffer_used;
+	gsize bytes_written;
+	gboolean ok;
+};
+
+/* Returns row y of the image being written to TIFF */
+typedef const guchar * (* TiffLineFunc) (gint y, gpointer data);
+
+/* Two unpacked rows of a BWPackedBitmap, see get_packed_line() */
+struct PackedLines {
+	const struct BWPackedBitmap * image;
+	guchar * pixels;
+};
+
+/* ITU-T T.4 modified Huffman codes, also used by T.6 horizontal mode */
+
+/* Terminating codes for run lengths 0 - 63 */
+static const struct RunCode white_terminating_codes[] = {
+	{ 0x035,  8 }, { 0x007,  6 }, { 0x007,  4 }, { 0x008,  4 },
+	{ 0x00b,  4 }, { 0x00c,  4 }, { 0x00e,  4 }, { 0x00f,  4 },
+	{ 0x013,  5 }, { 0x014,  5 }, { 0x007,  5 }, { 0x008,  5 },
+	{ 0x008,  6 }, { 0x003,  6 }, { 0x034,  6 }, { 0x035,  6 },
+	{ 0x02a,  6 }, { 0x02b,  6 }, { 0x027,  7 }, { 0x00c,  7 },
+	{ 0x008,  7 }, { 0x017,  7 }, { 0x003,  7 }, { 0x004,  7 },
+	{ 0x028,  7 }, { 0x02b,  7 }, { 0x013,  7 }, { 0x024,  7 },
+	{ 0x018,  7 }, { 0x002,  8 }, { 0x003,  8 }, { 0x01a,  8 },
+	{ 0x01b,  8 }, { 0x012,  8 }, { 0x013,  8 }, { 0x014,  8 },
+	{ 0x015,  8 }, { 0x016,  8 }, { 0x017,  8 }, { 0x028,  8 },
+	{ 0x029,  8 }, { 0x02a,  8 }, { 0x02b,  8 }, { 0x02c,  8 },
+	{ 0x02d,  8 }, { 0x004,  8 }, { 0x005,  8 }, { 0x00a,  8 },
+	{ 0x00b,  8 }, { 0x052,  8 }, { 0x053,  8 }, { 0x054,  8 },
+	{ 0x055,  8 }, { 0x024,  8 }, { 0x025,  8 }, { 0x058,  8 },
+	{ 0x059,  8 }, { 0x05a,  8 }, { 0x05b,  8 }, { 0x04a,  8 },
+	{ 0x04b,  8 }, { 0x032,  8 }, { 0x033,  8 }, { 0x034,  8 },
+};
+
+static const struct RunCode black_terminating_codes[] = {
+	{ 0x037, 10 }, { 0x002,  3 }, { 0x003,  2 }, { 0x002,  2 },
+	{ 0x003,  3 }, { 0x003,  4 }, { 0x002,  4 }, { 0x003,  5 },
+	{ 0x005,  6 }, { 0x004,  6 }, { 0x004,  7 }, { 0x005,  7 },
+	{ 0x007,  7 }, { 0x004,  8 }, { 0x007,  8 }, { 0x018,  9 },
+	{ 0x017, 10 }, { 0x018, 10 }, { 0x008, 10 }, { 0x067, 11 },
+	{ 0x068, 11 }, { 0x06c, 11 }, { 0x037, 11 }, { 0x028, 11 },
+	{ 0x017, 11 }, { 0x018, 11 }, { 0x0ca, 12 }, { 0x0cb, 12 },
+	{ 0x0cc, 12 }, { 0x0cd, 12 }, { 0x068, 12 }, { 0x069, 12 },
+	{ 0x06a, 12 }, { 0x06b, 12 }, { 0x0d2, 12 }, { 0x0d3, 12 },
+	{ 0x0d4, 12 }, { 0x0d5, 12 }, { 0x0d6, 12 }, { 0x0d7, 12 },
+	{ 0x06c, 12 }, { 0x06d, 12 }, { 0x0da, 12 }, { 0x0db, 12 },
+	{ 0x054, 12 }, { 0x055, 12 }, { 0x056, 12 }, { 0x057, 12 },
+	{ 0x064, 12 }, { 0x065, 12 }, { 0x052, 12 }, { 0x053, 12 },
+	{ 0x024, 12 }, { 0x037, 12 }, { 0x038, 12 }, { 0x027, 12 },
+	{ 0x028, 12 }, { 0x058, 12 }, { 0x059, 12 }, { 0x02b, 12 },
+	{ 0x02c, 12 }, { 0x05a, 12 }, { 0x066, 12 }, { 0x067, 12 },
+};
+
+/* Make-up codes for run lengths 64, 128, ... 1728 */
+static const struct RunCode white_makeup_codes[] = {
+	{ 0x01b,  5 }, { 0x012,  5 }, { 0x017,  6 }, { 0x037,  7 },
+	{ 0x036,  8 }, { 0x037,  8 }, { 0x064,  8 }, { 0x065,  8 },
+	{ 0x068,  8 }, { 0x067,  8 }, { 0x0cc,  9 }, { 0x0cd,  9 },
+	{ 0x0d2,  9 }, { 0x0d3,  9 }, { 0x0d4,  9 }, { 0x0d5,  9 },
+	{ 0x0d6,  9 }, { 0x0d7,  9 }, { 0x0d8,  9 }, { 0x0d9,  9 },
+	{ 0x0da,  9 }, { 0x0db,  9 }, { 0x098,  9 }, { 0x099,  9 },
+	{ 0x09a,  9 }, { 0x018,  6 }, { 0x09b,  9 },
+};
+
+static const struct RunCode black_makeup_codes[] = {
+	{ 0x00f, 10 }, { 0x0c8, 12 }, { 0x0c9, 12 }, { 0x05b, 12 },
+	{ 0x033, 12 }, { 0x034, 12 }, { 0x035, 12 }, { 0x06c, 13 },
+	{ 0x06d, 13 }, { 0x04a, 13 }, { 0x04b, 13 }, { 0x04c, 13 },
+	{ 0x04d, 13 }, { 0x072, 13 }, { 0x073, 13 }, { 0x074, 13 },
+	{ 0x075, 13 }, { 0x076, 13 }, { 0x077, 13 }, { 0x052, 13 },
+	{ 0x053, 13 }, { 0x054, 13 }, { 0x055, 13 }, { 0x05a, 13 },
+	{ 0x05b, 13 }, { 0x064, 13 }, { 0x065, 13 },
+};
+
+/* Make-up codes for run lengths 1792, 1856, ... 2560, both colors */
+static const struct RunCode extended_makeup_codes[] = {
+	{ 0x008, 11 }, { 0x00c, 11 }, { 0x00d, 11 }, { 0x012, 12 },
+	{ 0x013, 12 }, { 0x014, 12 }, { 0x015, 12 }, { 0x016, 12 },
+	{ 0x017, 12 }, { 0x01c, 12 }, { 0x01d, 12 }, { 0x01e, 12 },
+	{ 0x01f, 12 },
+};
+
+static const struct RunCode vertical_codes[7] = {
+	/* a1 - b1 = -3 ... 3 */
+	{ 0x02, 7 }, { 0x02, 6 }, { 0x02, 3 }, { 0x01, 1 },
+	{ 0x03, 3 }, { 0x03, 6 }, { 0x03, 7 }
+};
+static const struct RunCode pass_code = { 0x1, 4 };
+static const struct RunCode horizontal_code = { 0x1, 3 };
+static const struct RunCode eol_code = { 0x001, 12 };
+
+static void put_bits(struct BitWriter * writer, guint32 code, gint length);
+static void put_code(struct BitWriter * writer, const struct RunCode * code);
+static void put_run(struct BitWriter * writer, gint run, gboolean black);
+static void flush_bits(struct BitWriter * writer);
+static gint next_change(const guchar * line, gint x, gint width);
+static gint next_change_to(const guchar * line, gint x, gint width,
+                           gboolean black);
+static void encode_g4_row(struct BitWriter * writer, const guchar * line,
+                          const guchar * reference, gint width);
+static void vector_printf(struct VectorWriter * writer,
+                          const gchar * format, ...) G_GNUC_PRINTF(2, 3);
+static void format_number(gchar * buffer, gdouble value);
+static gdouble dot_radius(gint pixel_count);
+static gboolean write_svg_dot(gint x, gint y, gint pixel_count,
+                              gpointer user_data);
+static gboolean write_pdf_dot(gint x, gint y, gint pixel_count,
+                              gpointer user_data);
+static void start_pdf_object(struct VectorWriter * writer, gint object);
+static void put16(guchar * p, guint16 value);
+static void put32(guchar * p, guint32 value);
+static guchar * put_tag(guchar * p, guint16 tag, guint16 type,
+                        guint32 count, guint32 value);
+static gboolean write_tiff_g4(FILE * file, gint width, gint height,
+                              TiffLineFunc get_line, gpointer line_data,
+                              gdouble resolution);
+static const guchar * get_bitmap_line(gint y, gpointer data);
+static const guchar * get_packed_line(gint y, gpointer data);
+
+/*
+ * Writes image as raw PBM
+ */
+gboolean halftone_write_pbm(FILE * file, const struct BWBitmap * image)
+{
+	gsize packed_width = (image->x_size + 7) / 8;
+	guchar * stripe;
+	gint y, row;
+	gboolean ok;
+
+	stripe = (guchar *) halftone_try_malloc(packed_width
+	                                        * OUTPUT_STRIPE_HEIGHT);
+	if (stripe == NULL) {
+		return FALSE;
+	}
+	ok = fprintf(file, "P4\n%d %d\n", image->x_size, image->y_size) > 0;
+	for (y = 0; ok && y < image->y_size; y += row) {
+		for (row = 0; row < OUTPUT_STRIPE_HEIGHT
+		        && y + row < image->y_size; row++) {
+			halftone_pack_row(image->pixels
+			                  + (gsize) (y + row) * image->x_size,
+			                  image->x_size, stripe + row * packed_width);
+		}
+		ok = fwrite(stripe, packed_width, row, file) == (gsize) row;
+	}
+	halftone_free(stripe, packed_width * OUTPUT_STRIPE_HEIGHT);
+	return ok;
+}
+
+gboolean halftone_write_pbm_packed(FILE * file,
+                                   const struct BWPackedBitmap * image)
+{
+	return fprintf(file, "P4\n%d %d\n", image->x_size, image->y_size) > 0
+	       && fwrite(image->pixels, (image->x_size + 7) / 8, image->y_size,
+	                 file) == (gsize) image->y_size;
+}
+
+static void put_bits(struct BitWriter * writer, guint32 code, gint length)
+{
+	writer->bits = (writer->bits << length) | code;
+	writer->bit_count += length;
+	while (writer->bit_count >= 8) {
+		writer->bit_count -= 8;
+		writer->buffer[writer->buffer_used++] =
+			(guchar) (writer->bits >> writer->bit_count);
+		if (writer->buffer_used == BIT_WRITER_BUFFER) {
+			flush_bits(writer);
+		}
+	}
+}
+
+static void put_code(struct BitWriter * writer, const struct RunCode * code)
+{
+	put_bits(writer, code->code, code->length);
+}
+
+/*
+ * Writes one run length as make-up codes followed by a terminating code.
+ */
+static void put_run(struct BitWriter * writer, gint run, gboolean black)
+{
+	const struct RunCode * terminating = black ? black_terminating_codes
+	                                           : white_terminating_codes;
+	const struct RunCode * makeup = black ? black_makeup_codes
+	                                      : white_makeup_codes;
+
+	while (run > MAX_MAKEUP_RUN) {
+		put_code(writer, &extended_makeup_codes[(MAX_MAKEUP_RUN - 1792) / 64]);
+		run -= MAX_MAKEUP_RUN;
+	}
+	if (run >= 1792) {
+		put_code(writer, &extended_makeup_codes[(run - 1792) / 64]);
+		run %= 64;
+	} else if (run >= 64) {
+		put_code(writer, &makeup[run / 64 - 1]);
+		run %= 64;
+	}
+	put_code(writer, &terminating[run]);
+}
+
+static void flush_bits(struct BitWriter * writer)
+{
+	if (writer->buffer_used > 0 && writer->ok) {
+		writer->ok = fwrite(writer->buffer, 1, writer->buffer_used,
+		                    writer->file) == writer->buffer_used;
+	}
+	writer->bytes_written += writer->buffer_used;
+	writer->buffer_used = 0;
+}
+
+/*
+ * Returns the first changing element after x, or width if none.
+ * Pixel -1 is an imaginary white pixel.
+ */
+static gint next_change(const guchar * line, gint x, gint width)
+{
+	guchar color;
+
+	if (x >= width) {
+		return width;
+	}
+	color = (x < 0) ? WHITE : line[x];
+	for (x++; x < width; x++) {
+		if (line[x] != color) {
+			return x;
+		}
+	}
+	return width;
+}
+
+/*
+ * Returns the first changing element after x which changes to the
+ * given color, or width if none.
+ */
+static gint next_change_to(const guchar * line, gint x, gint width,
+                           gboolean black)
+{
+	x = next_change(line, x, width);
+	if (x < width && (line[x] == BLACK) != black) {
+		x = next_change(line, x, width);
+	}
+	return x;
+}
+
+/*
+ * Encodes one row in two-dimensional mode against the reference row
+ * (ITU-T T.6, section 2.2).
+ */
+static void encode_g4_row(struct BitWriter * writer, const guchar * line,
+                          const guchar * reference, gint width)
+{
+	gint a0 = -1, a1, a2, b1, b2;
+	gboolean black = FALSE;    /* color of a0 */
+
+	while (a0 < width) {
+		a1 = next_change(line, a0, width);
+		b1 = next_change_to(reference, a0, width, !black);
+		b2 = next_change(reference, b1, width);
+		if (b2 < a1) {
+			/* Pass mode */
+			put_code(writer, &pass_code);
+			a0 = b2;
+		} else if (ABS(a1 - b1) <= 3) {
+			/* Vertical mode */
+			put_code(writer, &vertical_codes[a1 - b1 + 3]);
+			a0 = a1;
+			black = !black;
+		} else {
+			/* Horizontal mode */
+			a2 = next_change(line, a1, width);
+			put_code(writer, &horizontal_code);
+			put_run(writer, a1 - MAX(a0, 0), black);
+			put_run(writer, a2 - a1, !black);
+			a0 = a2;
+		}
+	}
+}
+
+static void put16(guchar * p, guint16 value)
+{
+	p[0] = value & 0xff;
+	p[1] = value >> 8;
+}
+
+static void put32(guchar * p, guint32 value)
+{
+	put16(p, value & 0xffff);
+	put16(p + 2, value >> 16);
+}
+
+static guchar * put_tag(guchar * p, guint16 tag, guint16 type,
+                        guint32 count, guint32 value)
+{
+	put16(p, tag);
+	put16(p + 2, type);
+	put32(p + 4, count);
+	if (type == TIFF_SHORT) {
+		put32(p + 8, 0);
+		put16(p + 8, (guint16) value);
+	} else {
+		put32(p + 8, value);
+	}
+	return p + 12;
+}
+
+/*
+ * Writes a little-endian TIFF G4 file: 8-byte header, the encoded
+ * strip, then the directory. The header is rewritten at the end, when
+ * the directory offset is known. get_line returns row y as a BWBitmap
+ * row; it must stay valid until the row after it has been requested.
+ */
+static gboolean write_tiff_g4(FILE * file, gint width, gint height,
+                              TiffLineFunc get_line, gpointer line_data,
+                              gdouble resolution)
+{
+	struct BitWriter * writer;
+	guchar header[8];
+	guchar directory[2 + TIFF_TAG_COUNT * 12 + 4 + 16];
+	guchar * p;
+	guchar * white_line;
+	const guchar * reference;
+	const guchar * line;
+	guint32 strip_size, directory_offset, rational_offset;
+	gint y, tag_count;
+	gboolean ok;
+
+	writer = g_try_new0(struct BitWriter, 1);
+	white_line = (guchar *) halftone_try_malloc(width);
+	if (writer == NULL || white_line == NULL) {
+		g_free(writer);
+		halftone_free(white_line, width);
+		return FALSE;
+	}
+	memset(white_line, WHITE, width);
+	writer->file = file;
+	writer->ok = TRUE;
+
+	memcpy(header, "II*\0", 4);
+	put32(header + 4, 0);
+	writer->ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+	/* The first row is coded against an imaginary white row */
+	reference = white_line;
+	for (y = 0; y < height && writer->ok; y++) {
+		line = get_line(y, line_data);
+		encode_g4_row(writer, line, reference, width);
+		reference = line;
+	}
+	/* EOFB */
+	put_code(writer, &eol_code);
+	put_code(writer, &eol_code);
+	if (writer->bit_count > 0) {
+		put_bits(writer, 0, 8 - writer->bit_count);
+	}
+	flush_bits(writer);
+	strip_size = (guint32) writer->bytes_written;
+	ok = writer->ok;
+	g_free(writer);
+	halftone_free(white_line, width);
+
+	/* Directory, aligned to a word boundary */
+	directory_offset = sizeof(header) + strip_size + (strip_size & 1);
+	tag_count = resolution > 0 ? TIFF_TAG_COUNT : TIFF_TAG_COUNT - 3;
+	rational_offset = directory_offset + 2 + tag_count * 12 + 4;
+	p = directory;
+	put16(p, tag_count);
+	p += 2;
+	p = put_tag(p, 256, TIFF_LONG, 1, width);    /* ImageWidth */
+	p = put_tag(p, 257, TIFF_LONG, 1, height);    /* ImageLength */
+	p = put_tag(p, 258, TIFF_SHORT, 1, 1);               /* BitsPerSample */
+	p = put_tag(p, 259, TIFF_SHORT, 1, 4);               /* Compression */
+	p = put_tag(p, 262, TIFF_SHORT, 1, 0);               /* WhiteIsZero */
+	p = put_tag(p, 273, TIFF_LONG, 1, sizeof(header));   /* StripOffsets */
+	p = put_tag(p, 277, TIFF_SHORT, 1, 1);               /* SamplesPerPixel */
+	p = put_tag(p, 278, TIFF_LONG, 1, height);    /* RowsPerStrip */
+	p = put_tag(p, 279, TIFF_LONG, 1, strip_size);       /* StripByteCounts */
+	if (resolution > 0) {
+		p = put_tag(p, 282, TIFF_RATIONAL, 1, rational_offset);
+		p = put_tag(p, 283, TIFF_RATIONAL, 1, rational_offset + 8);
+		p = put_tag(p, 296, TIFF_SHORT, 1, 2);           /* inches */
+	}
+	put32(p, 0);    /* no next directory */
+	p += 4;
+	if (resolution > 0) {
+		put32(p, (guint32) (resolution * 100 + 0.5));
+		put32(p + 4, 100);
+		memcpy(p + 8, p, 8);
+		p += 16;
+	}
+
+	if (ok && (strip_size & 1)) {
+		ok = fputc(0, file) != EOF;
+	}
+	ok = ok && fwrite(directory, 1, p - directory, file)
+	           == (gsize) (p - directory);
+
+	/* Header with the directory offset */
+	put32(header + 4, directory_offset);
+	ok = ok && fseek(file, 0, SEEK_SET) == 0
+	        && fwrite(header, 1, sizeof(header), file) == sizeof(header)
+	        && fseek(file, 0, SEEK_END) == 0;
+	return ok;
+}
+
+static const guchar * get_bitmap_line(gint y, gpointer data)
+{
+	const struct BWBitmap * image = (const struct BWBitmap *) data;
+
+	return image->pixels + (gsize) y * image->x_size;
+}
+
+/* Unpacks rows to two buffers in turn, so the previous row stays valid */
+static const guchar * get_packed_line(gint y, gpointer data)
+{
+	struct PackedLines * lines = (struct PackedLines *) data;
+	const struct BWPackedBitmap * image = lines->image;
+	guchar * line = lines->pixels + (y & 1) * image->x_size;
+
+	halftone_unpack_row(image->pixels
+	                    + (gsize) y * ((image->x_size + 7) / 8),
+	                    image->x_size, line);
+	return line;
+}
+
+gboolean halftone_write_tiff_g4(FILE * file, const struct BWBitmap * image,
+                                gdouble resolution)
+{
+	return write_tiff_g4(file, image->x_size, image->y_size,
+	                     get_bitmap_line, (gpointer) image, resolution);
+}
+
+gboolean halftone_write_tiff_g4_packed(FILE * file,
+                                       const struct BWPackedBitmap * image,
+                                       gdouble resolution)
+{
+	struct PackedLines lines;
+	gsize size = (gsize) image->x_size * 2;
+	gboolean ok;
+
+	lines.image = image;
+	lines.pixels = (guchar *) halftone_try_malloc(size);
+	if (lines.pixels == NULL) {
+		return FALSE;
+	}
+	ok = write_tiff_g4(file, image->x_size, image->y_size,
+	                   get_packed_line, &lines, resolution);
+	halftone_free(lines.pixels, size);
+	return ok;
+}
+
+static void vector_printf(struct VectorWriter * writer,
+                          const gchar * format, ...)
+{
+	va_list args;
+	gint n;
+
+	if (!writer->ok) {
+		return;
+	}
+	va_start(args, format);
+	n = vfprintf(writer->file, format, args);
+	va_end(args);
+	if (n < 0) {
+		writer->ok = FALSE;
+	} else {
+		writer->offset += n;
+	}
+}
+
+/*
+ * Formats with two decimals and a decimal point regardless of locale
+ */
+static void format_number(gchar * buffer, gdouble value)
+{
+	g_ascii_formatd(buffer, G_ASCII_DTOSTR_BUF_SIZE, "%.2f", value);
+}
+
+/*
+ * Radius of the disc with the same area as the dot, in half pixels
+ */
+static gdouble dot_radius(gint pixel_count)
+{
+	return HALF_PIXELS * sqrt(pixel_count / G_PI);
+}
+
+static gboolean write_svg_dot(gint x, gint y, gint pixel_count,
+                              gpointer user_data)
+{
+	struct VectorWriter * writer = (struct VectorWriter *) user_data;
+	gchar radius[G_ASCII_DTOSTR_BUF_SIZE];
+
+	format_number(radius, dot_radius(pixel_count));
+	vector_printf(writer, "<circle cx=\"%d\" cy=\"%d\" r=\"%s\"/>\n",
+	              HALF_PIXELS * x + 1, HALF_PIXELS * y + 1, radius);
+	return writer->ok;
+}
+
+gboolean halftone_write_svg(FILE * file, const HalftoneDots * dots,
+                            const HalftoneSource * source,
+                            gdouble resolution)
+{
+	struct VectorWriter writer = { file, 0, { 0 }, 0, TRUE };
+	gchar width[G_ASCII_DTOSTR_BUF_SIZE], height[G_ASCII_DTOSTR_BUF_SIZE];
+	gint units_x = HALF_PIXELS * source->width;
+	gint units_y = HALF_PIXELS * source->height;
+
+	if (resolution <= 0) {
+		resolution = 72;
+	}
+	/* Page size in points */
+	format_number(width, source->width * 72.0 / resolution);
+	format_number(height, source->height * 72.0 / resolution);
+	vector_printf(&writer,
+	        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	        "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\"\n"
+	        "     width=\"%spt\" height=\"%spt\" viewBox=\"0 0 %d %d\">\n"
+	        "<rect width=\"%d\" height=\"%d\" fill=\"white\"/>\n"
+	        "<g fill=\"black\">\n",
+	        width, height, units_x, units_y, units_x, units_y);
+	if (writer.ok
+		&& !halftone_trace_dots(dots, source, write_svg_dot, &writer)) {
+		writer.ok = FALSE;
+	}
+	vector_printf(&writer, "</g>\n</svg>\n");
+	return writer.ok;
+}
+
+/*
+ * Each dot is a zero-length line with round caps, which PDF paints
+ * as a disc with the diameter of the line width. The width is set
+ * only when the dot size changes.
+ */
+static gboolean write_pdf_dot(gint x, gint y, gint pixel_count,
+                              gpointer user_data)
+{
+	struct VectorWriter * writer = (struct VectorWriter *) user_data;
+	gchar diameter[G_ASCII_DTOSTR_BUF_SIZE];
+	gint cx = HALF_PIXELS * x + 1;
+	gint cy = HALF_PIXELS * y + 1;
+
+	if (pixel_count != writer->last_pixel_count) {
+		format_number(diameter, 2 * dot_radius(pixel_count));
+		vector_printf(writer, "%s w\n", diameter);
+		writer->last_pixel_count = pixel_count;
+	}
+	vector_printf(writer, "%d %d m %d %d l S\n", cx, cy, cx, cy);
+	return writer->ok;
+}
+
+static void start_pdf_object(struct VectorWriter * writer, gint object)
+{
+	writer->object_offsets[object] = writer->offset;
+	vector_printf(writer, "%d 0 obj\n", object);
+}
+
+gboolean halftone_write_pdf(FILE * file, const HalftoneDots * dots,
+                            const HalftoneSource * source,
+                            gdouble resolution)
+{
+	struct VectorWriter writer = { file, 0, { 0 }, 0, TRUE };
+	gchar width[G_ASCII_DTOSTR_BUF_SIZE], height[G_ASCII_DTOSTR_BUF_SIZE];
+	gchar scale[G_ASCII_DTOSTR_BUF_SIZE];
+	gsize stream_start, stream_length, xref_offset;
+	gint object;
+
+	if (resolution <= 0) {
+		resolution = 72;
+	}
+	/* Page size in points */
+	format_number(width, source->width * 72.0 / resolution);
+	format_number(height, source->height * 72.0 / resolution);
+	g_ascii_formatd(scale, G_ASCII_DTOSTR_BUF_SIZE, "%.6f",
+	                72.0 / resolution / HALF_PIXELS);
+
+	vector_printf(&writer, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n");
+	start_pdf_object(&writer, 1);
+	vector_printf(&writer, "<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+	start_pdf_object(&writer, 2);
+	vector_printf(&writer,
+	        "<< /Type /Pages /Kids [3 0 R] /Count 1 >>\nendobj\n");
+	start_pdf_object(&writer, 3);
+	vector_printf(&writer,
+	        "<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %s %s]\n"
+	        "   /Contents 4 0 R /Resources << >> >>\nendobj\n",
+	        width, height);
+	start_pdf_object(&writer, 4);
+	vector_printf(&writer, "<< /Length 5 0 R >>\nstream\n");
+
+	/* Units are half pixels, y grows downwards like in the image */
+	stream_start = writer.offset;
+	vector_printf(&writer, "%s 0 0 -%s 0 %s cm\n1 J 0 G\n",
+	              scale, scale, height);
+	if (writer.ok
+		&& !halftone_trace_dots(dots, source, write_pdf_dot, &writer)) {
+		writer.ok = FALSE;
+	}
+	stream_length = writer.offset - stream_start;
+	vector_printf(&writer, "endstream\nendobj\n");
+	start_pdf_object(&writer, 5);
+	vector_printf(&writer, "%" G_GSIZE_FORMAT "\nendobj\n", stream_length);
+
+	xref_offset = writer.offset;
+	vector_printf(&writer, "xref\n0 %d\n0000000000 65535 f \n",
+	              PDF_OBJECTS + 1);
+	for (object = 1; object <= PDF_OBJECTS; object++) {
+		vector_printf(&writer, "%010" G_GSIZE_FORMAT " 00000 n \n",
+		              writer.object_offsets[object]);
+	}
+	vector_printf(&writer,
+	        "trailer\n<< /Size %d /Root 1 0 R >>\n"
+	        "startxref\n%" G_GSIZE_FORMAT "\n%%%%EOF\n",
+	        PDF_OBJECTS + 1, xref_offset);
+	return writer.ok;
+}
@@ -0,0 +1,44 @@
+/* Printable Halftone: writing the result to files
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* The result is bilevel, so it is written 1 bit per pixel,
+ * OUTPUT_STRIPE_HEIGHT rows at a time. No full-depth copy is made.
+ * All writers return FALSE on write errors. */
+#ifndef HALFTONE_OUTPUT_H
+#define HALFTONE_OUTPUT_H
+
+#include <stdio.h>
+#include "halftone.h"
+
+/* Raw PBM (P4) */
+gboolean halftone_write_pbm(FILE * file, const struct BWBitmap * image);
+
+/* Single-strip TIFF with CCITT Group 4 (T.6) compression.
+ * resolution is in pixels per inch; 0 leaves it out.
+ * file must be seekable. */
+gboolean halftone_write_tiff_g4(FILE * file, const struct BWBitmap * image,
+                                gdouble resolution);
+
+/* The same from a result packed to 1 bit per pixel */
+gboolean halftone_write_pbm_packed(FILE * file,
+                                   const struct BWPackedBitmap * image);
+gboolean halftone_write_tiff_g4_packed(FILE * file,
+                                       const struct BWPackedBitmap * image,
+                                       gdouble resolution);
+
+/* Vector output: one disc per dot, area equal to the dot's pixel count.
+ * Dots are traced from source, no bitmap is rendered. resolution is in
+ * pixels per inch and sets the physical page size; 0 means 72. */
+gboolean halftone_write_svg(FILE * file, const HalftoneDots * dots,
+                            const HalftoneSource * source,
+                            gdouble resolution);
+gboolean halftone_write_pdf(FILE * file, const HalftoneDots * dots,
+                            const HalftoneSource * source,
+                            gdouble resolution);
+
+#endif /* HALFTONE_OUTPUT_H */
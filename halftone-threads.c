@@ -0,0 +1,147 @@
+/* Printable Halftone worker threads
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* The threaded engines split a render into steps which all threads
+ * finish before the next one starts. halftone_team_run() runs such a
+ * team: member 0 in the calling thread, the others in a process-wide
+ * pool of threads, and halftone_team_barrier() separates the steps.
+ *
+ * The pool threads are started on first use and kept until the process
+ * exits, so a resident plug-in or a server does not start and stop
+ * threads for every render. The pool grows to the largest team asked
+ * for. A barrier needs every member running at once, so one team at a
+ * time uses the pool; a render started while another one has it runs
+ * in its own thread alone, as the processors are busy anyway.
+ */
+#include "halftone.h"
+
+struct TeamMember {
+	HalftoneTeam * team;
+	gint index;
+};
+
+/* Held by the team using pool */
+static GMutex pool_mutex;
+static GThreadPool * pool = NULL;
+
+static void run_member(gpointer data, gpointer user_data);
+static gboolean reserve_pool(gint threads);
+static void finish_member(HalftoneTeam * team);
+
+/*
+ * Calls func(team, index, data) for index 0 .. threads - 1 at once,
+ * threads <= 0 being one per processor, and returns when all have
+ * returned. team->thread_count may be less than threads if the pool is
+ * busy or cannot grow; members split the work by it.
+ */
+void halftone_team_run(gint threads, HalftoneTeamFunc func, gpointer data)
+{
+	HalftoneTeam team;
+	struct TeamMember * members = NULL;
+	gint i;
+
+	if (threads <= 0) {
+		threads = g_get_num_processors();
+	}
+	if (threads > 1 && !g_mutex_trylock(&pool_mutex)) {
+		threads = 1;
+	} else if (threads > 1 && reserve_pool(threads - 1) == FALSE) {
+		g_mutex_unlock(&pool_mutex);
+		threads = 1;
+	}
+
+	team.thread_count = threads;
+	team.func = func;
+	team.data = data;
+	team.arrived = 0;
+	team.generation = 0;
+	team.running = threads;
+	g_mutex_init(&team.mutex);
+	g_cond_init(&team.cond);
+
+	if (threads > 1) {
+		members = g_new(struct TeamMember, threads);
+		for (i = 1; i < threads; i++) {
+			members[i].team = &team;
+			members[i].index = i;
+			g_thread_pool_push(pool, &members[i], NULL);
+		}
+	}
+	func(&team, 0, data);
+	finish_member(&team);
+
+	g_mutex_lock(&team.mutex);
+	while (team.running > 0) {
+		g_cond_wait(&team.cond, &team.mutex);
+	}
+	g_mutex_unlock(&team.mutex);
+	if (threads > 1) {
+		g_mutex_unlock(&pool_mutex);
+	}
+
+	g_mutex_clear(&team.mutex);
+	g_cond_clear(&team.cond);
+	g_free(members);
+}
+
+/*
+ * Waits until every member of team has called it as many times as
+ * this one.
+ */
+void halftone_team_barrier(HalftoneTeam * team)
+{
+	gint generation;
+
+	g_mutex_lock(&team->mutex);
+	generation = team->generation;
+	team->arrived++;
+	if (team->arrived == team->thread_count) {
+		team->arrived = 0;
+		team->generation++;
+		g_cond_broadcast(&team->cond);
+	} else {
+		while (generation == team->generation) {
+			g_cond_wait(&team->cond, &team->mutex);
+		}
+	}
+	g_mutex_unlock(&team->mutex);
+}
+
+static void run_member(gpointer data, gpointer user_data)
+{
+	struct TeamMember * member = (struct TeamMember *) data;
+	HalftoneTeam * team = member->team;
+
+	team->func(team, member->index, team->data);
+	finish_member(team);
+}
+
+static void finish_member(HalftoneTeam * team)
+{
+	g_mutex_lock(&team->mutex);
+	team->running--;
+	g_cond_broadcast(&team->cond);
+	g_mutex_unlock(&team->mutex);
+}
+
+/*
+ * Called with pool_mutex locked. Makes the pool at least threads
+ * threads. Exclusive threads start at once and stay, so every member
+ * pushed gets a thread of its own.
+ */
+static gboolean reserve_pool(gint threads)
+{
+	if (pool == NULL) {
+		pool = g_thread_pool_new(run_member, NULL, threads, TRUE, NULL);
+		return pool != NULL;
+	}
+	if (g_thread_pool_get_max_threads(pool) < threads) {
+		return g_thread_pool_set_max_threads(pool, threads, NULL);
+	}
+	return TRUE;
+}
@@ -0,0 +1,227 @@
+/* Printable Halftone paint strategy auto-tuner
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* The cost of painting a dot does not follow its size: painting the
+ * same image at size 4 took 8 times as long as at size 8, at size 2
+ * 9 times. Small dots are all loop overhead, large ones all memory
+ * traffic, and where one turns into the other depends on the machine.
+ *
+ * So on first use of a dot size each HALFTONE_PAINT_* strategy paints
+ * the same synthetic patch for a few milliseconds, and the fastest one
+ * is used from then on. The winners are kept in a key file, one group
+ * per host name, so that a home directory shared by several machines
+ * keeps a profile for each:
+ *
+ *   [hostname/2]
+ *   2=pixels
+ *   8=mask
+ *
+ * The number after the host name is PROFILE_VERSION. Raise it whenever
+ * a strategy is added or made faster; the old winners are then ignored
+ * and every size is timed again.
+ */
+#include <string.h>
+#include "halftone.h"
+
+#define PATCH_SIZE 256
+#define TUNE_ROUNDS 3
+#define MIN_ROUND_US 1000
+#define PROFILE_VERSION 2
+
+static GMutex tune_mutex;
+static GKeyFile * profile = NULL;
+static gchar * profile_filename = NULL;
+static gboolean profile_filename_set = FALSE;
+static gchar * profile_group = NULL;
+
+static const gchar * paint_names[HALFTONE_PAINT_STRATEGIES] = {
+	"mask",
+	"spans",
+	"pixels"
+};
+
+static void load_profile(void);
+static void save_profile(void);
+static gint time_strategies(const HalftoneDots * dots);
+
+const gchar * halftone_paint_name(gint strategy)
+{
+	if (strategy < 0 || strategy >= HALFTONE_PAINT_STRATEGIES) {
+		return NULL;
+	}
+	return paint_names[strategy];
+}
+
+/*
+ * Returns the fastest HALFTONE_PAINT_* for the size of dots.
+ */
+gint halftone_tune_paint(const HalftoneDots * dots)
+{
+	gchar key[16];
+	gchar * name;
+	gint strategy = -1;
+	gint i;
+
+	g_snprintf(key, sizeof(key), "%d", dots->dot_spacing);
+	g_mutex_lock(&tune_mutex);
+	load_profile();
+	name = g_key_file_get_string(profile, profile_group, key, NULL);
+	for (i = 0; name != NULL && i < HALFTONE_PAINT_STRATEGIES; i++) {
+		if (strcmp(name, paint_names[i]) == 0) {
+			strategy = i;
+		}
+	}
+	g_free(name);
+	g_mutex_unlock(&tune_mutex);
+	if (strategy >= 0) {
+		return strategy;
+	}
+
+	/* Not locked while timing; if two threads tune the same size,
+	 * both results are good */
+	strategy = time_strategies(dots);
+
+	g_mutex_lock(&tune_mutex);
+	g_key_file_set_string(profile, profile_group, key,
+	                      paint_names[strategy]);
+	/* Winners of older versions of the renderer */
+	g_key_file_remove_group(profile, g_get_host_name(), NULL);
+	save_profile();
+	g_mutex_unlock(&tune_mutex);
+	return strategy;
+}
+
+/*
+ * Uses filename as the profile from now on. Results already in memory
+ * are dropped.
+ */
+void halftone_tune_set_profile(const gchar * filename)
+{
+	g_mutex_lock(&tune_mutex);
+	g_free(profile_filename);
+	profile_filename = g_strdup(filename);
+	profile_filename_set = TRUE;
+	if (profile != NULL) {
+		g_key_file_free(profile);
+		profile = NULL;
+	}
+	g_mutex_unlock(&tune_mutex);
+}
+
+/* Called with tune_mutex locked */
+static void load_profile(void)
+{
+	if (profile != NULL) {
+		return;
+	}
+	if (profile_group == NULL) {
+		profile_group = g_strdup_printf("%s/%d", g_get_host_name(),
+		                                PROFILE_VERSION);
+	}
+	if (!profile_filename_set) {
+		profile_filename = g_build_filename(g_get_user_config_dir(),
+		                                    "printable-halftone",
+		                                    "tuning", NULL);
+		profile_filename_set = TRUE;
+	}
+	profile = g_key_file_new();
+	if (profile_filename != NULL) {
+		/* A missing or broken profile is tuned again */
+		g_key_file_load_from_file(profile, profile_filename,
+		                          G_KEY_FILE_NONE, NULL);
+	}
+}
+
+/*
+ * Called with tune_mutex locked. The profile only saves time, so
+ * failing to write it is not an error.
+ */
+static void save_profile(void)
+{
+	gchar * data, * directory;
+	gsize length;
+
+	if (profile_filename == NULL) {
+		return;
+	}
+	data = g_key_file_to_data(profile, &length, NULL);
+	directory = g_path_get_dirname(profile_filename);
+	if (data != NULL && g_mkdir_with_parents(directory, 0755) == 0) {
+		g_file_set_contents(profile_filename, data, length, NULL);
+	}
+	g_free(directory);
+	g_free(data);
+}
+
+/* Microseconds per painting of the whole patch */
+static gdouble time_patch(const HalftoneDots * dots, gint strategy,
+                          struct BWBitmap * patch)
+{
+	gint dot_spacing = dots->dot_spacing;
+	gint x, y, phase, passes = 0;
+	gint64 start = g_get_monotonic_time();
+	gint64 elapsed;
+
+	do {
+		memset(patch->pixels, WHITE, (gsize) PATCH_SIZE * PATCH_SIZE);
+		for (phase = 0; phase < 2; phase++) {
+			for (y = phase * dot_spacing / 2; y < PATCH_SIZE;
+			        y += dot_spacing) {
+				for (x = phase * dot_spacing / 2; x < PATCH_SIZE;
+				        x += dot_spacing) {
+					/* Every luminance, scattered like in a photo */
+					halftone_dots_paint(dots, strategy, patch, x, y,
+					                    (x * 37 + y * 101) % LUMINANCES);
+				}
+			}
+		}
+		passes++;
+		elapsed = g_get_monotonic_time() - start;
+	} while (elapsed < MIN_ROUND_US);
+	return (gdouble) elapsed / passes;
+}
+
+/*
+ * Paints the patch with each strategy in turn, TUNE_ROUNDS times, and
+ * returns the one with the fastest round. Falls back to MASK if out of
+ * memory.
+ */
+static gint time_strategies(const HalftoneDots * dots)
+{
+	struct BWBitmap patch;
+	gdouble best[HALFTONE_PAINT_STRATEGIES];
+	gdouble time;
+	gint round, strategy, winner = HALFTONE_PAINT_MASK;
+
+	patch.x_size = PATCH_SIZE;
+	patch.y_size = PATCH_SIZE;
+	patch.pixels = (guchar *) halftone_try_malloc((gsize) PATCH_SIZE
+	                                              * PATCH_SIZE);
+	if (patch.pixels == NULL) {
+		return HALFTONE_PAINT_MASK;
+	}
+	for (strategy = 0; strategy < HALFTONE_PAINT_STRATEGIES; strategy++) {
+		best[strategy] = G_MAXDOUBLE;
+	}
+	/* Rounds interleaved, so that a busy moment of the machine
+	 * does not count against one strategy only */
+	for (round = 0; round < TUNE_ROUNDS; round++) {
+		for (strategy = 0; strategy < HALFTONE_PAINT_STRATEGIES;
+		        strategy++) {
+			time = time_patch(dots, strategy, &patch);
+			best[strategy] = MIN(best[strategy], time);
+		}
+	}
+	for (strategy = 0; strategy < HALFTONE_PAINT_STRATEGIES; strategy++) {
+		if (best[strategy] < best[winner]) {
+			winner = strategy;
+		}
+	}
+	halftone_free(patch.pixels, (gsize) PATCH_SIZE * PATCH_SIZE);
+	return winner;
+}
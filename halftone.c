@@ -0,0 +1,2342 @@
+/* Printable Halftone renderer
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "halftone.h"
+#ifdef G_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+/* Table cache: dot_spacing -> link in dots_cache_order, whose data is
+ * the HalftoneDots. The cache holds one reference to each. The most
+ * recently used tables are at the head of dots_cache_order; beyond
+ * DOTS_CACHE_SIZE tables the least recently used one is dropped. */
+#define DOTS_CACHE_SIZE 32
+static GMutex dots_cache_mutex;
+static GHashTable * dots_cache = NULL;
+static GQueue dots_cache_order = G_QUEUE_INIT;
+
+/* Bytes allocated with halftone_try_malloc(), see halftone_memory_peak() */
+static GMutex memory_mutex;
+static gsize memory_in_use = 0;
+static gsize memory_peak = 0;
+
+/* Arena blocks from this size on are aligned to and advised to use
+ * transparent huge pages, see arena_block_new() */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Start of each arena block. The memory handed out follows it,
+ * at HALFTONE_ARENA_ALIGNMENT. */
+struct HalftoneArenaBlock {
+	HalftoneArenaBlock * next;
+	gsize size;
+};
+
+static gint compare_BitmapPixels(const void * a, const void * b);
+static gboolean list_pixels_of_dot(HalftoneDots * dots);
+static gint paint_pixel(struct BWBitmap * image, const gint x, const gint y);
+static gboolean calibrate_dot_sizes(HalftoneDots * dots);
+static gboolean precalculate_dots(HalftoneDots * dots);
+static gboolean precalculate_spans(HalftoneDots * dots);
+static gboolean precalculate_bitboard(HalftoneDots * dots);
+static gboolean prepare_tiles(HalftoneContext * ctx, gint width, gint height);
+static void tiles_to_bitmap(HalftoneContext * ctx, gint first_row,
+                            gint end_row);
+static void paint_dot(const HalftoneDots * dots, struct BWBitmap * image,
+                      const gint x, const gint y, const gint luminance);
+static void paint_spans(const HalftoneDots * dots, struct BWBitmap * image,
+                        gint x, gint y, gint luminance);
+static void paint_pixels(const HalftoneDots * dots, struct BWBitmap * image,
+                         gint x, gint y, gint luminance);
+static gboolean render_fine(HalftoneContext * ctx,
+                            const HalftoneSource * source);
+static gboolean prepare_buffers(HalftoneContext * ctx, gint width,
+                                gint height, gsize scanline_size);
+static gint first_on_lattice(gint start, gint offset, gint spacing);
+static void paint_fine_dot(const HalftoneDots * dots, struct BWBitmap * image,
+                           gint x, gint y, gint pixel_count);
+static gboolean get_buffer_row(gint y, guchar * row, gpointer user_data);
+static void fill_white(guchar * row, gsize samples, gint format);
+static gboolean get_stripe_row(gint y, guchar * row, gpointer user_data);
+static gboolean hold_varying_dots(HalftoneContext * ctx,
+                                  gint min_spacing, gint max_spacing);
+static void release_varying_dots(HalftoneContext * ctx);
+
+/* Largest max_dot_width that fits a tile of the bitboard engine */
+#define BITBOARD_MAX_DOT_WIDTH 7
+#define BITBOARD_MASKS (LUMINANCES * 8 * 2)
+
+/* Painters of 8-bit dots, indexed by HALFTONE_PAINT_* */
+typedef void (* PaintFunc) (const HalftoneDots * dots,
+                            struct BWBitmap * image,
+                            gint x, gint y, gint luminance);
+
+static const PaintFunc paint_funcs[HALFTONE_PAINT_STRATEGIES] = {
+	paint_dot,
+	paint_spans,
+	paint_pixels
+};
+
+static PaintFunc paint_func(const HalftoneDots * dots, gint strategy);
+
+/* Rows of a stripe grown by the region margin, from the whole source.
+ * See get_stripe_row(). */
+struct StripeSource {
+	const HalftoneSource * source;
+	gint y;
+	gint margin;
+};
+
+/*
+ * Prepares everything for the actual filtering.
+ * Returns NULL if dot_spacing < 2 or if out of memory.
+ */
+HalftoneDots * halftone_dots_new(gint dot_spacing)
+{
+	HalftoneDots * dots;
+
+	if (dot_spacing < 2) {
+		return NULL;
+	}
+	dots = g_try_new0(HalftoneDots, 1);
+	if (dots == NULL) {
+		return NULL;
+	}
+	dots->ref_count = 1;
+	dots->dot_spacing = dot_spacing;
+
+	if (list_pixels_of_dot(dots) == FALSE
+		|| calibrate_dot_sizes(dots) == FALSE
+		|| precalculate_dots(dots) == FALSE
+		|| precalculate_spans(dots) == FALSE
+		|| precalculate_bitboard(dots) == FALSE) {
+		halftone_dots_unref(dots);
+		return NULL;
+	}
+	/* Small dots are always painted on the bitboard */
+	if (dots->bitboard_masks == NULL) {
+		dots->paint_strategy = halftone_tune_paint(dots);
+	}
+	return dots;
+}
+
+HalftoneDots * halftone_dots_ref(HalftoneDots * dots)
+{
+	g_atomic_int_inc(&dots->ref_count);
+	return dots;
+}
+
+void halftone_dots_unref(HalftoneDots * dots)
+{
+	if (dots == NULL || !g_atomic_int_dec_and_test(&dots->ref_count)) {
+		return;
+	}
+	halftone_free(dots->pixels_of_dot, (gsize) dots->pixels_in_dot_bitmap
+	                                   * sizeof(struct BitmapPixel));
+	halftone_free(dots->precalculated_dots,
+	              (gsize) dots->pixels_in_dot_bitmap * LUMINANCES);
+	halftone_free(dots->shade_of_pixel_count,
+	              (dots->max_pixels_in_dot + 1) * sizeof(guint16));
+	halftone_free(dots->pixel_order,
+	              (gsize) dots->pixels_in_dot_bitmap * sizeof(gint));
+	halftone_free(dots->dot_spans, (gsize) LUMINANCES * dots->max_dot_width
+	                               * 2 * sizeof(gint16));
+	halftone_free(dots->bitboard_masks, BITBOARD_MASKS * sizeof(guint64));
+	g_free(dots);
+}
+
+/* Bytes of the tables of dots max_dot_width wide */
+static gsize dot_tables_size(gint max_dot_width, gint max_pixels_in_dot)
+{
+	gsize pixels_in_dot_bitmap = (gsize) max_dot_width * max_dot_width;
+
+	return pixels_in_dot_bitmap
+	       * (sizeof(struct BitmapPixel) + LUMINANCES + sizeof(gint))
+	       + (max_pixels_in_dot + 1) * sizeof(guint16)
+	       + (gsize) LUMINANCES * max_dot_width * 2 * sizeof(gint16)
+	       + (max_dot_width <= BITBOARD_MAX_DOT_WIDTH
+	          ? BITBOARD_MASKS * sizeof(guint64) : 0);
+}
+
+/*
+ * Bytes taken by the tables of dots.
+ */
+gsize halftone_dots_size(const HalftoneDots * dots)
+{
+	return dot_tables_size(dots->max_dot_width, dots->max_pixels_in_dot);
+}
+
+/*
+ * Called with dots_cache_mutex locked. Returns the link of dot_spacing
+ * in dots_cache_order, moved to the head as the most recently used,
+ * or NULL.
+ */
+static GList * dots_cache_lookup(gint dot_spacing)
+{
+	GList * link;
+
+	if (dots_cache == NULL) {
+		dots_cache = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	link = g_hash_table_lookup(dots_cache, GINT_TO_POINTER(dot_spacing));
+	if (link != NULL) {
+		g_queue_unlink(&dots_cache_order, link);
+		g_queue_push_head_link(&dots_cache_order, link);
+	}
+	return link;
+}
+
+/*
+ * Returns cached dot tables for dot_spacing, building them on first use.
+ * Returns NULL if dot_spacing < 2 or if out of memory.
+ *
+ * The tables are built and tuned without the cache locked, so that
+ * threads wanting cached sizes do not wait for them. If two threads
+ * build the same size, the tables of the first one are kept.
+ */
+HalftoneDots * halftone_dots_cache_get(gint dot_spacing)
+{
+	HalftoneDots * dots, * built, * oldest = NULL;
+	GList * link;
+
+	g_mutex_lock(&dots_cache_mutex);
+	link = dots_cache_lookup(dot_spacing);
+	if (link != NULL) {
+		dots = halftone_dots_ref((HalftoneDots *) link->data);
+		g_mutex_unlock(&dots_cache_mutex);
+		return dots;
+	}
+	g_mutex_unlock(&dots_cache_mutex);
+
+	built = halftone_dots_new(dot_spacing);
+	if (built == NULL) {
+		return NULL;
+	}
+
+	/* Another thread may have built the same size meanwhile, or
+	 * halftone_dots_cache_clear() dropped the cache */
+	g_mutex_lock(&dots_cache_mutex);
+	link = dots_cache_lookup(dot_spacing);
+	if (link != NULL) {
+		dots = (HalftoneDots *) link->data;
+	} else {
+		dots = built;
+		built = NULL;
+		g_queue_push_head(&dots_cache_order, dots);
+		g_hash_table_insert(dots_cache, GINT_TO_POINTER(dot_spacing),
+		        dots_cache_order.head);
+		if (dots_cache_order.length > DOTS_CACHE_SIZE) {
+			oldest = (HalftoneDots *) g_queue_pop_tail(&dots_cache_order);
+			g_hash_table_remove(dots_cache,
+			        GINT_TO_POINTER(oldest->dot_spacing));
+		}
+	}
+	halftone_dots_ref(dots);
+	g_mutex_unlock(&dots_cache_mutex);
+
+	halftone_dots_unref(built);
+	halftone_dots_unref(oldest);
+	return dots;
+}
+
+/*
+ * Drops the cache's references. Tables still used by contexts
+ * are freed when their last context lets go of them.
+ */
+void halftone_dots_cache_clear(void)
+{
+	g_mutex_lock(&dots_cache_mutex);
+	if (dots_cache != NULL) {
+		g_hash_table_destroy(dots_cache);
+		dots_cache = NULL;
+	}
+	while (dots_cache_order.length > 0) {
+		halftone_dots_unref(g_queue_pop_head(&dots_cache_order));
+	}
+	g_mutex_unlock(&dots_cache_mutex);
+}
+
+/*
+ * Creates a context with its own, unshared dot tables.
+ */
+HalftoneContext * halftone_context_new(gint dot_spacing)
+{
+	HalftoneContext * ctx;
+	HalftoneDots * dots = halftone_dots_new(dot_spacing);
+
+	if (dots == NULL) {
+		return NULL;
+	}
+	ctx = halftone_context_new_for_dots(dots);
+	halftone_dots_unref(dots);
+	return ctx;
+}
+
+/*
+ * Creates a context using shared dot tables. Takes a new reference.
+ */
+HalftoneContext * halftone_context_new_for_dots(HalftoneDots * dots)
+{
+	HalftoneContext * ctx = g_try_new0(HalftoneContext, 1);
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+	ctx->dots = halftone_dots_ref(dots);
+	return ctx;
+}
+
+/*
+ * Switches the context to other dot tables, keeping its scratch buffers.
+ */
+void halftone_context_set_dots(HalftoneContext * ctx, HalftoneDots * dots)
+{
+	if (ctx->dots == dots) {
+		return;
+	}
+	halftone_dots_ref(dots);
+	halftone_dots_unref(ctx->dots);
+	ctx->dots = dots;
+}
+
+void halftone_context_free(HalftoneContext * ctx)
+{
+	if (ctx == NULL) {
+		return;
+	}
+	halftone_dots_unref(ctx->dots);
+	halftone_arena_clear(&ctx->arena);
+	halftone_free(ctx->coverage_dots, ctx->coverage_allocated);
+	release_varying_dots(ctx);
+	g_free(ctx);
+}
+
+static void count_malloc(gsize size)
+{
+	g_mutex_lock(&memory_mutex);
+	memory_in_use += size;
+	memory_peak = MAX(memory_peak, memory_in_use);
+	g_mutex_unlock(&memory_mutex);
+}
+
+static void count_free(gsize size)
+{
+	g_mutex_lock(&memory_mutex);
+	memory_in_use -= size;
+	g_mutex_unlock(&memory_mutex);
+}
+
+/*
+ * g_try_malloc() counted in halftone_memory_in_use().
+ * The same size must be given to halftone_free().
+ */
+gpointer halftone_try_malloc(gsize size)
+{
+	gpointer memory = g_try_malloc(size);
+
+	if (memory != NULL) {
+		count_malloc(size);
+	}
+	return memory;
+}
+
+void halftone_free(gpointer memory, gsize size)
+{
+	if (memory == NULL) {
+		return;
+	}
+	g_free(memory);
+	count_free(size);
+}
+
+gsize halftone_memory_in_use(void)
+{
+	gsize in_use;
+
+	g_mutex_lock(&memory_mutex);
+	in_use = memory_in_use;
+	g_mutex_unlock(&memory_mutex);
+	return in_use;
+}
+
+/*
+ * Returns the most bytes in use since halftone_memory_reset_peak().
+ */
+gsize halftone_memory_peak(void)
+{
+	gsize peak;
+
+	g_mutex_lock(&memory_mutex);
+	peak = memory_peak;
+	g_mutex_unlock(&memory_mutex);
+	return peak;
+}
+
+void halftone_memory_reset_peak(void)
+{
+	g_mutex_lock(&memory_mutex);
+	memory_peak = memory_in_use;
+	g_mutex_unlock(&memory_mutex);
+}
+
+/*
+ * Allocates an arena block of size bytes, header included. A result
+ * bitmap of hundreds of megabytes would take a page fault every 4 KB
+ * when first cleared, so large blocks are aligned to huge pages and
+ * the kernel is asked to back them with such.
+ */
+static HalftoneArenaBlock * arena_block_new(gsize size)
+{
+	gpointer memory;
+
+#ifdef G_OS_UNIX
+	if (posix_memalign(&memory, size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE
+	                   : HALFTONE_ARENA_ALIGNMENT, size) != 0) {
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	if (size >= HUGE_PAGE_SIZE) {
+		/* Only a hint; without huge pages the block works the same */
+		madvise(memory, size - size % HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+	}
+#endif
+#else
+	/* Aligned as g_try_malloc() aligns */
+	memory = g_try_malloc(size);
+	if (memory == NULL) {
+		return NULL;
+	}
+#endif
+	count_malloc(size);
+	((HalftoneArenaBlock *) memory)->size = size;
+	return (HalftoneArenaBlock *) memory;
+}
+
+static void arena_block_free(HalftoneArenaBlock * block)
+{
+	count_free(block->size);
+#ifdef G_OS_UNIX
+	free(block);
+#else
+	g_free(block);
+#endif
+}
+
+/* Bytes taken from an arena for size bytes */
+static gsize arena_size(gsize size)
+{
+	return (size + HALFTONE_ARENA_ALIGNMENT - 1)
+	       & ~(gsize) (HALFTONE_ARENA_ALIGNMENT - 1);
+}
+
+/* Bytes of a block for the arena's use */
+static gsize arena_block_room(const HalftoneArenaBlock * block)
+{
+	return block->size - HALFTONE_ARENA_ALIGNMENT;
+}
+
+/*
+ * Returns size bytes, aligned to HALFTONE_ARENA_ALIGNMENT, which stay
+ * until the next halftone_arena_reset().
+ *
+ * The blocks are filled in the order they were allocated. A render
+ * asks for the same buffers in the same order as the one before, so
+ * once the blocks fit a render, the next one like it allocates
+ * nothing. Blocks too small for a buffer, which this render has not
+ * used yet, are freed before a larger one is allocated, so memory
+ * grows by no more than the render needs.
+ * Returns NULL if out of memory.
+ */
+gpointer halftone_arena_alloc(HalftoneArena * arena, gsize size)
+{
+	HalftoneArenaBlock * block = arena->current;
+	HalftoneArenaBlock ** link;
+	gpointer memory;
+
+	size = arena_size(size);
+	if (block == NULL || arena->used + size > arena_block_room(block)) {
+		link = block != NULL ? &block->next : &arena->blocks;
+		while (*link != NULL && arena_block_room(*link) < size) {
+			block = *link;
+			*link = block->next;
+			arena_block_free(block);
+		}
+		if (*link == NULL) {
+			*link = arena_block_new(HALFTONE_ARENA_ALIGNMENT + size);
+			if (*link == NULL) {
+				return NULL;
+			}
+			(*link)->next = NULL;
+		}
+		block = *link;
+		arena->current = block;
+		arena->used = 0;
+	}
+	memory = (guchar *) block + HALFTONE_ARENA_ALIGNMENT + arena->used;
+	arena->used += size;
+	return memory;
+}
+
+/*
+ * Frees everything allocated from arena, keeping the blocks the last
+ * render used for the next one.
+ */
+void halftone_arena_reset(HalftoneArena * arena)
+{
+	HalftoneArenaBlock ** link;
+	HalftoneArenaBlock * block;
+
+	link = arena->current != NULL ? &arena->current->next : &arena->blocks;
+	while (*link != NULL) {
+		block = *link;
+		*link = block->next;
+		arena_block_free(block);
+	}
+	arena->current = NULL;
+	arena->used = 0;
+}
+
+/*
+ * Frees all memory of arena.
+ */
+void halftone_arena_clear(HalftoneArena * arena)
+{
+	arena->current = NULL;
+	halftone_arena_reset(arena);
+}
+
+/* Bytes of the blocks of arena */
+static gsize arena_blocks_size(const HalftoneArena * arena)
+{
+	const HalftoneArenaBlock * block;
+	gsize size = 0;
+
+	for (block = arena->blocks; block != NULL; block = block->next) {
+		size += block->size;
+	}
+	return size;
+}
+
+static gint compare_BitmapPixels(const void * a, const void * b)
+{
+	struct BitmapPixel * pa = (struct BitmapPixel *)a,
+				* pb = (struct BitmapPixel *)b;
+	gint distance_difference = pa->distance_from_center
+	        - pb->distance_from_center;
+	if (distance_difference > 0) {
+		return 1;
+	} else if (distance_difference < 0) {
+		return -1;
+	} else {
+		return 0;
+	}
+}
+
+/*
+ * Creates a list of pixels in the dot containing the x and y coordinates
+ * and the distance from the center of the dot.
+ * Pixels are sorted by their distance. The result is in dots->pixels_of_dot.
+ */
+static gboolean list_pixels_of_dot(HalftoneDots * dots)
+{
+	/* Create an array of max_dot_width x max_dot_width pixels,
+	 * representing bitmap of maximum-sized black dot.
+	 * Each pixel contains following information:
+	 * x and y position in bitmap and distance from the center
+	 * of the bitmap (~= the center of the dot).
+	 */
+	gint x, y, distance_x, distance_y;
+	gint dot_center_squared;
+	gint distance;
+	struct BitmapPixel * pixel;
+
+	dots->max_dot_width = dots->dot_spacing + 2;
+	if (dots->max_dot_width %2 == 0)
+		dots->max_dot_width += 1;
+	dots->dot_center = (dots->max_dot_width-1)/2;
+	dot_center_squared = dots->dot_center * dots->dot_center;
+	dots->pixels_in_dot_bitmap = dots->max_dot_width * dots->max_dot_width;
+
+	/* Create a list of pixels in the dot */
+	dots->pixels_of_dot = (struct BitmapPixel *) halftone_try_malloc(
+	        (gsize) dots->pixels_in_dot_bitmap * sizeof(struct BitmapPixel));
+	if (dots->pixels_of_dot == NULL) {
+		return FALSE;
+	}
+
+	/*
+	 * Measure pixels' distance from the center of the dot */
+	dots->max_pixels_in_dot = 0;
+	for (y = 0; y < dots->max_dot_width; y++) {
+		for (x = 0; x < dots->max_dot_width; x++) {
+			distance_x = x - dots->dot_center;
+			distance_y = y - dots->dot_center;
+
+			/* Since distances are calculated only to sort pixels by
+			 * their distance, the square of the distance is enough;
+			 * (a > b) <=> (sqrt(a) > sqrt(b)), so no time-consuming
+			 * square rooting calculation is required. */
+			distance = distance_x * distance_x + distance_y * distance_y;
+			if (distance < dot_center_squared) {
+				pixel = &dots->pixels_of_dot[dots->max_pixels_in_dot];
+				pixel->x_position = distance_x;
+				pixel->y_position = distance_y;
+				pixel->distance_from_center = distance;
+				dots->max_pixels_in_dot++;
+			}
+		}
+	}
+	qsort(dots->pixels_of_dot, dots->max_pixels_in_dot,
+	      sizeof(struct BitmapPixel), compare_BitmapPixels);
+
+	return TRUE;
+}
+
+/*
+ * Assigns dot sizes to luminance values.
+ * Fills pixel_count_of_luminance.
+ * Paints five black dots on bitmap with size of dot_spacing X dot_spacing
+ * and white background with four dots on each corner and one at the center,
+ * growing dot sizes pixel by pixel and measuring white pixels / all pixels
+ * ratio = final luminance.
+ */
+static gboolean calibrate_dot_sizes(HalftoneDots * dots)
+{
+	struct BWBitmap test_image;
+	gint dot_spacing = dots->dot_spacing;
+	gint x, y, image_center;
+	gint n, black_pixels_in_bitmap, test_image_size;
+	gint shade, previous_shade, dot_pixel_size;
+	gint shade_ranges[LUMINANCES], shade_range_dot_sizes[LUMINANCES];
+	gint shade_range_count;
+	gint luminance, shade_range, range_max, range_min;
+
+	test_image.x_size = dot_spacing;
+	test_image.y_size = dot_spacing;
+	test_image_size = test_image.x_size * test_image.y_size;
+	image_center = dot_spacing / 2;
+	test_image.pixels = (guchar *) halftone_try_malloc(test_image_size);
+	dots->shade_of_pixel_count = (guint16 *) halftone_try_malloc(
+	        (dots->max_pixels_in_dot + 1) * sizeof(guint16));
+	if (test_image.pixels == NULL || dots->shade_of_pixel_count == NULL) {
+		halftone_free(test_image.pixels, test_image_size);
+		return FALSE;
+	}
+	memset(test_image.pixels, WHITE, test_image_size);
+	/* Go through every dot size (in pixels)
+	 * beginning from luminance == 255 (white, dot size == 0)
+	 * and mark dot sizes where luminance changes
+	 * until luminance == 0 (black) is reached.
+	 * So n luminance ranges are found where
+	 * luminance(range 0) = white and luminance (range n-1) = black. */
+	black_pixels_in_bitmap = 0;
+	dot_pixel_size = 0;
+	previous_shade = WHITE;
+	shade_ranges[0] = 255;
+	shade_range_dot_sizes[0] = 0;
+	shade_range_count = 1;
+	dots->shade_of_pixel_count[0] = MAX_LUMINANCE16;
+	for (dot_pixel_size = 0; dot_pixel_size < dots->max_pixels_in_dot;) {
+		x = dots->pixels_of_dot[dot_pixel_size].x_position;
+		y = dots->pixels_of_dot[dot_pixel_size].y_position;
+		n = paint_pixel(&test_image, x, y);
+		n += paint_pixel(&test_image, dot_spacing + x, y);
+		n += paint_pixel(&test_image, x, dot_spacing + y);
+		n += paint_pixel(&test_image, dot_spacing + x, dot_spacing + y);
+		n += paint_pixel(&test_image, image_center + x, image_center + y);
+		black_pixels_in_bitmap += n;
+		dot_pixel_size++;
+		dots->shade_of_pixel_count[dot_pixel_size] = MAX_LUMINANCE16
+			- (gint64) MAX_LUMINANCE16 * black_pixels_in_bitmap
+			  / test_image_size;
+		shade = WHITE - WHITE * black_pixels_in_bitmap / test_image_size;
+		if (shade < previous_shade) {
+			shade_ranges[shade_range_count] = shade;
+			shade_range_dot_sizes[shade_range_count] = dot_pixel_size;
+			shade_range_count++;
+			previous_shade = shade;
+		}
+		if (shade == 0) {
+			break;
+		}
+	}
+	/* Larger dots are black too */
+	while (dot_pixel_size < dots->max_pixels_in_dot) {
+		dots->shade_of_pixel_count[++dot_pixel_size] = 0;
+	}
+	/* Make the luminance ranges overlap so that one range changes
+	 * to another at the halfway of both ranges' luminances.
+	 * Example: luminances a = 199, b = 142, c = 85.
+	 * Range containing luminance b
+	 * is from (a + b) / 2 = (199 + 142) / 2 = 170
+	 *    to   (b + c) / 2 - 1 = (142 + 85) / 2 - 1 = 112.
+	 * After that the sum of all the output luminances
+	 * at input luminance = 0..255 is the same as
+	 * when output luminances = input luminances.
+	 */
+	/* last range: white only */
+	for (luminance = WHITE, range_min = (shade_ranges[1] + WHITE) / 2;
+			luminance > range_min; luminance--) {
+		dots->pixel_count_of_luminance[luminance] = 0;
+	}
+	for (shade_range = 1; shade_range < shade_range_count - 1;
+			shade_range++) {
+		range_max = (shade_ranges[shade_range - 1] +
+		        shade_ranges[shade_range]) / 2;
+		range_min = (shade_ranges[shade_range + 1] +
+				shade_ranges[shade_range]) / 2;
+		for (luminance = range_max; luminance > range_min; luminance--) {
+			dots->pixel_count_of_luminance[luminance] =
+				shade_range_dot_sizes[shade_range];
+		}
+	}
+	/* first range: black only. */
+	for (; luminance >= 0; luminance--) {
+		dots->pixel_count_of_luminance[luminance] =
+			shade_range_dot_sizes[shade_range];
+	}
+	halftone_free(test_image.pixels, test_image_size);
+	return TRUE;
+}
+
+/*
+ * Tries to paint a black pixel in given bitmap
+ * Returns number of white pixels changed to black (1 or 0)
+ */
+static gint paint_pixel(struct BWBitmap * image, const gint x, const gint y)
+{
+	gint index;
+	if ((x >= 0) && (x < image->x_size) && (y >= 0) && (y < image->y_size)) {
+		index = y * image->x_size + x;
+		if (image->pixels[index] == WHITE) {
+			image->pixels[index] = BLACK;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Generates precalculated dot images used in actual filtering
+ */
+static gboolean precalculate_dots(HalftoneDots * dots)
+{
+	gint luminance, dot_pixel_size, x, y, index, base_index;
+	gint pixels_in_dot_bitmap = dots->pixels_in_dot_bitmap;
+
+	dots->precalculated_dots = (guchar *) halftone_try_malloc(
+	        (gsize) pixels_in_dot_bitmap * LUMINANCES);
+	dots->pixel_order = (gint *) halftone_try_malloc(
+	        (gsize) pixels_in_dot_bitmap * sizeof(gint));
+	if (dots->precalculated_dots == NULL || dots->pixel_order == NULL) {
+		return FALSE;
+	}
+
+	for (index = 0; index < pixels_in_dot_bitmap; index++) {
+		dots->pixel_order[index] = G_MAXINT;
+	}
+	for (dot_pixel_size = 0; dot_pixel_size < dots->max_pixels_in_dot;
+	        dot_pixel_size++) {
+		x = dots->dot_center + dots->pixels_of_dot[dot_pixel_size].x_position;
+		y = dots->dot_center + dots->pixels_of_dot[dot_pixel_size].y_position;
+		dots->pixel_order[y * dots->max_dot_width + x] = dot_pixel_size;
+	}
+
+	/* Generate bitmap with white background.
+	 * Generally, copy bitmap to next luminance value
+	 * and add some black pixels each round. */
+	dot_pixel_size = 0;
+	base_index = WHITE * pixels_in_dot_bitmap;
+	memset(dots->precalculated_dots + base_index, WHITE, pixels_in_dot_bitmap);
+
+	for (luminance = WHITE; luminance >= BLACK;
+	        luminance--, base_index -= pixels_in_dot_bitmap) {
+		while (dot_pixel_size < dots->pixel_count_of_luminance[luminance]) {
+			x = dots->dot_center
+			    + dots->pixels_of_dot[dot_pixel_size].x_position;
+			y = dots->dot_center
+			    + dots->pixels_of_dot[dot_pixel_size].y_position;
+			index = y * dots->max_dot_width + x;
+			dots->precalculated_dots[base_index + index] = BLACK;
+			dot_pixel_size++;
+		}
+		if (luminance > 0) {
+			memcpy(dots->precalculated_dots + base_index
+			         - pixels_in_dot_bitmap,
+			       dots->precalculated_dots + base_index,
+			       pixels_in_dot_bitmap);
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Finds the black run of each row of each precalculated dot.
+ * Empty rows get an empty run.
+ */
+static gboolean precalculate_spans(HalftoneDots * dots)
+{
+	gint max_dot_width = dots->max_dot_width;
+	gint luminance, row, x, start, end;
+	const guchar * pixels;
+	gint16 * span;
+
+	dots->dot_spans = (gint16 *) halftone_try_malloc(
+	        (gsize) LUMINANCES * max_dot_width * 2 * sizeof(gint16));
+	if (dots->dot_spans == NULL) {
+		return FALSE;
+	}
+	pixels = dots->precalculated_dots;
+	span = dots->dot_spans;
+	for (luminance = 0; luminance < LUMINANCES; luminance++) {
+		for (row = 0; row < max_dot_width; row++) {
+			start = max_dot_width;
+			end = 0;
+			for (x = 0; x < max_dot_width; x++) {
+				if (pixels[x] == BLACK) {
+					start = MIN(start, x);
+					end = x + 1;
+				}
+			}
+			span[0] = MIN(start, end);
+			span[1] = end;
+			pixels += max_dot_width;
+			span += 2;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Makes the masks of the bitboard engine for small dots.
+ *
+ * The bitboard keeps the result as 8 x 8 pixel tiles of 64 bits:
+ * bit 8 * row + column is set for a black pixel. A dot of up to
+ * 7 x 7 pixels, moved right by 0 .. 7 columns, reaches at most one
+ * tile to the right: bitboard_masks[2 * (8 * luminance + shift)] is
+ * the dot in a tile's top left corner, moved right by shift, and the
+ * next mask is what went over to the tile on the right. Moving down is
+ * a shift of the whole mask, see paint_bitboard_row().
+ */
+static gboolean precalculate_bitboard(HalftoneDots * dots)
+{
+	gint max_dot_width = dots->max_dot_width;
+	gint luminance, shift, row, column, x;
+	const guchar * pixels;
+	guint64 * mask;
+
+	if (max_dot_width > BITBOARD_MAX_DOT_WIDTH) {
+		return TRUE;
+	}
+	dots->bitboard_masks = (guint64 *) halftone_try_malloc(
+	        BITBOARD_MASKS * sizeof(guint64));
+	if (dots->bitboard_masks == NULL) {
+		return FALSE;
+	}
+	memset(dots->bitboard_masks, 0, BITBOARD_MASKS * sizeof(guint64));
+	for (luminance = 0; luminance < LUMINANCES; luminance++) {
+		pixels = dots->precalculated_dots
+		         + luminance * dots->pixels_in_dot_bitmap;
+		for (shift = 0; shift < 8; shift++) {
+			mask = dots->bitboard_masks + 2 * (8 * luminance + shift);
+			for (row = 0; row < max_dot_width; row++) {
+				for (column = 0; column < max_dot_width; column++) {
+					if (pixels[row * max_dot_width + column] != BLACK) {
+						continue;
+					}
+					x = column + shift;
+					if (x < 8) {
+						mask[0] |= G_GUINT64_CONSTANT(1) << (8 * row + x);
+					} else {
+						mask[1] |= G_GUINT64_CONSTANT(1) << (8 * row + x - 8);
+					}
+				}
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Finds the dot size whose shade is nearest to luminance.
+ */
+gint halftone_dots_pixel_count16(const HalftoneDots * dots,
+                                 guint16 luminance)
+{
+	const guint16 * shade = dots->shade_of_pixel_count;
+	gint low = 0;
+	gint high = dots->max_pixels_in_dot;
+	gint middle;
+
+	/* Shades get darker as dots grow.
+	 * Find the smallest dot at least as dark as luminance... */
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (shade[middle] > luminance) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	/* ...or the one before it, if that is nearer */
+	if (low > 0 && shade[low - 1] - luminance < luminance - shade[low]) {
+		low--;
+	}
+	return low;
+}
+
+/*
+ * Starts a render of source: frees the buffers of the previous render
+ * and allocates result_image and the scanline buffer from the arena.
+ * Memory is reused if the previous render was as large.
+ */
+gboolean halftone_context_prepare(HalftoneContext * ctx,
+                                  const HalftoneSource * source)
+{
+	return prepare_buffers(ctx, source->width, source->height,
+	                       (gsize) source->width * source->channels
+	                       * halftone_sample_size(source->format));
+}
+
+static gboolean prepare_buffers(HalftoneContext * ctx, gint width,
+                                gint height, gsize scanline_size)
+{
+	struct BWBitmap * result_image = &ctx->result_image;
+
+	halftone_arena_reset(&ctx->arena);
+	result_image->pixels = (guchar *) halftone_arena_alloc(&ctx->arena,
+	        (gsize) width * height);
+	ctx->scanline = (guchar *) halftone_arena_alloc(&ctx->arena,
+	                                                scanline_size);
+	if (result_image->pixels == NULL || ctx->scanline == NULL) {
+		return FALSE;
+	}
+	result_image->x_size = width;
+	result_image->y_size = height;
+	return TRUE;
+}
+
+/*
+ * Clears a bitboard for a width x height result, with a border of one
+ * tile on each side for the dots reaching over the edges. Result pixel
+ * (0, 0) is the top left pixel of tile (1, 1).
+ */
+static gboolean prepare_tiles(HalftoneContext * ctx, gint width, gint height)
+{
+	gint tiles_x = (width + 7) / 8 + 2;
+	gint tiles_y = (height + 7) / 8 + 2;
+	gsize size = (gsize) tiles_x * tiles_y * sizeof(guint64);
+
+	ctx->tiles = (guint64 *) halftone_arena_alloc(&ctx->arena, size);
+	if (ctx->tiles == NULL) {
+		return FALSE;
+	}
+	memset(ctx->tiles, 0, size);
+	ctx->tiles_x = tiles_x;
+	return TRUE;
+}
+
+/*
+ * ORs a row of count dots into the bitboard: the dots centered at result
+ * pixels (x, y), (x + dot_spacing, y), ..., with luminances[0],
+ * luminances[1], ...
+ *
+ * A dot is at most 7 x 7 pixels, so it lands on at most 2 x 2 tiles,
+ * and there is no clipping: the border tiles take what falls outside.
+ * Dots are at most 5 pixels apart, so the row moves right at most one
+ * tile per dot; the tiles under the current dot are kept in registers
+ * and written when the row has left them.
+ */
+static void paint_bitboard_row(const HalftoneDots * dots,
+                               HalftoneContext * ctx, gint y,
+                               gint x, gint count,
+                               const guchar * luminances)
+{
+	gint top = y - dots->dot_center + 8;
+	gint shift = 8 * (top & 7);
+	guint64 * upper = ctx->tiles + (gsize) (top >> 3) * ctx->tiles_x;
+	guint64 * lower = upper + ctx->tiles_x;
+	guint64 upper_left = 0, upper_right = 0;
+	guint64 lower_left = 0, lower_right = 0;
+	gint tile_x = -1;
+	gint left, n;
+	const guint64 * mask;
+
+	for (n = 0; n < count; n++, x += dots->dot_spacing) {
+		left = x - dots->dot_center + 8;
+		if (left >> 3 != tile_x) {
+			if (tile_x >= 0) {
+				upper[tile_x] |= upper_left;
+				lower[tile_x] |= lower_left;
+			}
+			upper_left = upper_right;
+			lower_left = lower_right;
+			upper_right = 0;
+			lower_right = 0;
+			tile_x = left >> 3;
+		}
+		mask = dots->bitboard_masks + 2 * (8 * luminances[n] + (left & 7));
+		upper_left |= mask[0] << shift;
+		upper_right |= mask[1] << shift;
+		/* Rows moved past the bottom go to the tiles below. Shifting
+		 * by 64 bits is undefined, so when shift is 0, by 1 + 63. */
+		lower_left |= (mask[0] >> 1) >> (63 - shift);
+		lower_right |= (mask[1] >> 1) >> (63 - shift);
+	}
+	if (tile_x >= 0) {
+		upper[tile_x] |= upper_left;
+		upper[tile_x + 1] |= upper_right;
+		lower[tile_x] |= lower_left;
+		lower[tile_x + 1] |= lower_right;
+	}
+}
+
+/*
+ * Replaces the start of an 8-bit scanline with the luminances of its
+ * pixels x, x + dot_spacing, ... left of x_end, for paint_bitboard_row().
+ * Returns their count. Works in place, as pixel n is never left of
+ * byte n.
+ */
+static gint lattice_luminances(guchar * scanline, gint x, gint x_end,
+                               gint dot_spacing, gint channels)
+{
+	gint n;
+
+	for (n = 0; x < x_end; n++, x += dot_spacing) {
+		scanline[n] = halftone_luminance(scanline + x * channels, channels);
+	}
+	return n;
+}
+
+/* The 8 pixels of the low 8 bits of a tile row, WHITE or BLACK,
+ * in the order they lie in memory */
+static inline guint64 expand_tile_row(guint64 bits)
+{
+	/* Bit n to byte n... */
+	guint64 spread = (bits * G_GUINT64_CONSTANT(0x0101010101010101))
+	                 & G_GUINT64_CONSTANT(0x8040201008040201);
+	/* ...to the top bit of byte n... */
+	guint64 black = ((spread + G_GUINT64_CONSTANT(0x7f7f7f7f7f7f7f7f))
+	                 | spread) & G_GUINT64_CONSTANT(0x8080808080808080);
+
+	/* ...to a whole byte */
+	return GUINT64_TO_LE(~((black >> 7) * 0xff));
+}
+
+/*
+ * Copies rows first_row .. end_row - 1 of the bitboard to
+ * ctx->result_image.
+ */
+static void tiles_to_bitmap(HalftoneContext * ctx, gint first_row,
+                            gint end_row)
+{
+	struct BWBitmap * result_image = &ctx->result_image;
+	gint width = result_image->x_size;
+	gint x, y, shift;
+	const guint64 * tile;
+	guchar * dest;
+	guint64 pixels;
+
+	for (y = first_row; y < end_row; y++) {
+		tile = ctx->tiles + (gsize) (y / 8 + 1) * ctx->tiles_x + 1;
+		shift = 8 * (y & 7);
+		dest = result_image->pixels + (gsize) y * width;
+		for (x = 0; x + 8 <= width; x += 8, tile++) {
+			pixels = expand_tile_row((*tile >> shift) & 0xff);
+			memcpy(dest + x, &pixels, 8);
+		}
+		if (x < width) {
+			pixels = expand_tile_row((*tile >> shift) & 0xff);
+			memcpy(dest + x, &pixels, width - x);
+		}
+	}
+}
+
+/*
+ * Does the actual filtering. The result is in ctx->result_image.
+ * Returns FALSE if out of memory or if source->get_row fails.
+ */
+gboolean halftone_context_render(HalftoneContext * ctx,
+                                 const HalftoneSource * source)
+{
+	const HalftoneDots * dots = ctx->dots;
+	struct BWBitmap * result_image = &ctx->result_image;
+	gint dot_spacing = dots->dot_spacing;
+	gint channels = source->channels;
+	gint x, y, index, count;
+	gint index_step = dot_spacing * channels;
+	guchar * scanline;
+	guchar luminance;
+	gint phase;
+	PaintFunc paint = paint_func(dots, dots->paint_strategy);
+	gboolean bitboard = dots->bitboard_masks != NULL;
+
+	if (halftone_context_prepare(ctx, source) == FALSE) {
+		return FALSE;
+	}
+	scanline = ctx->scanline;
+	memset(result_image->pixels, WHITE,
+	       (gsize) result_image->x_size * result_image->y_size);
+	if (source->format != HALFTONE_FORMAT_U8) {
+		return render_fine(ctx, source);
+	}
+	if (bitboard && prepare_tiles(ctx, result_image->x_size,
+	                              result_image->y_size) == FALSE) {
+		return FALSE;
+	}
+#if 1
+	// yksi for(phase) lisää ei näytä hidastavan huomattavasti
+	// gimp_pixel_rgn_get_row vie 70% suoritusajasta
+	// pistekoosta riippumatta.
+	// optimointi: muuta gimp_pixel_rgn_get_row
+	// gimp_pixel_rgb_get_rectiksi, y-koko maks. 64
+	//
+	// paint_dot vie 10% suoritusajasta (koolla 8)
+	//   koolla 6 2x ajan vrt koolla 8
+	//   koolla 5 2.5x ajan vrt koolla 8
+	//   koolla 4 8x ajan vrt koolla 8
+	//   koolla 2 9x ajan vrt koolla 8
+	// optimointi hankalaa nimenomaan pienellä pistekoolla
+    //
+	for (phase = 0; phase < 2; phase++) {
+	for (y = phase * dot_spacing / 2;
+			y < result_image->y_size; y += dot_spacing) {
+		if (source->get_row(y, scanline, source->user_data) == FALSE) {
+			return FALSE;
+		}
+		if (bitboard) {
+			x = phase * dot_spacing / 2;
+			count = lattice_luminances(scanline, x, result_image->x_size,
+			                           dot_spacing, channels);
+			paint_bitboard_row(dots, ctx, y, x, count, scanline);
+		} else {
+		for (x = phase * dot_spacing / 2, index = x * channels;
+		        x < result_image->x_size;
+		        x += dot_spacing, index += index_step) {
+			luminance = halftone_luminance(scanline + index, channels);
+			paint(dots, result_image, x, y, luminance);
+		}
+		}
+		if (source->progress != NULL) {
+			source->progress((gdouble)y / (gdouble)result_image->y_size
+			                 * 0.5 + (gdouble)phase * 0.5,
+			                 source->user_data);
+		}
+	}
+	}
+	if (bitboard) {
+		tiles_to_bitmap(ctx, 0, result_image->y_size);
+	}
+#else
+	/* Unoptimized version */
+
+	for (y = 0; y < result_image->y_size; y += dot_spacing) {
+		source->get_row(y, scanline, source->user_data);
+		for (x = 0, index = 0; x < result_image->x_size;
+		        x += dot_spacing, index += index_step) {
+			luminance = halftone_luminance(scanline + index, channels);
+			paint_dot(dots, result_image, x, y, luminance);
+		}
+	}
+	for (y = dot_spacing / 2; y < result_image->y_size; y += dot_spacing) {
+		source->get_row(y, scanline, source->user_data);
+		for (x = dot_spacing / 2, index = x * channels;
+		        x < result_image->x_size;
+		        x += dot_spacing, index += index_step) {
+			luminance = halftone_luminance(scanline + index, channels);
+			paint_dot(dots, result_image, x, y, luminance);
+		}
+	}
+#endif
+	return TRUE;
+}
+
+/*
+ * Renders the area x, y, width, height of a larger image into
+ * ctx->result_image, which gets the size of the area. The dot lattice
+ * is anchored at the origin of the image, not of the area, so areas
+ * rendered separately fit together without seams.
+ *
+ * Dots centered up to dot_center pixels outside the area reach into it,
+ * so source must cover the area grown by halftone_region_margin() on
+ * each side: source row 0, column 0 is image pixel (x - margin,
+ * y - margin). Pixels outside the image should be white, as no dots
+ * are centered there in halftone_context_render().
+ * Returns FALSE if out of memory or if source->get_row fails.
+ */
+gboolean halftone_context_render_region(HalftoneContext * ctx,
+                                        const HalftoneSource * source,
+                                        gint x, gint y,
+                                        gint width, gint height)
+{
+	const HalftoneDots * dots = ctx->dots;
+	struct BWBitmap * result_image = &ctx->result_image;
+	gint dot_spacing = dots->dot_spacing;
+	gint margin = halftone_region_margin(dots);
+	gint phase, offset, dot_x, dot_y, pixel_count, count;
+	guint16 luminance;
+	PaintFunc paint = paint_func(dots, dots->paint_strategy);
+	gboolean bitboard = dots->bitboard_masks != NULL
+	                    && source->format == HALFTONE_FORMAT_U8;
+
+	if (source->width != width + 2 * margin
+		|| source->height != height + 2 * margin) {
+		return FALSE;
+	}
+	if (prepare_buffers(ctx, width, height,
+	                    (gsize) source->width * source->channels
+	                    * halftone_sample_size(source->format)) == FALSE) {
+		return FALSE;
+	}
+	memset(result_image->pixels, WHITE, (gsize) width * height);
+	if (bitboard && prepare_tiles(ctx, width, height) == FALSE) {
+		return FALSE;
+	}
+
+	for (phase = 0; phase < 2; phase++) {
+		offset = phase * dot_spacing / 2;
+		for (dot_y = first_on_lattice(y - margin, offset, dot_spacing);
+		        dot_y < y + height + margin; dot_y += dot_spacing) {
+			if (source->get_row(dot_y - y + margin, ctx->scanline,
+			                    source->user_data) == FALSE) {
+				return FALSE;
+			}
+			if (bitboard) {
+				dot_x = first_on_lattice(x - margin, offset, dot_spacing);
+				count = lattice_luminances(ctx->scanline, dot_x - x + margin,
+				                           width + 2 * margin, dot_spacing,
+				                           source->channels);
+				paint_bitboard_row(dots, ctx, dot_y - y, dot_x - x, count,
+				                   ctx->scanline);
+				continue;
+			}
+			for (dot_x = first_on_lattice(x - margin, offset, dot_spacing);
+			        dot_x < x + width + margin; dot_x += dot_spacing) {
+				luminance = halftone_luminance16(ctx->scanline,
+				                                 dot_x - x + margin,
+				                                 source->channels,
+				                                 source->format);
+				if (source->format == HALFTONE_FORMAT_U8) {
+					paint(dots, result_image, dot_x - x, dot_y - y,
+					      luminance / 257);
+				} else {
+					pixel_count = halftone_dots_pixel_count16(dots,
+					                                          luminance);
+					if (pixel_count > 0) {
+						paint_fine_dot(dots, result_image,
+						               dot_x - x, dot_y - y, pixel_count);
+					}
+				}
+			}
+		}
+	}
+	if (bitboard) {
+		tiles_to_bitmap(ctx, 0, height);
+	}
+	return TRUE;
+}
+
+/*
+ * Parallel painting.
+ *
+ * Dots of one phase of the lattice are dot_spacing apart but
+ * max_dot_width = dot_spacing + 2 or + 3 pixels wide, so neighbors
+ * overlap by a pixel or two, and painters which read and write back
+ * whole bytes or tiles must not paint them at the same time. Dots
+ * further apart may: a painter touches nothing outside the
+ * max_dot_width square around the center, or for the bitboard, outside
+ * 2 x 2 tiles, which is less than 16 pixels from the center's tile.
+ *
+ * So the lattice rows of each phase are colored row_colors ways, row r
+ * with color r % row_colors, and each row is cut into blocks of
+ * block_dots dots, colored 2 ways. Blocks of one phase and colors, a
+ * class, are so far apart that painting one never touches another. All
+ * threads paint the blocks of one class at once, without locks, and meet
+ * at a barrier before the next class. Painting only ever turns pixels
+ * black, so the result is the same as from halftone_context_render()
+ * whatever the order.
+ *
+ * Blocks split the width as well as the height, so a short and wide
+ * image keeps all threads busy where bands of rows would not.
+ */
+
+/* Narrowest block, so that a thread paints a run of nearby dots */
+#define PARALLEL_BLOCK_WIDTH 64
+
+struct ParallelJob {
+	HalftoneContext * ctx;
+	const HalftoneSource * source;
+	PaintFunc paint;
+	gboolean bitboard;
+	gboolean fine;
+
+	/* Luminances of the dots of 8-bit sources, pixel counts of others,
+	 * phase by phase, row by row: ctx->lattice from first_value[phase].
+	 * Read before painting, as source->get_row is not thread safe. */
+	gint rows[2];
+	gint columns[2];
+	gsize first_value[2];
+	gint row_colors;
+	gint block_dots;
+};
+
+/* Lattice points of one phase, rows or columns, over length pixels */
+static gint lattice_points(gint length, gint dot_spacing, gint phase)
+{
+	gint offset = phase * dot_spacing / 2;
+
+	if (length <= offset) {
+		return 0;
+	}
+	return (length - offset + dot_spacing - 1) / dot_spacing;
+}
+
+/* Bytes of ctx->lattice for a parallel render of source */
+static gsize lattice_size(const HalftoneDots * dots,
+                          const HalftoneSource * source)
+{
+	gsize points = 0;
+	gint phase;
+
+	for (phase = 0; phase < 2; phase++) {
+		points += (gsize) lattice_points(source->width, dots->dot_spacing,
+		                                 phase)
+		          * lattice_points(source->height, dots->dot_spacing, phase);
+	}
+	if (source->format == HALFTONE_FORMAT_U8) {
+		return points;
+	}
+	return points * sizeof(gint);
+}
+
+/*
+ * Reads the value of every dot into ctx->lattice, for the first half
+ * of the progress.
+ */
+static gboolean read_lattice(struct ParallelJob * job)
+{
+	HalftoneContext * ctx = job->ctx;
+	const HalftoneSource * source = job->source;
+	gint dot_spacing = ctx->dots->dot_spacing;
+	gint phase, row, column, offset, x, y;
+	gsize index;
+
+	for (phase = 0; phase < 2; phase++) {
+		offset = phase * dot_spacing / 2;
+		for (row = 0; row < job->rows[phase]; row++) {
+			y = offset + row * dot_spacing;
+			if (source->get_row(y, ctx->scanline,
+			                    source->user_data) == FALSE) {
+				return FALSE;
+			}
+			index = job->first_value[phase]
+			        + (gsize) row * job->columns[phase];
+			for (column = 0, x = offset; column < job->columns[phase];
+			        column++, x += dot_spacing, index++) {
+				if (job->fine) {
+					((gint *) ctx->lattice)[index] =
+					        halftone_dots_pixel_count16(ctx->dots,
+					                halftone_luminance16(ctx->scanline, x,
+					                                     source->channels,
+					                                     source->format));
+				} else {
+					ctx->lattice[index] = halftone_luminance(
+					        ctx->scanline + x * source->channels,
+					        source->channels);
+				}
+			}
+			if (source->progress != NULL) {
+				source->progress((gdouble) y / source->height * 0.25
+				                 + phase * 0.25, source->user_data);
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Paints block block of lattice row row of phase.
+ */
+static void paint_block(struct ParallelJob * job, gint phase, gint row,
+                        gint block)
+{
+	HalftoneContext * ctx = job->ctx;
+	const HalftoneDots * dots = ctx->dots;
+	gint dot_spacing = dots->dot_spacing;
+	gint offset = phase * dot_spacing / 2;
+	gint first = block * job->block_dots;
+	gint count = MIN(job->block_dots, job->columns[phase] - first);
+	gint x = offset + first * dot_spacing;
+	gint y = offset + row * dot_spacing;
+	gsize index = job->first_value[phase]
+	              + (gsize) row * job->columns[phase] + first;
+	const gint * pixel_counts;
+	gint n;
+
+	if (job->bitboard) {
+		paint_bitboard_row(dots, ctx, y, x, count, ctx->lattice + index);
+	} else if (job->fine) {
+		pixel_counts = (const gint *) ctx->lattice + index;
+		for (n = 0; n < count; n++, x += dot_spacing) {
+			if (pixel_counts[n] > 0) {
+				paint_fine_dot(dots, &ctx->result_image, x, y,
+				               pixel_counts[n]);
+			}
+		}
+	} else {
+		for (n = 0; n < count; n++, x += dot_spacing) {
+			job->paint(dots, &ctx->result_image, x, y,
+			           ctx->lattice[index + n]);
+		}
+	}
+}
+
+static void paint_team(HalftoneTeam * team, gint index, gpointer data)
+{
+	struct ParallelJob * job = (struct ParallelJob *) data;
+	const HalftoneSource * source = job->source;
+	gint classes = 2 * job->row_colors * 2;
+	gint class = 0;
+	gint phase, row_color, block_color, rows, blocks, height;
+	gint64 units, unit, last;
+
+	for (phase = 0; phase < 2; phase++) {
+		for (row_color = 0; row_color < job->row_colors; row_color++) {
+			for (block_color = 0; block_color < 2; block_color++) {
+				/* Rows and blocks of the class, split evenly */
+				rows = (job->rows[phase] - row_color + job->row_colors - 1)
+				       / job->row_colors;
+				blocks = ((job->columns[phase] + job->block_dots - 1)
+				          / job->block_dots - block_color + 1) / 2;
+				units = (gint64) MAX(rows, 0) * MAX(blocks, 0);
+				last = units * (index + 1) / team->thread_count;
+				for (unit = units * index / team->thread_count;
+				        unit < last; unit++) {
+					paint_block(job, phase,
+					            row_color + unit / blocks * job->row_colors,
+					            block_color + unit % blocks * 2);
+				}
+				halftone_team_barrier(team);
+				class++;
+				if (index == 0 && source->progress != NULL) {
+					source->progress(0.5 + 0.5 * class / classes,
+					                 source->user_data);
+				}
+			}
+		}
+	}
+	if (job->bitboard) {
+		height = job->ctx->result_image.y_size;
+		tiles_to_bitmap(job->ctx,
+		                height * index / team->thread_count,
+		                height * (index + 1) / team->thread_count);
+	}
+}
+
+/*
+ * Renders source like halftone_context_render(), with the painting
+ * split between threads threads, 0 = one per processor. The result is
+ * the same, bit for bit. source->get_row is only called from the
+ * calling thread.
+ * Returns FALSE if out of memory or if source->get_row fails.
+ */
+gboolean halftone_context_render_parallel(HalftoneContext * ctx,
+                                          const HalftoneSource * source,
+                                          gint threads)
+{
+	const HalftoneDots * dots = ctx->dots;
+	struct ParallelJob job;
+	gint dot_spacing = dots->dot_spacing;
+	gsize size = lattice_size(dots, source);
+	gint reach, phase;
+
+	job.ctx = ctx;
+	job.source = source;
+	job.paint = paint_func(dots, dots->paint_strategy);
+	job.fine = source->format != HALFTONE_FORMAT_U8;
+	job.bitboard = dots->bitboard_masks != NULL && !job.fine;
+	for (phase = 0; phase < 2; phase++) {
+		job.rows[phase] = lattice_points(source->height, dot_spacing, phase);
+		job.columns[phase] = lattice_points(source->width, dot_spacing,
+		                                    phase);
+	}
+	job.first_value[0] = 0;
+	job.first_value[1] = (gsize) job.rows[0] * job.columns[0];
+
+	/* Dots of a class are at least reach pixels apart */
+	reach = job.bitboard ? 16 : dots->max_dot_width;
+	job.row_colors = (reach + dot_spacing - 1) / dot_spacing;
+	job.block_dots = MAX((reach + dot_spacing - 1) / dot_spacing - 1,
+	                     (PARALLEL_BLOCK_WIDTH + dot_spacing - 1)
+	                     / dot_spacing);
+
+	/* No more threads than blocks in the first class. One thread
+	 * gains nothing from reading the dots ahead. */
+	if (threads <= 0) {
+		threads = g_get_num_processors();
+	}
+	threads = CLAMP(threads, 1,
+	                MAX((job.rows[0] + job.row_colors - 1) / job.row_colors
+	                    * ((job.columns[0] + 2 * job.block_dots - 1)
+	                       / (2 * job.block_dots)), 1));
+	if (threads == 1) {
+		return halftone_context_render(ctx, source);
+	}
+
+	if (halftone_context_prepare(ctx, source) == FALSE) {
+		return FALSE;
+	}
+	ctx->lattice = (guchar *) halftone_arena_alloc(&ctx->arena, size);
+	if (ctx->lattice == NULL) {
+		return FALSE;
+	}
+	memset(ctx->result_image.pixels, WHITE,
+	       (gsize) source->width * source->height);
+	if (job.bitboard && prepare_tiles(ctx, source->width,
+	                                  source->height) == FALSE) {
+		return FALSE;
+	}
+	if (read_lattice(&job) == FALSE) {
+		return FALSE;
+	}
+
+	/* The calling thread is member 0 */
+	halftone_team_run(threads, paint_team, &job);
+	return TRUE;
+}
+
+/* Up to 4 buffers of a render, each padded to the arena alignment and
+ * on the first render in a block of its own */
+#define RENDER_ARENA_OVERHEAD (4 * 2 * HALFTONE_ARENA_ALIGNMENT)
+
+/* Bytes of a row of bitboard tiles for source, 0 without a bitboard */
+static gsize tile_row_size(const HalftoneDots * dots,
+                           const HalftoneSource * source)
+{
+	if (dots->bitboard_masks == NULL
+		|| source->format != HALFTONE_FORMAT_U8) {
+		return 0;
+	}
+	return (gsize) ((source->width + 7) / 8 + 2) * sizeof(guint64);
+}
+
+/*
+ * Bytes of scratch buffers that rendering source takes besides the dot
+ * tables, if it is rendered stripe_height rows at a time with
+ * halftone_context_render_stripes(). stripe_height = source->height
+ * is halftone_context_render() or halftone_context_render_parallel()
+ * in one piece.
+ */
+gsize halftone_render_size(const HalftoneDots * dots,
+                           const HalftoneSource * source, gint stripe_height)
+{
+	gsize pixel_size = source->channels * halftone_sample_size(source->format);
+	gint margin = halftone_region_margin(dots);
+
+	gsize tiles;
+
+	stripe_height = MIN(stripe_height, source->height);
+	tiles = tile_row_size(dots, source) * ((stripe_height + 7) / 8 + 2);
+	if (stripe_height == source->height) {
+		return (gsize) source->width * source->height
+		       + source->width * pixel_size + tiles
+		       + lattice_size(dots, source) + RENDER_ARENA_OVERHEAD;
+	}
+	return (gsize) source->width * stripe_height
+	       + (source->width + 2 * margin) * pixel_size + tiles
+	       + RENDER_ARENA_OVERHEAD;
+}
+
+/*
+ * Returns the most rows per stripe for which rendering source fits
+ * in budget bytes besides the dot tables: source->height if the
+ * image fits in one piece, 0 if not even one row fits.
+ */
+gint halftone_stripe_height(const HalftoneDots * dots,
+                            const HalftoneSource * source, gsize budget)
+{
+	/* A row of bitboard tiles more for rounding up to whole tiles */
+	gsize fixed = halftone_render_size(dots, source, 0)
+	              + tile_row_size(dots, source);
+	gsize row_size = source->width + tile_row_size(dots, source) / 8;
+
+	if (halftone_render_size(dots, source, source->height) <= budget) {
+		return source->height;
+	}
+	if (fixed > budget) {
+		return 0;
+	}
+	return MIN((budget - fixed) / row_size, (gsize) source->height);
+}
+
+/*
+ * Renders source like halftone_context_render(), but stripe_height rows
+ * at a time with halftone_context_render_region(), so that only one
+ * stripe of the result is in memory. stripe_func gets each stripe in
+ * turn, from the top. Buffers left from larger earlier renders are
+ * dropped.
+ * Returns FALSE if out of memory, if source->get_row fails or if
+ * stripe_func stops the render.
+ */
+gboolean halftone_context_render_stripes(HalftoneContext * ctx,
+                                         const HalftoneSource * source,
+                                         gint stripe_height,
+                                         HalftoneStripeFunc stripe_func,
+                                         gpointer user_data)
+{
+	struct StripeSource stripe;
+	HalftoneSource region;
+	gint margin = halftone_region_margin(ctx->dots);
+	gint y, rows;
+
+	if (stripe_height <= 0) {
+		return FALSE;
+	}
+	if (arena_blocks_size(&ctx->arena)
+	        > halftone_render_size(ctx->dots, source, stripe_height)) {
+		halftone_arena_clear(&ctx->arena);
+	}
+
+	stripe.source = source;
+	stripe.margin = margin;
+	region.width = source->width + 2 * margin;
+	region.channels = source->channels;
+	region.format = source->format;
+	region.get_row = get_stripe_row;
+	region.progress = NULL;
+	region.user_data = &stripe;
+
+	for (y = 0; y < source->height; y += rows) {
+		rows = MIN(stripe_height, source->height - y);
+		stripe.y = y;
+		region.height = rows + 2 * margin;
+		if (halftone_context_render_region(ctx, &region, 0, y,
+		                                   source->width, rows) == FALSE
+			|| stripe_func(y, &ctx->result_image, user_data) == FALSE) {
+			return FALSE;
+		}
+		if (source->progress != NULL) {
+			source->progress((gdouble) (y + rows) / source->height,
+			                 source->user_data);
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Bytes that halftone_context_render_varying() takes besides
+ * halftone_render_size() of source in one piece: the tables of every
+ * size from min_spacing to max_spacing, whether cached or not, and a
+ * row of control.
+ */
+gsize halftone_varying_size(const HalftoneSource * control,
+                            gint min_spacing, gint max_spacing)
+{
+	gsize size = (gsize) control->width * control->channels
+	             * halftone_sample_size(control->format)
+	             + HALFTONE_ARENA_ALIGNMENT;
+	gint dot_spacing, max_dot_width;
+
+	for (dot_spacing = min_spacing; dot_spacing <= max_spacing;
+	        dot_spacing++) {
+		/* As in list_pixels_of_dot(); a dot has at most every pixel */
+		max_dot_width = (dot_spacing + 2) | 1;
+		size += dot_tables_size(max_dot_width,
+		                        max_dot_width * max_dot_width);
+	}
+	return size;
+}
+
+/* Drops the context's references to the tables of a varying size */
+static void release_varying_dots(HalftoneContext * ctx)
+{
+	gint i;
+
+	if (ctx->varying_dots == NULL) {
+		return;
+	}
+	for (i = 0; i <= ctx->varying_max - ctx->varying_min; i++) {
+		halftone_dots_unref(ctx->varying_dots[i]);
+	}
+	g_free(ctx->varying_dots);
+	ctx->varying_dots = NULL;
+}
+
+/*
+ * Makes ctx->varying_dots hold the tables of every size from
+ * min_spacing to max_spacing. The cache keeps only DOTS_CACHE_SIZE
+ * sizes, fewer than a wide range has, so the context holds the tables
+ * itself; rendering the same range again then builds none.
+ */
+static gboolean hold_varying_dots(HalftoneContext * ctx,
+                                  gint min_spacing, gint max_spacing)
+{
+	gint i;
+
+	if (ctx->varying_dots != NULL && ctx->varying_min == min_spacing
+		&& ctx->varying_max == max_spacing) {
+		return TRUE;
+	}
+	release_varying_dots(ctx);
+	ctx->varying_dots = g_try_new0(HalftoneDots *,
+	                               max_spacing - min_spacing + 1);
+	if (ctx->varying_dots == NULL) {
+		return FALSE;
+	}
+	ctx->varying_min = min_spacing;
+	ctx->varying_max = max_spacing;
+	for (i = 0; i <= max_spacing - min_spacing; i++) {
+		ctx->varying_dots[i] = halftone_dots_cache_get(min_spacing + i);
+		if (ctx->varying_dots[i] == NULL) {
+			release_varying_dots(ctx);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Renders source with dot_spacing varying from min_spacing to
+ * max_spacing as set by the luminance of control, which must have the
+ * size of source: black = min_spacing, white = max_spacing.
+ *
+ * Each dot_spacing paints its own lattice, using tables from the cache,
+ * which ctx holds until it renders another range.
+ * Between two sizes both lattices paint, so that size changes fade over
+ * instead of leaving seams. The lattices are unrelated, so their dots
+ * overlap at random: if they leave white fractions a and b, together
+ * they leave a * b. Each lattice therefore gets the luminance
+ * (source luminance) ^ weight, with the weights of the two sizes
+ * summing to 1.
+ *
+ * control should change slowly compared to the dot size; a fade
+ * narrower than the dots is sampled by too few of them.
+ * Returns FALSE if out of memory or if get_row of either source fails.
+ */
+gboolean halftone_context_render_varying(HalftoneContext * ctx,
+                                         const HalftoneSource * source,
+                                         const HalftoneSource * control,
+                                         gint min_spacing, gint max_spacing)
+{
+	struct BWBitmap * result_image = &ctx->result_image;
+	const HalftoneDots * dots;
+	guchar * control_row;
+	gint range = max_spacing - min_spacing;
+	gint dot_spacing, phase, x, y, pixel_count;
+	gint64 position, distance;
+	gdouble weight, luminance;
+	gsize control_row_size = (gsize) control->width * control->channels
+	                         * halftone_sample_size(control->format);
+	gboolean ok = TRUE;
+
+	if (control->width != source->width || control->height != source->height
+		|| min_spacing < 2 || range < 0
+		|| halftone_context_prepare(ctx, source) == FALSE
+		|| hold_varying_dots(ctx, min_spacing, max_spacing) == FALSE) {
+		return FALSE;
+	}
+	control_row = (guchar *) halftone_arena_alloc(&ctx->arena,
+	                                              control_row_size);
+	if (control_row == NULL) {
+		return FALSE;
+	}
+	memset(result_image->pixels, WHITE,
+	       (gsize) result_image->x_size * result_image->y_size);
+
+	for (dot_spacing = min_spacing; ok && dot_spacing <= max_spacing;
+	        dot_spacing++) {
+		dots = ctx->varying_dots[dot_spacing - min_spacing];
+		for (phase = 0; ok && phase < 2; phase++) {
+		for (y = phase * dot_spacing / 2;
+				ok && y < result_image->y_size; y += dot_spacing) {
+			ok = source->get_row(y, ctx->scanline, source->user_data)
+			     && control->get_row(y, control_row, control->user_data);
+			for (x = phase * dot_spacing / 2;
+			        ok && x < result_image->x_size; x += dot_spacing) {
+				/* Where the control puts this pixel between the sizes,
+				 * in 1 / MAX_LUMINANCE16 size steps */
+				position = (gint64) range
+				           * halftone_luminance16(control_row, x,
+				                                  control->channels,
+				                                  control->format);
+				distance = position
+				           - (gint64) (dot_spacing - min_spacing)
+				             * MAX_LUMINANCE16;
+				if (distance < 0) {
+					distance = -distance;
+				}
+				if (distance >= MAX_LUMINANCE16) {
+					continue;
+				}
+				weight = (gdouble) (MAX_LUMINANCE16 - distance)
+				         / MAX_LUMINANCE16;
+				luminance = (gdouble) halftone_luminance16(ctx->scanline, x,
+				                                           source->channels,
+				                                           source->format)
+				            / MAX_LUMINANCE16;
+				pixel_count = halftone_dots_pixel_count16(dots,
+					(guint16) (pow(luminance, weight) * MAX_LUMINANCE16 + 0.5));
+				if (pixel_count > 0) {
+					paint_fine_dot(dots, result_image, x, y, pixel_count);
+				}
+			}
+			if (source->progress != NULL) {
+				source->progress(((gdouble) (dot_spacing - min_spacing)
+				                  + (gdouble) y / result_image->y_size * 0.5
+				                  + (gdouble) phase * 0.5) / (range + 1),
+				                 source->user_data);
+			}
+		}
+		}
+	}
+	return ok;
+}
+
+/*
+ * Returns the first coordinate >= start which is offset plus
+ * a multiple of spacing.
+ */
+static gint first_on_lattice(gint start, gint offset, gint spacing)
+{
+	gint steps = (start - offset) / spacing;
+
+	/* Division rounds towards zero, we want up */
+	if (offset + steps * spacing < start) {
+		steps++;
+	}
+	return offset + steps * spacing;
+}
+
+/*
+ * Reports the dots of source in the same order as they are painted.
+ * Returns FALSE if out of memory, if source->get_row fails
+ * or if dot_func stops the trace.
+ */
+gboolean halftone_trace_dots(const HalftoneDots * dots,
+                             const HalftoneSource * source,
+                             HalftoneDotFunc dot_func, gpointer user_data)
+{
+	gint dot_spacing = dots->dot_spacing;
+	gint channels = source->channels;
+	gint index_step = dot_spacing * channels;
+	gint x, y, index, phase, pixel_count;
+	gsize scanline_size = (gsize) source->width * channels
+	                      * halftone_sample_size(source->format);
+	gboolean ok = TRUE;
+	guchar * scanline;
+
+	scanline = (guchar *) halftone_try_malloc(scanline_size);
+	if (scanline == NULL) {
+		return FALSE;
+	}
+	for (phase = 0; ok && phase < 2; phase++) {
+		for (y = phase * dot_spacing / 2;
+				ok && y < source->height; y += dot_spacing) {
+			ok = source->get_row(y, scanline, source->user_data);
+			for (x = phase * dot_spacing / 2, index = x * channels;
+			        ok && x < source->width;
+			        x += dot_spacing, index += index_step) {
+				if (source->format == HALFTONE_FORMAT_U8) {
+					pixel_count = dots->pixel_count_of_luminance[
+						halftone_luminance(scanline + index, channels)];
+				} else {
+					pixel_count = halftone_dots_pixel_count16(dots,
+						halftone_luminance16(scanline, x, channels,
+						                     source->format));
+				}
+				if (pixel_count > 0) {
+					ok = dot_func(x, y, pixel_count, user_data);
+				}
+			}
+			if (source->progress != NULL) {
+				source->progress((gdouble)y / (gdouble)source->height
+				                 * 0.5 + (gdouble)phase * 0.5,
+				                 source->user_data);
+			}
+		}
+	}
+	halftone_free(scanline, scanline_size);
+	return ok;
+}
+
+/*
+ * Paints black dots into image.
+ */
+static void paint_dot(const HalftoneDots * dots, struct BWBitmap * image,
+                      const gint x, const gint y, const gint luminance)
+{
+	/* Counters etc. */
+	gint in_x, in_y, out_x;
+	gint max_dot_width = dots->max_dot_width;
+
+	/* Beginning and end coordinates for precalculated_dots */
+	gint in_x1 = 0;
+	gint in_y1 = 0;
+	gint in_x2 = max_dot_width;
+	gint in_y2 = max_dot_width;
+
+	/* Beginning and end coordinates for image */
+	gint out_x1 = x - dots->dot_center;
+	gint out_y1 = y - dots->dot_center;
+	gint out_x2 = out_x1 + max_dot_width;
+	gint out_y2 = out_y1 + max_dot_width;
+
+	if (out_x1 < 0) {
+		in_x1 -= out_x1;
+		out_x1 = 0;
+	}
+	if (out_y1 < 0) {
+		in_y1 -= out_y1;
+		out_y1 = 0;
+	}
+	if (out_x2 > image->x_size) {
+		in_x2 -= out_x2 - image->x_size;
+		out_x2 = image->x_size;
+	}
+	if (out_y2 > image->y_size) {
+		in_y2 -= out_y2 - image->y_size;
+		out_y2 = image->y_size;
+	}
+
+	/* Original version */
+//	for (in_y = in_y1, out_y = out_y1;
+//         in_y < in_y2;
+//         in_y++, out_y++)
+//    {
+//		for (in_x = in_x1, out_x = out_x1;
+//             in_x < in_x2;
+//             in_x++, out_x++)
+//        {
+//			index_in = luminance * pixels_in_dot_bitmap
+//			           + in_y * max_dot_width + in_x;
+//
+//			index_out = out_y * image->x_size + out_x;
+//
+//			if (precalculated_dots[index_in] == BLACK) {
+//				image->pixels[index_out] = BLACK;
+//			}
+//		}
+//	}
+	/* Optimized version */
+	const guchar * src = dots->precalculated_dots
+	                     + luminance * dots->pixels_in_dot_bitmap
+	                     + in_y1 * max_dot_width;
+	guchar * dest = image->pixels + out_y1 * image->x_size;
+	for (in_y = in_y1; in_y < in_y2; in_y++)
+    {
+		for (in_x = in_x1, out_x = out_x1;
+             in_x < in_x2;
+             in_x++, out_x++)
+        {
+			dest[out_x] = (dest[out_x]) & (src[in_x]);
+		}
+		src += max_dot_width;
+		dest += image->x_size;
+	}
+}
+
+/*
+ * paint_dot() for dot sizes whose max_dot_width is WIDTH, a constant,
+ * so that the compiler can unroll and vectorize the loops. Dots wholly
+ * inside the image need no clipping; the rest go to paint_dot().
+ */
+#define DEFINE_PAINT_DOT_FIXED(WIDTH) \
+static void paint_dot_##WIDTH(const HalftoneDots * dots, \
+                              struct BWBitmap * image, \
+                              gint x, gint y, gint luminance) \
+{ \
+	gint left = x - (WIDTH - 1) / 2; \
+	gint top = y - (WIDTH - 1) / 2; \
+	const guchar * src; \
+	guchar * dest; \
+	guint64 left_word, middle_word, right_word, mask; \
+	gint row; \
+\
+	if (left < 0 || top < 0 || left + WIDTH > image->x_size \
+		|| top + WIDTH > image->y_size) { \
+		paint_dot(dots, image, x, y, luminance); \
+		return; \
+	} \
+	src = dots->precalculated_dots + luminance * (WIDTH * WIDTH); \
+	dest = image->pixels + (gsize) top * image->x_size + left; \
+	if (luminance == WHITE) { \
+		return; \
+	} \
+	for (row = 0; row < WIDTH; row++) { \
+		/* Three overlapping words cover widths 9 .. 24. All are \
+		 * read before any is written, and a pixel ANDed twice \
+		 * is the same. */ \
+		memcpy(&left_word, dest, 8); \
+		memcpy(&middle_word, dest + WIDTH / 2 - 4, 8); \
+		memcpy(&right_word, dest + WIDTH - 8, 8); \
+		memcpy(&mask, src, 8); \
+		left_word &= mask; \
+		memcpy(&mask, src + WIDTH / 2 - 4, 8); \
+		middle_word &= mask; \
+		memcpy(&mask, src + WIDTH - 8, 8); \
+		right_word &= mask; \
+		memcpy(dest, &left_word, 8); \
+		memcpy(dest + WIDTH / 2 - 4, &middle_word, 8); \
+		memcpy(dest + WIDTH - 8, &right_word, 8); \
+		src += WIDTH; \
+		dest += image->x_size; \
+	} \
+}
+
+DEFINE_PAINT_DOT_FIXED(9)
+DEFINE_PAINT_DOT_FIXED(11)
+DEFINE_PAINT_DOT_FIXED(13)
+DEFINE_PAINT_DOT_FIXED(15)
+DEFINE_PAINT_DOT_FIXED(17)
+DEFINE_PAINT_DOT_FIXED(19)
+
+/* The most used dot sizes, FIXED_MIN_SPACING .. FIXED_MAX_SPACING.
+ * max_dot_width is dot_spacing + 2, rounded up to odd. */
+#define FIXED_MIN_SPACING 6
+#define FIXED_MAX_SPACING 16
+
+static const PaintFunc fixed_paint_dots[] = {
+	paint_dot_9,    /* 6 */
+	paint_dot_9,    /* 7 */
+	paint_dot_11,   /* 8 */
+	paint_dot_11,   /* 9 */
+	paint_dot_13,   /* 10 */
+	paint_dot_13,   /* 11 */
+	paint_dot_15,   /* 12 */
+	paint_dot_15,   /* 13 */
+	paint_dot_17,   /* 14 */
+	paint_dot_17,   /* 15 */
+	paint_dot_19    /* 16 */
+};
+
+/*
+ * Returns the painter of strategy for the size of dots: for MASK, the
+ * specialized paint_dot() of the size if there is one.
+ */
+static PaintFunc paint_func(const HalftoneDots * dots, gint strategy)
+{
+	if (strategy == HALFTONE_PAINT_MASK
+		&& dots->dot_spacing >= FIXED_MIN_SPACING
+		&& dots->dot_spacing <= FIXED_MAX_SPACING) {
+		return fixed_paint_dots[dots->dot_spacing - FIXED_MIN_SPACING];
+	}
+	return paint_funcs[strategy];
+}
+
+/*
+ * Paints the same pixels as paint_dot(), a row of the dot at a time.
+ */
+static void paint_spans(const HalftoneDots * dots, struct BWBitmap * image,
+                        gint x, gint y, gint luminance)
+{
+	gint max_dot_width = dots->max_dot_width;
+	gint left = x - dots->dot_center;
+	gint top = y - dots->dot_center;
+	gint in_y1 = MAX(0, -top);
+	gint in_y2 = MIN(max_dot_width, image->y_size - top);
+	const gint16 * span = dots->dot_spans
+	                      + 2 * ((gsize) luminance * max_dot_width + in_y1);
+	guchar * dest = image->pixels + (gsize) (top + in_y1) * image->x_size;
+	gint in_y, start, end;
+
+	for (in_y = in_y1; in_y < in_y2; in_y++) {
+		start = MAX(left + span[0], 0);
+		end = MIN(left + span[1], image->x_size);
+		if (start < end) {
+			memset(dest + start, BLACK, end - start);
+		}
+		span += 2;
+		dest += image->x_size;
+	}
+}
+
+/*
+ * Paints the same pixels as paint_dot(), one at a time from the list of
+ * pixels of the dot. Cheap for small and light dots.
+ */
+static void paint_pixels(const HalftoneDots * dots, struct BWBitmap * image,
+                         gint x, gint y, gint luminance)
+{
+	const struct BitmapPixel * pixel = dots->pixels_of_dot;
+	const struct BitmapPixel * end = pixel
+	        + dots->pixel_count_of_luminance[luminance];
+	gint dot_center = dots->dot_center;
+	gint out_x, out_y;
+	guchar * center;
+
+	if (x >= dot_center && x + dot_center < image->x_size
+		&& y >= dot_center && y + dot_center < image->y_size) {
+		/* The whole dot is inside, no clipping */
+		center = image->pixels + (gsize) y * image->x_size + x;
+		for (; pixel < end; pixel++) {
+			center[pixel->y_position * image->x_size
+			       + pixel->x_position] = BLACK;
+		}
+		return;
+	}
+	for (; pixel < end; pixel++) {
+		out_x = x + pixel->x_position;
+		out_y = y + pixel->y_position;
+		if (out_x >= 0 && out_x < image->x_size
+			&& out_y >= 0 && out_y < image->y_size) {
+			image->pixels[(gsize) out_y * image->x_size + out_x] = BLACK;
+		}
+	}
+}
+
+void halftone_dots_paint(const HalftoneDots * dots, gint strategy,
+                         struct BWBitmap * image, gint x, gint y,
+                         gint luminance)
+{
+	paint_func(dots, strategy)(dots, image, x, y, luminance);
+}
+
+/*
+ * halftone_context_render() for 16-bit and float sources. Every dot size
+ * from 0 to max_pixels_in_dot is available, not just LUMINANCES of them.
+ */
+static gboolean render_fine(HalftoneContext * ctx,
+                            const HalftoneSource * source)
+{
+	const HalftoneDots * dots = ctx->dots;
+	struct BWBitmap * result_image = &ctx->result_image;
+	gint dot_spacing = dots->dot_spacing;
+	gint x, y, phase, pixel_count;
+
+	for (phase = 0; phase < 2; phase++) {
+	for (y = phase * dot_spacing / 2;
+			y < result_image->y_size; y += dot_spacing) {
+		if (source->get_row(y, ctx->scanline, source->user_data) == FALSE) {
+			return FALSE;
+		}
+		for (x = phase * dot_spacing / 2; x < result_image->x_size;
+		        x += dot_spacing) {
+			pixel_count = halftone_dots_pixel_count16(dots,
+				halftone_luminance16(ctx->scanline, x, source->channels,
+				                     source->format));
+			if (pixel_count > 0) {
+				paint_fine_dot(dots, result_image, x, y, pixel_count);
+			}
+		}
+		if (source->progress != NULL) {
+			source->progress((gdouble)y / (gdouble)result_image->y_size
+			                 * 0.5 + (gdouble)phase * 0.5,
+			                 source->user_data);
+		}
+	}
+	}
+	return TRUE;
+}
+
+/*
+ * Paints a dot of pixel_count pixels: the pixels whose pixel_order
+ * is below pixel_count.
+ */
+static void paint_fine_dot(const HalftoneDots * dots, struct BWBitmap * image,
+                           gint x, gint y, gint pixel_count)
+{
+	gint in_x, in_y, out_x;
+	gint max_dot_width = dots->max_dot_width;
+
+	/* Beginning and end coordinates for pixel_order */
+	gint in_x1 = 0;
+	gint in_y1 = 0;
+	gint in_x2 = max_dot_width;
+	gint in_y2 = max_dot_width;
+
+	/* Beginning and end coordinates for image */
+	gint out_x1 = x - dots->dot_center;
+	gint out_y1 = y - dots->dot_center;
+	gint out_x2 = out_x1 + max_dot_width;
+	gint out_y2 = out_y1 + max_dot_width;
+
+	if (out_x1 < 0) {
+		in_x1 -= out_x1;
+		out_x1 = 0;
+	}
+	if (out_y1 < 0) {
+		in_y1 -= out_y1;
+		out_y1 = 0;
+	}
+	if (out_x2 > image->x_size) {
+		in_x2 -= out_x2 - image->x_size;
+		out_x2 = image->x_size;
+	}
+	if (out_y2 > image->y_size) {
+		in_y2 -= out_y2 - image->y_size;
+		out_y2 = image->y_size;
+	}
+
+	const gint * order = dots->pixel_order + in_y1 * max_dot_width;
+	guchar * dest = image->pixels + (gsize) out_y1 * image->x_size;
+	for (in_y = in_y1; in_y < in_y2; in_y++) {
+		for (in_x = in_x1, out_x = out_x1; in_x < in_x2; in_x++, out_x++) {
+			if (order[in_x] < pixel_count) {
+				dest[out_x] = BLACK;
+			}
+		}
+		order += max_dot_width;
+		dest += image->x_size;
+	}
+}
+
+/* Sets samples samples of format to white */
+static void fill_white(guchar * row, gsize samples, gint format)
+{
+	gsize i;
+
+	switch (format) {
+	case HALFTONE_FORMAT_U16:
+		for (i = 0; i < samples; i++) {
+			((guint16 *) row)[i] = MAX_LUMINANCE16;
+		}
+		break;
+	case HALFTONE_FORMAT_FLOAT:
+		for (i = 0; i < samples; i++) {
+			((gfloat *) row)[i] = 1.0f;
+		}
+		break;
+	default:
+		memset(row, WHITE, samples);
+		break;
+	}
+}
+
+/*
+ * Outside the source the stripe is white, so that no dots are centered
+ * there and the stripes match halftone_context_render() exactly.
+ */
+static gboolean get_stripe_row(gint y, guchar * row, gpointer user_data)
+{
+	struct StripeSource * stripe = (struct StripeSource *) user_data;
+	const HalftoneSource * source = stripe->source;
+	gsize margin_samples = (gsize) stripe->margin * source->channels;
+	gsize source_samples = (gsize) source->width * source->channels;
+	gsize sample_size = halftone_sample_size(source->format);
+
+	y += stripe->y - stripe->margin;
+	if (y < 0 || y >= source->height) {
+		fill_white(row, source_samples + 2 * margin_samples, source->format);
+		return TRUE;
+	}
+	fill_white(row, margin_samples, source->format);
+	fill_white(row + (margin_samples + source_samples) * sample_size,
+	           margin_samples, source->format);
+	return source->get_row(y, row + margin_samples * sample_size,
+	                       source->user_data);
+}
+
+static gboolean get_buffer_row(gint y, guchar * row, gpointer user_data)
+{
+	HalftoneBuffer * buffer = (HalftoneBuffer *) user_data;
+
+	memcpy(row, buffer->pixels + y * buffer->rowstride, buffer->row_bytes);
+	return TRUE;
+}
+
+/*
+ * Sets source to read tightly packed rows from pixels.
+ * buffer must stay alive as long as source is used.
+ */
+void halftone_source_init_buffer(HalftoneSource * source,
+                                 HalftoneBuffer * buffer,
+                                 const guchar * pixels,
+                                 gint width, gint height, gint channels,
+                                 gint format)
+{
+	buffer->pixels = pixels;
+	buffer->row_bytes = (gsize) width * channels
+	                    * halftone_sample_size(format);
+	buffer->rowstride = buffer->row_bytes;
+
+	source->width = width;
+	source->height = height;
+	source->channels = channels;
+	source->format = format;
+	source->get_row = get_buffer_row;
+	source->progress = NULL;
+	source->user_data = buffer;
+}
+
+void halftone_pack_row(const guchar * pixels, gint width, guchar * packed)
+{
+	gint x, bit;
+	guchar byte;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		byte = 0;
+		for (bit = 0; bit < 8; bit++) {
+			byte = (byte << 1) | (pixels[x + bit] == BLACK);
+		}
+		*packed++ = byte;
+	}
+	if (x < width) {
+		byte = 0;
+		for (bit = 0; bit < 8; bit++) {
+			byte <<= 1;
+			if (x + bit < width) {
+				byte |= (pixels[x + bit] == BLACK);
+			}
+		}
+		*packed = byte;
+	}
+}
+
+void halftone_unpack_row(const guchar * packed, gint width, guchar * pixels)
+{
+	gint x;
+
+	for (x = 0; x < width; x++) {
+		pixels[x] = (packed[x / 8] & (0x80 >> (x % 8))) ? BLACK : WHITE;
+	}
+}
+
+void halftone_expand_row(const guchar * pixels, gint width, gint channels,
+                         guchar * out)
+{
+	gint x;
+
+	switch (channels) {
+	case 1: /* Greyscale */
+		memcpy(out, pixels, width);
+		break;
+	case 2: /* Greyscale + alpha */
+		for (x = 0; x < width; x++, out += channels) {
+			out[0] = pixels[x];
+		}
+		break;
+	case 3: /* RGB */
+	case 4: /* RGB + alpha */
+		for (x = 0; x < width; x++, out += channels) {
+			out[0] = pixels[x];
+			out[1] = pixels[x];
+			out[2] = pixels[x];
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void halftone_expand_mask_row(const guchar * pixels, gint width,
+                              gint channels, guchar * out)
+{
+	gint x;
+
+	if (channels == 1) {
+		for (x = 0; x < width; x++) {
+			out[x] = (pixels[x] != BLACK);
+		}
+		return;
+	}
+	memset(out, 0, (gsize) width * channels);
+	for (x = 0, out += channels - 1; x < width; x++, out += channels) {
+		*out = WHITE - pixels[x];
+	}
+}
@@ -0,0 +1,462 @@
+/* Printable Halftone renderer
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* The renderer does not depend on the GIMP. All of its state lives in
+ * two kinds of objects:
+ *
+ * HalftoneDots     Dot tables for one dot_spacing. Immutable after
+ *                  halftone_dots_new(), reference counted, so any number
+ *                  of contexts in any number of threads may share one.
+ *
+ * HalftoneContext  Per-render scratch buffers and the result bitmap.
+ *                  One context must be used by one thread at a time.
+ *
+ * Usage:
+ *   ctx = halftone_context_new(8);
+ *   halftone_context_render(ctx, &source);
+ *   ... read ctx->result_image ...
+ *   halftone_context_free(ctx);
+ */
+#ifndef HALFTONE_H
+#define HALFTONE_H
+
+#include <glib.h>
+
+#define BLACK 0
+#define WHITE 255
+#define LUMINANCES 256
+
+/* Luminance scale of 16-bit and float sources */
+#define MAX_LUMINANCE16 65535
+
+/* Sample formats of source rows */
+enum {
+	HALFTONE_FORMAT_U8,     /* guchar, 0 .. 255 */
+	HALFTONE_FORMAT_U16,    /* guint16 in host byte order, 0 .. 65535 */
+	HALFTONE_FORMAT_FLOAT   /* gfloat, 0.0 .. 1.0 */
+};
+
+/* Ways of painting a dot of 8-bit luminance. All paint the same pixels;
+ * which is fastest depends on the dot size and the machine, so
+ * halftone_dots_new() picks one with halftone_tune_paint().
+ *
+ * MASK    AND the dot's bitmap from precalculated_dots into the image,
+ *         with a kernel of its own for each size 6 .. 16
+ * SPANS   memset each row of the dot from dot_spans
+ * PIXELS  set the dot's pixels one by one from pixels_of_dot */
+enum {
+	HALFTONE_PAINT_MASK,
+	HALFTONE_PAINT_SPANS,
+	HALFTONE_PAINT_PIXELS,
+	HALFTONE_PAINT_STRATEGIES
+};
+
+/* Bitmap painted by the renderer: black dots on white background.
+ * Only WHITE and BLACK colors are used, except by
+ * halftone_context_render_coverage(), which paints gray levels. */
+struct BWBitmap {
+	gint x_size;
+	gint y_size;
+	guchar * pixels;
+};
+
+/* BWBitmap packed to 1 bit per pixel, rows of (x_size + 7) / 8 bytes
+ * as from halftone_pack_row(). An eighth of the memory of a BWBitmap,
+ * for keeping a whole result that does not fit otherwise. */
+struct BWPackedBitmap {
+	gint x_size;
+	gint y_size;
+	guchar * pixels;
+};
+
+/* Used by the renderer when creating models of the dots */
+struct BitmapPixel {
+	gint x_position;
+	gint y_position;
+	gint distance_from_center;
+};
+
+typedef struct {
+	gint ref_count;
+
+	/* a   b    dot_spacing is distance between dots a and b.
+	 *   c      The actual square grid has dots a, c and e on the same line.
+	 * d   e */
+	gint dot_spacing;
+
+	/* Derived from dot_spacing */
+	gint max_dot_width;
+	gint dot_center;
+
+	/* Size of dot bitmaps in precalculated_dots. */
+	gint pixels_in_dot_bitmap;
+
+	/* Number of sorted pixels in pixels_of_dot. */
+	gint max_pixels_in_dot;
+
+	/* Contains list of pixels in dot
+	 * sorted by their distance from the center of the dot.
+	 * x_position and y_position are from the center of the
+	 * dot, which is at (0, 0). */
+	struct BitmapPixel * pixels_of_dot;
+
+	/* Source image luminance -> dot size (pixel count) mapping. */
+	gint pixel_count_of_luminance[LUMINANCES];
+
+	/* Contains LUMINANCES max_dot_width * max_dot_width -sized bitmaps
+	 * representing the dot for each luminance. Each byte is one pixel:
+	 * BLACK = paint black, WHITE = transparent. */
+	guchar * precalculated_dots;
+
+	/* Full dot size resolution for 16-bit and float sources,
+	 * where 256 dot sizes would band:
+	 *
+	 * shade_of_pixel_count[n] is the luminance (0 .. MAX_LUMINANCE16)
+	 * of the screen when every dot has n pixels,
+	 * n = 0 .. max_pixels_in_dot.
+	 *
+	 * pixel_order is a max_dot_width * max_dot_width bitmap of
+	 * indexes to pixels_of_dot, G_MAXINT outside the largest dot.
+	 * A dot of n pixels is the pixels with pixel_order < n. */
+	guint16 * shade_of_pixel_count;
+	gint * pixel_order;
+
+	/* Black pixels of each row of each dot in precalculated_dots:
+	 * from dot_spans[2 * (luminance * max_dot_width + row)]
+	 * up to (not including) the next entry. A row of a round dot
+	 * is always one run of pixels. */
+	gint16 * dot_spans;
+
+	/* HALFTONE_PAINT_* used for 8-bit sources */
+	gint paint_strategy;
+
+	/* For max_dot_width <= 7 (dot_spacing 2 .. 5), otherwise NULL:
+	 * the dots as 64-bit masks of 8 x 8 pixel tiles, which 8-bit
+	 * sources are painted with instead of paint_strategy.
+	 * See precalculate_bitboard() in halftone.c. */
+	guint64 * bitboard_masks;
+} HalftoneDots;
+
+/* Reads source row y (0 <= y < height) into row, which has room for
+ * width * channels samples. Returns FALSE on failure, which aborts
+ * the render. */
+typedef gboolean (* HalftoneRowFunc) (gint y, guchar * row,
+                                      gpointer user_data);
+
+/* Called now and then with fraction = 0.0 .. 1.0 */
+typedef void (* HalftoneProgressFunc) (gdouble fraction, gpointer user_data);
+
+typedef struct {
+	gint width;
+	gint height;
+
+	/* 1 = grayscale, 2 = grayscale + alpha,
+	 * 3 = RGB, 4 = RGB + alpha */
+	gint channels;
+
+	/* HALFTONE_FORMAT_* of the samples in rows */
+	gint format;
+
+	HalftoneRowFunc get_row;
+	HalftoneProgressFunc progress;  /* may be NULL */
+	gpointer user_data;
+} HalftoneSource;
+
+/* Source reading from a plain pixel buffer.
+ * See halftone_source_init_buffer(). */
+typedef struct {
+	const guchar * pixels;
+	gsize rowstride;
+	gsize row_bytes;
+} HalftoneBuffer;
+
+/* Scratch memory for one render at a time. Allocations are aligned to
+ * HALFTONE_ARENA_ALIGNMENT bytes and all freed at once by
+ * halftone_arena_reset(), which keeps the blocks for the next render.
+ * See halftone.c. */
+#define HALFTONE_ARENA_ALIGNMENT 64
+
+typedef struct HalftoneArenaBlock HalftoneArenaBlock;
+
+typedef struct {
+	HalftoneArenaBlock * blocks;    /* oldest first */
+	HalftoneArenaBlock * current;   /* being filled, NULL after a reset */
+	gsize used;                     /* bytes of current */
+} HalftoneArena;
+
+typedef struct {
+	HalftoneDots * dots;
+
+	/* The result of the latest halftone_context_render().
+	 * Valid until the next render or halftone_context_free(). */
+	struct BWBitmap result_image;
+
+	/* Holds result_image and the scratch buffers of a render. Reset
+	 * at the start of every render, so its memory is reused by the
+	 * next one. */
+	HalftoneArena arena;
+	guchar * scanline;
+	gint16 * diffusion_values;
+
+	/* Coverage bitmaps for dot_spacing coverage_spacing,
+	 * see halftone-coverage.c */
+	guchar * coverage_dots;
+	gsize coverage_allocated;
+	gint coverage_spacing;
+
+	/* Bitboard of the result for dots with bitboard_masks,
+	 * tiles_x tiles per row */
+	guint64 * tiles;
+	gint tiles_x;
+
+	/* Value of every dot for halftone_context_render_parallel() */
+	guchar * lattice;
+
+	/* Tables of sizes varying_min .. varying_max, held from one
+	 * halftone_context_render_varying() to the next */
+	HalftoneDots ** varying_dots;
+	gint varying_min, varying_max;
+} HalftoneContext;
+
+/* Called by halftone_context_render_stripes() with rows y ..
+ * y + stripe->y_size - 1 of the result. Returning FALSE stops it. */
+typedef gboolean (* HalftoneStripeFunc) (gint y,
+                                         const struct BWBitmap * stripe,
+                                         gpointer user_data);
+
+/* Memory accounting. Every table and buffer of the renderer is
+ * allocated with halftone_try_malloc() or from an arena and counted,
+ * in all threads.
+ * Callers measure a stage by resetting the peak before it. */
+gpointer halftone_try_malloc(gsize size);
+void halftone_free(gpointer memory, gsize size);
+gsize halftone_memory_in_use(void);
+gsize halftone_memory_peak(void);
+void halftone_memory_reset_peak(void);
+
+gpointer halftone_arena_alloc(HalftoneArena * arena, gsize size);
+void halftone_arena_reset(HalftoneArena * arena);
+void halftone_arena_clear(HalftoneArena * arena);
+
+HalftoneDots * halftone_dots_new(gint dot_spacing);
+HalftoneDots * halftone_dots_ref(HalftoneDots * dots);
+void halftone_dots_unref(HalftoneDots * dots);
+gsize halftone_dots_size(const HalftoneDots * dots);
+
+/* Dot size in pixels for a 16-bit luminance */
+gint halftone_dots_pixel_count16(const HalftoneDots * dots,
+                                 guint16 luminance);
+
+/* Paints one dot of 8-bit luminance centered at (x, y) into image
+ * with a HALFTONE_PAINT_* strategy, for the auto-tuner and tests */
+void halftone_dots_paint(const HalftoneDots * dots, gint strategy,
+                         struct BWBitmap * image, gint x, gint y,
+                         gint luminance);
+
+/* Auto-tuner (halftone-tune.c). halftone_tune_paint() returns the
+ * fastest paint strategy for the size of dots, from the profile of
+ * this machine or, on first use of the size, by timing each strategy.
+ * The profile is a key file in the user's configuration directory;
+ * halftone_tune_set_profile() sets another one, NULL = keep the
+ * results in memory only. Thread safe. */
+gint halftone_tune_paint(const HalftoneDots * dots);
+void halftone_tune_set_profile(const gchar * filename);
+const gchar * halftone_paint_name(gint strategy);
+
+/* Process-wide table cache, keyed by dot_spacing. Thread safe.
+ * Keeps the most recently used tables. halftone_dots_cache_get()
+ * returns a new reference. */
+HalftoneDots * halftone_dots_cache_get(gint dot_spacing);
+void halftone_dots_cache_clear(void);
+
+HalftoneContext * halftone_context_new(gint dot_spacing);
+HalftoneContext * halftone_context_new_for_dots(HalftoneDots * dots);
+void halftone_context_set_dots(HalftoneContext * ctx, HalftoneDots * dots);
+gboolean halftone_context_prepare(HalftoneContext * ctx,
+                                  const HalftoneSource * source);
+gboolean halftone_context_render(HalftoneContext * ctx,
+                                 const HalftoneSource * source);
+
+/* Renders like halftone_context_render(), painting on threads worker
+ * threads, 0 = one per processor. The result is the same bit for bit.
+ * See halftone.c. */
+gboolean halftone_context_render_parallel(HalftoneContext * ctx,
+                                          const HalftoneSource * source,
+                                          gint threads);
+
+/* Renders one area of a larger image, for tiled or threaded callers.
+ * See halftone.c for how source must be laid out. */
+gboolean halftone_context_render_region(HalftoneContext * ctx,
+                                        const HalftoneSource * source,
+                                        gint x, gint y,
+                                        gint width, gint height);
+
+/* Rendering within a memory budget: halftone_render_size() estimates
+ * the scratch buffers of a render, halftone_stripe_height() picks the
+ * stripe height for a budget and halftone_context_render_stripes()
+ * renders the image one stripe at a time. See halftone.c. */
+gsize halftone_render_size(const HalftoneDots * dots,
+                           const HalftoneSource * source, gint stripe_height);
+gint halftone_stripe_height(const HalftoneDots * dots,
+                            const HalftoneSource * source, gsize budget);
+gboolean halftone_context_render_stripes(HalftoneContext * ctx,
+                                         const HalftoneSource * source,
+                                         gint stripe_height,
+                                         HalftoneStripeFunc stripe_func,
+                                         gpointer user_data);
+
+/* Dot size varying across the image, set by a control image.
+ * See halftone.c. */
+gboolean halftone_context_render_varying(HalftoneContext * ctx,
+                                         const HalftoneSource * source,
+                                         const HalftoneSource * control,
+                                         gint min_spacing, gint max_spacing);
+gsize halftone_varying_size(const HalftoneSource * control,
+                            gint min_spacing, gint max_spacing);
+
+/* How far outside an area halftone_context_render_region() reads */
+static inline gint halftone_region_margin(const HalftoneDots * dots)
+{
+	return dots->dot_center;
+}
+
+/* Worker threads of the threaded engines (halftone-threads.c).
+ * halftone_team_run() calls func(team, index, data) on
+ * team->thread_count threads at once; halftone_team_barrier() waits for
+ * the whole team. The threads are kept between renders. */
+typedef struct HalftoneTeam HalftoneTeam;
+typedef void (* HalftoneTeamFunc) (HalftoneTeam * team, gint index,
+                                   gpointer data);
+
+struct HalftoneTeam {
+	gint thread_count;
+	HalftoneTeamFunc func;
+	gpointer data;
+
+	GMutex mutex;
+	GCond cond;
+	gint arrived;
+	gint generation;
+	gint running;
+};
+
+void halftone_team_run(gint threads, HalftoneTeamFunc func, gpointer data);
+void halftone_team_barrier(HalftoneTeam * team);
+
+/* Knuth's dot diffusion (halftone-diffusion.c). Renders source into
+ * ctx->result_image like halftone_context_render(), but pixel by pixel
+ * instead of with dots; ctx->dots is not used. Runs on threads worker
+ * threads, 0 = one per processor. */
+gboolean halftone_context_render_diffusion(HalftoneContext * ctx,
+                                           const HalftoneSource * source,
+                                           gint threads);
+gsize halftone_diffusion_size(const HalftoneSource * source);
+
+/* Anti-aliased dots for screen proofs (halftone-coverage.c). Renders
+ * source like halftone_context_render(), but each pixel of
+ * ctx->result_image gets the gray level of its coverage by the dots. */
+gboolean halftone_context_render_coverage(HalftoneContext * ctx,
+                                          const HalftoneSource * source);
+gsize halftone_coverage_size(const HalftoneDots * dots);
+void halftone_context_free(HalftoneContext * ctx);
+
+/* Called by halftone_trace_dots() for every dot which has black pixels.
+ * (x, y) is the center pixel of the dot; pixel_count is the area
+ * of the dot in pixels. Returning FALSE stops the trace. */
+typedef gboolean (* HalftoneDotFunc) (gint x, gint y, gint pixel_count,
+                                      gpointer user_data);
+
+/* Walks the dot lattice like halftone_context_render(), but instead of
+ * painting, reports each dot to dot_func. Needs no result bitmap. */
+gboolean halftone_trace_dots(const HalftoneDots * dots,
+                             const HalftoneSource * source,
+                             HalftoneDotFunc dot_func, gpointer user_data);
+
+void halftone_source_init_buffer(HalftoneSource * source,
+                                 HalftoneBuffer * buffer,
+                                 const guchar * pixels,
+                                 gint width, gint height, gint channels,
+                                 gint format);
+
+/* Packs one row of a BWBitmap to 1 bit per pixel like in PBM files:
+ * most significant bit first, 1 = black. packed must have room for
+ * (width + 7) / 8 bytes. */
+void halftone_pack_row(const guchar * pixels, gint width, guchar * packed);
+
+/* The reverse of halftone_pack_row() */
+void halftone_unpack_row(const guchar * packed, gint width, guchar * pixels);
+
+/* Copies width gray levels from pixels to pixels of channels samples
+ * in out: to the gray channel, or to R, G and B. Alpha is left as is. */
+void halftone_expand_row(const guchar * pixels, gint width, gint channels,
+                         guchar * out);
+
+/* Like halftone_expand_row(), for a new drawable: with 1 channel, indexes
+ * into a black and white colormap; with 2 or 4, black dots on
+ * transparent. */
+void halftone_expand_mask_row(const guchar * pixels, gint width,
+                              gint channels, guchar * out);
+
+/* 30% R + 59% G + 11% B like the GIMP does */
+static inline guchar halftone_luminance(const guchar * pixel, gint channels)
+{
+	if (channels < 3) {
+		return pixel[0];
+	}
+	return (30 * pixel[0] + 59 * pixel[1] + 11 * pixel[2]) / 100;
+}
+
+static inline gsize halftone_sample_size(gint format)
+{
+	switch (format) {
+	case HALFTONE_FORMAT_U16:
+		return sizeof(guint16);
+	case HALFTONE_FORMAT_FLOAT:
+		return sizeof(gfloat);
+	default:
+		return sizeof(guchar);
+	}
+}
+
+/* Luminance 0 .. MAX_LUMINANCE16 of pixel x in a row of any format */
+static inline guint16 halftone_luminance16(const guchar * row, gint x,
+                                           gint channels, gint format)
+{
+	const guint16 * pixel16;
+	const gfloat * pixel_float;
+	gfloat luminance;
+
+	switch (format) {
+	case HALFTONE_FORMAT_U16:
+		pixel16 = (const guint16 *) row + x * channels;
+		if (channels < 3) {
+			return pixel16[0];
+		}
+		return (30 * pixel16[0] + 59 * pixel16[1] + 11 * pixel16[2]) / 100;
+	case HALFTONE_FORMAT_FLOAT:
+		pixel_float = (const gfloat *) row + x * channels;
+		if (channels < 3) {
+			luminance = pixel_float[0];
+		} else {
+			luminance = 0.30f * pixel_float[0] + 0.59f * pixel_float[1]
+			            + 0.11f * pixel_float[2];
+		}
+		/* NaN is black */
+		if (!(luminance > 0.0f)) {
+			return 0;
+		}
+		if (luminance >= 1.0f) {
+			return MAX_LUMINANCE16;
+		}
+		return (guint16) (luminance * MAX_LUMINANCE16 + 0.5f);
+	default:
+		return halftone_luminance(row + x * channels, channels) * 257;
+	}
+}
+
+#endif /* HALFTONE_H */
@@ -0,0 +1,353 @@
+/* Printable Halftone render daemon
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* A long-lived halftone server for pipelines which are not driven
+ * by the GIMP. Listens on a Unix domain socket, renders each request
+ * on a worker pool and replies with the 1-bit result. See halftoned.h
+ * for the protocol.
+ *
+ * Dot tables are prepared once per size and kept for the lifetime of
+ * the server. Each worker thread keeps its own render buffers.
+ *
+ * Usage: halftoned [--socket PATH] [--threads N] [--preload 6,8,12]
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "halftone.h"
+#include "halftoned.h"
+
+/* Largest accepted raster, in bytes */
+#define MAX_REQUEST_BYTES ((gsize) 1 << 31)
+
+/* Rows packed per write() of the reply */
+#define REPLY_STRIPE_HEIGHT 64
+
+struct Connection {
+	gint fd;
+	gint64 accept_time;
+};
+
+/* Queue latency statistics, printed every STATS_INTERVAL requests */
+#define STATS_INTERVAL 100
+static GMutex stats_mutex;
+static guint stats_requests = 0;
+static gint64 stats_queue_total = 0;
+static gint64 stats_queue_max = 0;
+
+static gchar * socket_path = HALFTONED_DEFAULT_SOCKET;
+static gint thread_count = 0;
+static gchar * preload_sizes = NULL;
+static gboolean verbose = FALSE;
+
+static volatile sig_atomic_t quit_requested = 0;
+
+/* Each worker thread keeps its own context between requests */
+static GPrivate worker_context = G_PRIVATE_INIT(
+        (GDestroyNotify) halftone_context_free);
+
+static GOptionEntry option_entries[] =
+{
+	{ "socket", 's', 0, G_OPTION_ARG_FILENAME, &socket_path,
+	  "Listen on PATH (default " HALFTONED_DEFAULT_SOCKET ")", "PATH" },
+	{ "threads", 't', 0, G_OPTION_ARG_INT, &thread_count,
+	  "Number of worker threads (default: one per processor)", "N" },
+	{ "preload", 'p', 0, G_OPTION_ARG_STRING, &preload_sizes,
+	  "Prepare dot tables for these sizes at startup", "6,8,12" },
+	{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+	  "Log every request", NULL },
+	{ NULL }
+};
+
+static gboolean read_all(gint fd, gpointer buffer, gsize size);
+static gboolean write_all(gint fd, gconstpointer buffer, gsize size);
+static void serve(gpointer data, gpointer user_data);
+static guint32 render_request(gint fd, const struct HalftoneRequest * request,
+                              guchar ** pixels, HalftoneContext ** ctx);
+static gboolean send_result(gint fd, const struct BWBitmap * result_image);
+static void update_stats(gint64 queue_usec);
+static void handle_signal(int signum);
+
+static gboolean read_all(gint fd, gpointer buffer, gsize size)
+{
+	guchar * p = (guchar *) buffer;
+	gssize n;
+
+	while (size > 0) {
+		n = read(fd, p, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return FALSE;
+		}
+		p += n;
+		size -= n;
+	}
+	return TRUE;
+}
+
+static gboolean write_all(gint fd, gconstpointer buffer, gsize size)
+{
+	const guchar * p = (const guchar *) buffer;
+	gssize n;
+
+	while (size > 0) {
+		n = write(fd, p, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return FALSE;
+		}
+		p += n;
+		size -= n;
+	}
+	return TRUE;
+}
+
+/*
+ * Worker: reads one request from the connection, renders it
+ * and writes the reply.
+ */
+static void serve(gpointer data, gpointer user_data)
+{
+	struct Connection * connection = (struct Connection *) data;
+	struct HalftoneRequest request;
+	struct HalftoneReply reply;
+	HalftoneContext * ctx = g_private_get(&worker_context);
+	guchar * pixels = NULL;
+	gint64 start_time, queue_usec;
+
+	start_time = g_get_monotonic_time();
+	queue_usec = start_time - connection->accept_time;
+	update_stats(queue_usec);
+
+	if (read_all(connection->fd, &request, sizeof(request)) == FALSE) {
+		goto out;
+	}
+	memset(&reply, 0, sizeof(reply));
+	reply.magic = HALFTONE_REPLY_MAGIC;
+	reply.width = request.width;
+	reply.height = request.height;
+	reply.status = render_request(connection->fd, &request, &pixels, &ctx);
+	g_private_set(&worker_context, ctx);
+	reply.queue_usec = (guint32) MIN(queue_usec, G_MAXINT);
+	reply.render_usec = (guint32) MIN(g_get_monotonic_time() - start_time,
+	                                  G_MAXINT);
+
+	if (verbose) {
+		g_print("halftoned: %ux%ux%u size %u: status %u, "
+		        "queue %.1f ms, render %.1f ms\n",
+		        request.width, request.height, request.channels,
+		        request.dot_spacing, reply.status,
+		        reply.queue_usec / 1000.0, reply.render_usec / 1000.0);
+	}
+	if (write_all(connection->fd, &reply, sizeof(reply))
+		&& reply.status == HALFTONE_STATUS_OK) {
+		send_result(connection->fd, &ctx->result_image);
+	}
+out:
+	g_free(pixels);
+	close(connection->fd);
+	g_free(connection);
+}
+
+/*
+ * Validates the request, reads its pixels and renders them with *ctx,
+ * which is created or switched to the requested size as needed.
+ * Returns a HALFTONE_STATUS_* code.
+ */
+static guint32 render_request(gint fd, const struct HalftoneRequest * request,
+                              guchar ** pixels, HalftoneContext ** ctx)
+{
+	HalftoneSource source;
+	HalftoneBuffer buffer;
+	HalftoneDots * dots;
+	gsize size;
+
+	if (request->magic != HALFTONE_REQUEST_MAGIC
+		|| request->width == 0 || request->height == 0
+		|| request->channels < 1 || request->channels > 4
+		|| request->dot_spacing < 2 || request->dot_spacing > 1000
+		|| request->width > G_MAXINT / request->channels) {
+		return HALFTONE_STATUS_BAD_REQUEST;
+	}
+	size = (gsize) request->width * request->height * request->channels;
+	if (size > MAX_REQUEST_BYTES) {
+		return HALFTONE_STATUS_BAD_REQUEST;
+	}
+	*pixels = (guchar *) g_try_malloc(size);
+	if (*pixels == NULL) {
+		return HALFTONE_STATUS_OUT_OF_MEMORY;
+	}
+	if (read_all(fd, *pixels, size) == FALSE) {
+		return HALFTONE_STATUS_BAD_REQUEST;
+	}
+
+	dots = halftone_dots_cache_get(request->dot_spacing);
+	if (dots == NULL) {
+		return HALFTONE_STATUS_OUT_OF_MEMORY;
+	}
+	if (*ctx == NULL) {
+		*ctx = halftone_context_new_for_dots(dots);
+	} else {
+		halftone_context_set_dots(*ctx, dots);
+	}
+	halftone_dots_unref(dots);
+	if (*ctx == NULL) {
+		return HALFTONE_STATUS_OUT_OF_MEMORY;
+	}
+
+	halftone_source_init_buffer(&source, &buffer, *pixels,
+	        request->width, request->height, request->channels,
+	        HALFTONE_FORMAT_U8);
+	if (halftone_context_render(*ctx, &source) == FALSE) {
+		return HALFTONE_STATUS_OUT_OF_MEMORY;
+	}
+	return HALFTONE_STATUS_OK;
+}
+
+/*
+ * Writes result_image packed to 1 bit per pixel,
+ * REPLY_STRIPE_HEIGHT rows at a time.
+ */
+static gboolean send_result(gint fd, const struct BWBitmap * result_image)
+{
+	gsize packed_width = (result_image->x_size + 7) / 8;
+	guchar * stripe = (guchar *) g_try_malloc(packed_width
+	                                          * REPLY_STRIPE_HEIGHT);
+	gboolean ok = (stripe != NULL);
+	gint y, row;
+
+	for (y = 0; ok && y < result_image->y_size; y += row) {
+		for (row = 0; row < REPLY_STRIPE_HEIGHT
+		        && y + row < result_image->y_size; row++) {
+			halftone_pack_row(result_image->pixels
+			                  + (gsize) (y + row) * result_image->x_size,
+			                  result_image->x_size,
+			                  stripe + row * packed_width);
+		}
+		ok = write_all(fd, stripe, row * packed_width);
+	}
+	g_free(stripe);
+	return ok;
+}
+
+static void update_stats(gint64 queue_usec)
+{
+	g_mutex_lock(&stats_mutex);
+	stats_requests++;
+	stats_queue_total += queue_usec;
+	stats_queue_max = MAX(stats_queue_max, queue_usec);
+	if (stats_requests % STATS_INTERVAL == 0) {
+		g_print("halftoned: %u requests, queue latency "
+		        "average %.2f ms, max %.2f ms\n",
+		        stats_requests,
+		        stats_queue_total / 1000.0 / STATS_INTERVAL,
+		        stats_queue_max / 1000.0);
+		stats_queue_total = 0;
+		stats_queue_max = 0;
+	}
+	g_mutex_unlock(&stats_mutex);
+}
+
+static void handle_signal(int signum)
+{
+	quit_requested = 1;
+}
+
+int main(int argc, char ** argv)
+{
+	GOptionContext * options;
+	GError * error = NULL;
+	GThreadPool * pool;
+	struct sockaddr_un address;
+	struct sigaction action;
+	struct Connection * connection;
+	HalftoneDots * dots;
+	gchar ** sizes;
+	gint listen_fd, fd, i;
+
+	options = g_option_context_new("- Printable Halftone render daemon");
+	g_option_context_add_main_entries(options, option_entries, NULL);
+	if (!g_option_context_parse(options, &argc, &argv, &error)) {
+		g_printerr("halftoned: %s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(options);
+	if (thread_count <= 0) {
+		thread_count = g_get_num_processors();
+	}
+
+	if (preload_sizes != NULL) {
+		sizes = g_strsplit(preload_sizes, ",", 0);
+		for (i = 0; sizes[i] != NULL; i++) {
+			dots = halftone_dots_cache_get(atoi(sizes[i]));
+			if (dots == NULL) {
+				g_printerr("halftoned: cannot prepare size %s\n", sizes[i]);
+			}
+			halftone_dots_unref(dots);
+		}
+		g_strfreev(sizes);
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		g_printerr("halftoned: socket path too long\n");
+		return 1;
+	}
+	strcpy(address.sun_path, socket_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socket_path);
+	if (listen_fd < 0
+		|| bind(listen_fd, (struct sockaddr *) &address,
+		        sizeof(address)) < 0
+		|| listen(listen_fd, 64) < 0) {
+		g_printerr("halftoned: %s: %s\n", socket_path, strerror(errno));
+		return 1;
+	}
+
+	/* No SA_RESTART, so that accept() returns when asked to quit */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pool = g_thread_pool_new(serve, NULL, thread_count, TRUE, &error);
+	if (pool == NULL) {
+		g_printerr("halftoned: %s\n", error->message);
+		return 1;
+	}
+	g_print("halftoned: listening on %s with %d threads\n",
+	        socket_path, thread_count);
+
+	while (!quit_requested) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		connection = g_new(struct Connection, 1);
+		connection->fd = fd;
+		connection->accept_time = g_get_monotonic_time();
+		g_thread_pool_push(pool, connection, NULL);
+	}
+
+	close(listen_fd);
+	unlink(socket_path);
+	g_thread_pool_free(pool, FALSE, TRUE);
+	halftone_dots_cache_clear();
+	return 0;
+}
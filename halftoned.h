@@ -0,0 +1,54 @@
+/* Printable Halftone render daemon: wire protocol
+ *
+ * Copyright (C) 2006-2007, 2011 Artturi Tilanterä
+ *  <artturi.tilantera@iki.fi>
+ *
+ * See printable-halftone.c for the license.
+ */
+
+/* One request per connection over a Unix domain stream socket.
+ * All integers are in the native byte order of the machine.
+ *
+ * client -> server:
+ *   struct HalftoneRequest
+ *   height rows of width * channels bytes, top to bottom
+ *
+ * server -> client:
+ *   struct HalftoneReply
+ *   if status == HALFTONE_STATUS_OK: height rows of (width + 7) / 8 bytes,
+ *   packed like in raw PBM files (most significant bit first, 1 = black)
+ */
+#ifndef HALFTONED_H
+#define HALFTONED_H
+
+#include <glib.h>
+
+#define HALFTONE_REQUEST_MAGIC 0x51525448  /* "HTRQ" */
+#define HALFTONE_REPLY_MAGIC   0x50525448  /* "HTRP" */
+
+#define HALFTONED_DEFAULT_SOCKET "/tmp/halftoned.socket"
+
+enum {
+	HALFTONE_STATUS_OK = 0,
+	HALFTONE_STATUS_BAD_REQUEST = 1,
+	HALFTONE_STATUS_OUT_OF_MEMORY = 2
+};
+
+struct HalftoneRequest {
+	guint32 magic;
+	guint32 width;
+	guint32 height;
+	guint32 channels;     /* 1 = gray, 2 = gray + alpha, 3 = RGB, 4 = RGBA */
+	guint32 dot_spacing;  /* "Size" in the plug-in dialog */
+};
+
+struct HalftoneReply {
+	guint32 magic;
+	guint32 status;
+	guint32 width;
+	guint32 height;
+	guint32 queue_usec;   /* time the request waited for a worker */
+	guint32 render_usec;  /* receiving the pixels and rendering */
+};
+
+#endif /* HALFTONED_H */
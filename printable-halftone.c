@@ -30,103 +30,138 @@
 
 /* Installation:
  * 1. install package libgimp-dev
- * 2. gimptool-2.0 --install plugin.c
- *    (or gimptool-2.0 --install-admin plugin.c)
+ * 2. make install
+ *    (or make install-admin)
  */
 #include <stdio.h>
 #include <string.h>
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
+#include "halftone.h"
+#include "halftone-output.h"
 
 #define PROCEDURE_NAME   "gimp_plugin_printable_halftone"
+#define RESIDENT_PROCEDURE_NAME "extension_printable_halftone_resident"
+#define TEMP_PROCEDURE_NAME     "gimp_plugin_printable_halftone_resident"
 #define DATA_KEY_VALS    "plug_in_printable_halftone"
 #define DATA_KEY_UI_VALS "plug_in_printable_halftone_ui"
-#define PARASITE_KEY     "plug-in-template-options"
-#define BLACK 0
-#define WHITE 255
-#define LUMINANCES 256
+#define PARASITE_KEY     "printable-halftone-tile-hashes"
 #define SCANLINE_AREA_HEIGHT 64
+#define TILE_SIZE        64
+#define TILE_HASHES_MAGIC 0x31485448   /* "THH1" */
 
 /*
- ***** RENDERER DATA
+ ***** GIMP I/O
  */
-/* Temporary bitmap used by the renderer paint black dots on white. */
-// TODO: is this still needed?
-struct BWBitmap {
-	gint x_size;
-	gint y_size;
-	guchar * pixels;
+struct PluginIO {
+	GimpPixelRgn rgn_in, rgn_out;
+	guchar * scanlines_out;
+
+	/* channels: 1 = grayscale, 2 = grayscale + alpha,
+	 *           3 = RGB, 4 = RGB + alpha */
+	gint channels;
+
+	/* Coordinates of upper left and lower right rectangle
+	 * containing the selection in image in GIMP
+	 * to be processed. */
+	gint area_x1, area_y1,
+	     area_x2, area_y2;
+
+	/* Microseconds spent in get_row(), logged by render() */
+	gint64 read_time;
 };
 
-/* Used by the renderer when creating models of the dots */
-struct BitmapPixel { 
-	gint x_position;
-	gint y_position;
-	gint distance_from_center;
+/* PARASITE_KEY of the source drawable: what the result layer was last
+ * rendered from, followed by tiles_x * tiles_y guint64 hashes of the
+ * TILE_SIZE x TILE_SIZE source tiles. See update_layer(). */
+struct TileHashesHeader {
+	guint32 magic;
+	gint32 dot_spacing;
+	gint32 channels;
+	gint32 area_x1, area_y1, area_x2, area_y2;
+	gint32 tiles_x, tiles_y;
+
+	/* Not compared; the layer is looked up by it */
+	gint32 layer_tattoo;
 };
 
-/* a   b    dot_spacing is distance between dots a and b.
- *   c      The actual square grid has dots a, c and e on the same line.
- * d   e    dot_spacing contains last value used before current run
- *          and changes to current value used at list_pixels_of_dot().
- *          list_pixels_of_dot() also resets this if an error occurs. */
-static gint dot_spacing = 0;
-
-/* Derived from dot_spacing */
-static gint max_dot_width = 0;
-static gint dot_center = 0;
-
-/* Contains list of pixels in dot
- * sorted by their distance from the center of the dot.
- * x_position and y_position are from the center of the
- * dot, which is at (0, 0). See dot_center @ list_pixels_of_dot(). */
-struct BitmapPixel * pixels_of_dot = NULL;
-
-/* Contents of *pixels_of_dot remain unchanged (in list_pixels_of_dot())
- * if dot_spacing currently used is <= the one used when
- * contents of *pixels_of_dot was generated last time. */
- 
-/* Number of allocated BitmapPixels in *pixels_of_dot.
- * Size of dot bitmaps in *precalculated_dots. */
-static gint pixels_in_dot_bitmap = 0;
-
-/* Number of sorted pixels in *pixels_of_dot. */
-static gint max_pixels_in_dot = 0;
-
-/* Source image luminance -> dot size (pixel count) mapping.
- * Set by calibrate_dot_sizes(). */
-static gint pixel_count_of_luminance[LUMINANCES];
-
-/* Contains (max_pixels_in_dot + 1) * (max_dot_width * max_dot_width) -sized
- * bitmaps representing dot with each possible size (pixel counts from
- * zero to max_pixels_in_dot). Each byte is one pixel, values:
- * 0 = black (paint black), 1 = white (transparent). */
-static guchar * precalculated_dots = NULL;
-
-/* The final result of rendering, which is finally sent
- * back to the GIMP.
- * It's an image containing black dots painted on white background.
- * Only WHITE and BLACK colors are used. */
-static struct BWBitmap result_image = { 0, 0, NULL };
+/* Source rows of one tile, grown by the region margin.
+ * x and y are relative to the selection area and may be outside it;
+ * it is white there, so that no dots are centered outside the area,
+ * as in a render of the whole area. */
+struct RegionIO {
+	struct PluginIO * io;
+	gint x, y;
+	gint width;
+};
 
+/* Stripes of the result sent on as they are rendered,
+ * see render_stripes() */
+struct StripeOutput {
+	struct PluginIO * io;
+	GimpDrawable * drawable;
+	GimpDrawable * target;          /* NULL for file outputs */
+	gint out_channels;
+	struct BWPackedBitmap * canvas; /* file outputs */
+};
 
-/*
- ***** GIMP I/O
- */
-static GimpPixelRgn rgn_in, rgn_out;
-static guchar * scanlines_out;
+/* Where the result goes */
+enum {
+	OUTPUT_DRAWABLE,   /* replace the selection */
+	OUTPUT_PBM,        /* 1-bit files, drawable left untouched */
+	OUTPUT_TIFF_G4,
+	OUTPUT_SVG,        /* vector files, one disc per dot */
+	OUTPUT_PDF,
+	OUTPUT_INDEXED_IMAGE,      /* new black and white INDEXED image */
+	OUTPUT_TRANSPARENT_LAYER   /* new layer, black dots on transparent */
+};
 
-/* channels: 1 = grayscale, 2 = grayscale + alpha,
- *           3 = RGB, 4 = RGB + alpha */
-static gint channels;
+/* How the result is rendered */
+enum {
+	ENGINE_AM_SCREEN,      /* dots of varying size, render2() in 1.0 */
+	ENGINE_DOT_DIFFUSION,  /* Knuth 1987 */
+	ENGINE_COVERAGE        /* anti-aliased dots in gray, for the screen */
+};
 
-/* Coordinates of upper left and lower right rectangle
- * containing the selection in image in GIMP
- * to be processed. */
-static gint area_x1, area_y1,
-		   area_x2, area_y2;
+/* Settings of the latest run, kept with gimp_set_data() under
+ * DATA_KEY_VALS for the rest of the session */
+typedef struct {
+	gint size;
+	gboolean vary_size;
+	gint max_size;
+	gint32 size_map;        /* drawable setting the size */
+	gint engine;
+	gint output;
+	gchar filename[1024];
+	gboolean update_layer;
+	gboolean all_layers;    /* every layer of the image, not just drawable */
+	gint memory_limit;      /* megabytes, 0 = no limit */
+} PlugInVals;
+
+static PlugInVals vals = {
+	8,                  /* size */
+	FALSE,              /* vary_size */
+	16,                 /* max_size */
+	-1,                 /* size_map */
+	ENGINE_AM_SCREEN,   /* engine */
+	OUTPUT_DRAWABLE,    /* output */
+	"",                 /* filename */
+	TRUE,               /* update_layer */
+	FALSE,              /* all_layers */
+	0                   /* memory_limit */
+};
 
-static gint ui_value_size = 8;
+/* File written by this render: vals.filename, numbered per layer
+ * if all_layers is set */
+static gchar output_filename[1024] = "";
+
+/* Start of the stage logged next by log_memory_stage() */
+static gint64 stage_start_time = 0;
+
+/* Render context kept between calls in resident mode.
+ * Its dot tables come from halftone_dots_cache_get(), so every
+ * size used once in the session stays prepared. */
+static HalftoneContext * resident_ctx = NULL;
 
 /* General */
 static void query (void);
@@ -136,6 +171,10 @@ static void run   (const gchar     * name,
 		           gint            * nreturn_vals,
                    GimpParam       **return_vals);
 
+static void run_resident(void);
+static void render_layer(gint32 drawable_id, gint layer_number,
+                         GimpRunMode run_mode, HalftoneContext ** ctx);
+
 static gboolean dialog(GimpDrawable * drawable);
 
 //static gboolean dialog (gint32           image_ID,
@@ -145,19 +184,44 @@ static gboolean dialog(GimpDrawable * drawable);
 //                       PlugInDrawableVals * drawable_vals,
 //                       PlugInUIVals       * ui_vals);
 static gboolean dialog_image_constraint_func (gint32 image_id, gpointer data);
+static gboolean dialog_size_map_constraint_func (gint32 drawable_id,
+                                                 gpointer data);
 
 /* Rendering */
-static void render(GimpDrawable * drawable);
-static gboolean prepare_dots(const gint new_dot_spacing);
-static gint compare_BitmapPixels(const void * a, const void * b);
-static gboolean list_pixels_of_dot(const gint new_dot_spacing);
-static gint paint_pixel(struct BWBitmap * image, const gint x, const gint y);
-static gboolean calibrate_dot_sizes(void);
-static gboolean precalculate_dots(void);
-static gboolean render2(void);
-static void paint_dot(const gint x, const gint y, const gint luminance);
-static void send_to_gimp(void);
-static void cleanup_precalc(void);
+static gint32 render(GimpDrawable * drawable, HalftoneContext ** ctx);
+static GimpDrawable * create_output_drawable(GimpDrawable * drawable,
+                                             const struct PluginIO * io,
+                                             gint32 * new_image_id);
+static gboolean get_row(gint y, guchar * row, gpointer user_data);
+static void update_progress(gdouble fraction, gpointer user_data);
+static void size_tile_cache(const struct PluginIO * io);
+static void check_shm(void);
+static void log_memory_stage(const gchar * stage);
+static gint32 render_stripes(GimpDrawable * drawable, struct PluginIO * io,
+                             const HalftoneSource * source,
+                             HalftoneContext * ctx, gint stripe_height);
+static gboolean send_stripe(gint y, const struct BWBitmap * stripe,
+                            gpointer user_data);
+static GimpDrawable * init_output(GimpDrawable * drawable,
+                                  struct PluginIO * io, gint * out_channels,
+                                  gint32 * new_image_id);
+static void finish_output(GimpDrawable * drawable, GimpDrawable * target,
+                          const struct PluginIO * io);
+static void send_to_gimp(struct PluginIO * io,
+                         const struct BWBitmap * result_image, gint y_offset);
+static void send_to_new_drawable(struct PluginIO * io, gint channels,
+                                 const struct BWBitmap * result_image,
+                                 gint x, gint y);
+static void update_layer(GimpDrawable * drawable, struct PluginIO * io,
+                         HalftoneContext * ctx);
+static guint64 hash_tile(struct PluginIO * io, guchar * buffer,
+                         gint x, gint y, gint width, gint height);
+static gboolean get_region_row(gint y, guchar * row, gpointer user_data);
+static gboolean write_to_file(gint32 image_id,
+                              const struct BWBitmap * result_image,
+                              const struct BWPackedBitmap * canvas);
+static gboolean write_vector_file(gint32 image_id, const HalftoneDots * dots,
+                                  const HalftoneSource * source);
 
 GimpPlugInInfo PLUG_IN_INFO =
 {
@@ -169,10 +233,7 @@ GimpPlugInInfo PLUG_IN_INFO =
 
 MAIN()
 
-static void
-query (void)
-{
-  static GimpParamDef args[] =
+static GimpParamDef args[] =
   {
     {
       GIMP_PDB_INT32,
@@ -188,19 +249,68 @@ query (void)
       GIMP_PDB_DRAWABLE,
       "drawable",
       "Input drawable"
+    },
+    {
+      GIMP_PDB_INT32,
+      "size",
+      "Distance between dots in pixels (2 <= size <= 100)"
+    },
+    {
+      GIMP_PDB_INT32,
+      "all-layers",
+      "Process every layer of the image instead of drawable (TRUE, FALSE); "
+      "file names get the layer number before the extension"
+    },
+    {
+      GIMP_PDB_INT32,
+      "engine",
+      "Rendering (0 = dots, 1 = dot diffusion, 2 = anti-aliased dots)"
+    },
+    {
+      GIMP_PDB_INT32,
+      "output",
+      "Where the result goes (0 = replace the selection, 1 = PBM file, "
+      "2 = TIFF G4 file, 3 = SVG file, 4 = PDF file, "
+      "5 = new black and white image, 6 = new transparent layer)"
+    },
+    {
+      GIMP_PDB_STRING,
+      "filename",
+      "File for outputs 1 - 4"
+    },
+    {
+      GIMP_PDB_INT32,
+      "memory-limit",
+      "Most memory for rendering in megabytes, 0 = no limit. "
+      "Larger images are rendered in stripes with the dots engine"
+    }
+  };
+
+static GimpParamDef resident_args[] =
+  {
+    {
+      GIMP_PDB_INT32,
+      "run-mode",
+      "Run mode"
     }
   };
 
-  const gchar * help_string =
+static const gchar * help_string =
     "Models analog halftoning by literally painting black dots "
 	"on white background, varying dot size according to the "
 	"source lightness. No digital halftoning cells used. "
 	"Grid angle is 45 degrees. Size = DPI / LPI * 1.4 . "
 	"(1.4 ~= square root of 2) " 
 	"Example: Size = 14 produces halftone with 60 LPI on 600 DPI image. "
+	"Size may vary across the image as set by another layer "
+	"(black = Size, white = the second size). "
+	"Alternatively renders with Knuth's dot diffusion. "
 	"Uses 30% R + 59% G + 11% B grayscale conversion "
 	"in RGB images like GIMP does. Preserves alpha channel.";
- 
+
+static void
+query (void)
+{
   gimp_install_procedure (
 	PROCEDURE_NAME,
     "",
@@ -215,6 +325,27 @@ query (void)
     args, NULL);
 
   gimp_plugin_menu_register (PROCEDURE_NAME, "<Image>/Filters/Distorts");
+
+  /* Optional resident mode: started from the menu, stays alive
+   * for the rest of the session and serves TEMP_PROCEDURE_NAME. */
+  gimp_install_procedure (
+	RESIDENT_PROCEDURE_NAME,
+    "Keeps Printable Halftone loaded for the session",
+    "Starts Printable Halftone as a resident extension which "
+	"adds Filters > Distorts > Printable Halftone (resident). "
+	"Prepared dot tables, render buffers and painting threads are "
+	"kept between calls, so repeated use skips plug-in startup, "
+	"table building and thread startup.",
+    "Artturi Tilanterä",
+    "Artturi Tilanterä",
+    "2011",
+    "Printable Halftone _Resident Mode",
+    "",
+    GIMP_EXTENSION,
+    G_N_ELEMENTS (resident_args), 0,
+    resident_args, NULL);
+
+  gimp_plugin_menu_register (RESIDENT_PROCEDURE_NAME, "<Toolbox>/Xtns");
 }
 
 static void
@@ -228,6 +359,11 @@ run (const gchar      *name,
   GimpPDBStatusType status = GIMP_PDB_SUCCESS;
   GimpRunMode       run_mode;
   GimpDrawable     *drawable;
+  HalftoneContext  *ctx = NULL;
+  HalftoneContext **ctx_used;
+  gint32            image_id;
+  gint32           *layers;
+  gint              layer_count, i;
 
   /* Setting mandatory output values */
   *nreturn_vals = 1;
@@ -236,38 +372,156 @@ run (const gchar      *name,
   values[0].type = GIMP_PDB_STATUS;
   values[0].data.d_status = status;
 
+  if (strcmp (name, RESIDENT_PROCEDURE_NAME) == 0)
+    {
+      run_resident ();
+      return;
+    }
+
   /* Getting run_mode - we won't display a dialog if 
    * we are in NONINTERACTIVE mode */
   run_mode = param[0].data.d_int32;
 
   /*  Get the specified drawable  */
+  image_id = param[1].data.d_image;
   drawable = gimp_drawable_get (param[2].data.d_drawable);
 
   switch (run_mode)
     {
     case GIMP_RUN_INTERACTIVE:
       /* Get options last values if needed */
-//      gimp_get_data (PROCEDURE_NAME, &bvals);
+      gimp_get_data (DATA_KEY_VALS, &vals);
 
       /* Display the dialog */
       if (!dialog(drawable))
-        return;
+        {
+          gimp_drawable_detach (drawable);
+          return;
+        }
+      break;
+
+    case GIMP_RUN_NONINTERACTIVE:
+      if (nparams != G_N_ELEMENTS (args))
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+          break;
+        }
+      vals.size       = param[3].data.d_int32;
+      vals.all_layers = param[4].data.d_int32;
+      vals.engine     = param[5].data.d_int32;
+      vals.output     = param[6].data.d_int32;
+      /* Neither is a PDB argument; scripts get a full render that does
+       * not depend on parasites left by earlier runs */
+      vals.vary_size  = FALSE;
+      vals.update_layer = FALSE;
+      g_strlcpy (vals.filename,
+                 param[7].data.d_string ? param[7].data.d_string : "",
+                 sizeof (vals.filename));
+      vals.memory_limit = param[8].data.d_int32;
+      if (vals.size < 2 || vals.size > 100
+          || vals.memory_limit < 0
+          || vals.engine < ENGINE_AM_SCREEN || vals.engine > ENGINE_COVERAGE
+          || vals.output < OUTPUT_DRAWABLE
+          || vals.output > OUTPUT_TRANSPARENT_LAYER)
+        status = GIMP_PDB_CALLING_ERROR;
+      break;
+
+    case GIMP_RUN_WITH_LAST_VALS:
+      gimp_get_data (DATA_KEY_VALS, &vals);
       break;
 
     default:
       break;
     }
 
-  render(drawable);
+  if (status == GIMP_PDB_SUCCESS)
+    {
+      /* One context for all layers; in resident mode, for the session */
+      if (strcmp (name, TEMP_PROCEDURE_NAME) == 0)
+        ctx_used = &resident_ctx;
+      else
+        ctx_used = &ctx;
 
-  gimp_displays_flush();
-  gimp_drawable_detach(drawable);
+      if (vals.all_layers)
+        {
+          layers = gimp_image_get_layers (image_id, &layer_count);
+          for (i = 0; i < layer_count; i++)
+            render_layer (layers[i], i + 1, run_mode, ctx_used);
+          g_free (layers);
+        }
+      else
+        {
+          render_layer (drawable->drawable_id, 0, run_mode, ctx_used);
+        }
+      halftone_context_free (ctx);
+      gimp_displays_flush ();
+
+      /*  Finally, set options in the core  */
+      if (run_mode == GIMP_RUN_INTERACTIVE)
+        gimp_set_data (DATA_KEY_VALS, &vals, sizeof (vals));
+    }
 
-  /*  Finally, set options in the core  */
-  if (run_mode == GIMP_RUN_INTERACTIVE)
-//    gimp_set_data (PROCEDURE_NAME, &bvals, sizeof (MyBlurVals));
+  gimp_drawable_detach (drawable);
+  values[0].data.d_status = status;
+}
 
-  return;
+/*
+ * Renders one drawable. layer_number > 0 is added to the file name.
+ */
+static void
+render_layer (gint32            drawable_id,
+              gint              layer_number,
+              GimpRunMode       run_mode,
+              HalftoneContext **ctx)
+{
+  GimpDrawable *drawable = gimp_drawable_get (drawable_id);
+  const gchar  *extension = strrchr (vals.filename, '.');
+  gint32        new_image_id;
+
+  /* name.pbm -> name-1.pbm */
+  if (layer_number > 0 && extension != NULL
+      && strchr (extension, G_DIR_SEPARATOR) == NULL)
+    g_snprintf (output_filename, sizeof (output_filename), "%.*s-%d%s",
+                (gint) (extension - vals.filename), vals.filename,
+                layer_number, extension);
+  else if (layer_number > 0)
+    g_snprintf (output_filename, sizeof (output_filename), "%s-%d",
+                vals.filename, layer_number);
+  else
+    g_strlcpy (output_filename, vals.filename, sizeof (output_filename));
+
+  new_image_id = render (drawable, ctx);
+  if (new_image_id != -1 && run_mode == GIMP_RUN_INTERACTIVE)
+    gimp_display_new (new_image_id);
+  gimp_drawable_detach (drawable);
+}
+
+/*
+ * Resident mode main loop. Never returns; GIMP ends the process
+ * when it quits.
+ */
+static void
+run_resident (void)
+{
+  gimp_install_temp_proc (
+	TEMP_PROCEDURE_NAME,
+    "",
+    help_string,
+    "Artturi Tilanterä",
+    "Artturi Tilanterä",
+    "2011",
+    "Printable Halftone (resident)...",
+    "RGB*, GRAY*",
+    GIMP_TEMPORARY,
+    G_N_ELEMENTS (args), 0,
+    args, NULL,
+    run);
+
+  gimp_plugin_menu_register (TEMP_PROCEDURE_NAME, "<Image>/Filters/Distorts");
+
+  gimp_extension_ack ();
+  for (;;)
+    gimp_extension_process (0);
 }
 
 /* User Interface */
@@ -277,8 +531,28 @@ static gboolean dialog(GimpDrawable * drawable)
 	GtkWidget *dialog;
 	GtkWidget *main_vbox;
 	GtkWidget *main_hbox;
+	GtkWidget *options_vbox;
+	GtkWidget *output_hbox;
+	GtkWidget *engine_hbox;
+	GtkWidget *engine_label;
+	GtkWidget *engine_combo;
+	GtkWidget *vary_hbox;
+	GtkWidget *vary_check;
+	GtkWidget *vary_label;
+	GtkWidget *max_size_spinbutton;
+	GtkWidget *max_size_adj;
+	GtkWidget *size_map_combo;
 	GtkWidget *frame;
 	GtkWidget *size_label;
+	GtkWidget *output_label;
+	GtkWidget *output_combo;
+	GtkWidget *filename_entry;
+	GtkWidget *update_check;
+	GtkWidget *all_layers_check;
+	GtkWidget *memory_hbox;
+	GtkWidget *memory_label;
+	GtkWidget *memory_spinbutton;
+	GtkWidget *memory_adj;
 	GtkWidget *alignment;
 	GtkWidget *spinbutton;
 	GtkWidget *spinbutton_adj;
@@ -307,9 +581,13 @@ static gboolean dialog(GimpDrawable * drawable)
 	gtk_container_add (GTK_CONTAINER (frame), alignment);
 	gtk_alignment_set_padding (GTK_ALIGNMENT (alignment), 6, 6, 6, 6);
 
+	options_vbox = gtk_vbox_new (FALSE, 6);
+	gtk_widget_show (options_vbox);
+	gtk_container_add (GTK_CONTAINER (alignment), options_vbox);
+
 	main_hbox = gtk_hbox_new (FALSE, 0);
 	gtk_widget_show (main_hbox);
-	gtk_container_add (GTK_CONTAINER (alignment), main_hbox);
+	gtk_box_pack_start (GTK_BOX (options_vbox), main_hbox, FALSE, FALSE, 0);
 
 	/* Size label */
 	size_label = gtk_label_new_with_mnemonic ("_Size:");
@@ -318,7 +596,7 @@ static gboolean dialog(GimpDrawable * drawable)
 	gtk_label_set_justify (GTK_LABEL (size_label), GTK_JUSTIFY_RIGHT);
 
 	/* Spin buttons */
-	spinbutton_adj = (GtkWidget *) gtk_adjustment_new (8, 2, 100, 1, 5, 0);
+	spinbutton_adj = (GtkWidget *) gtk_adjustment_new (vals.size, 2, 100, 1, 5, 0);
 	//spinbutton_adj = (GtkWidget *) gtk_adjustment_new (8, 2, 100, 1, 5, 5);
 	spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (spinbutton_adj), 1, 0);
 	gtk_widget_show (spinbutton);
@@ -327,11 +605,148 @@ static gboolean dialog(GimpDrawable * drawable)
 
 	g_signal_connect (spinbutton_adj, "value_changed",
 	                  G_CALLBACK (gimp_int_adjustment_update),
-					  &ui_value_size);
+					  &vals.size);
+
+	/* Vary size: black in the size map = Size, white = the second size */
+	vary_hbox = gtk_hbox_new (FALSE, 0);
+	gtk_widget_show (vary_hbox);
+	gtk_box_pack_start (GTK_BOX (options_vbox), vary_hbox, FALSE, FALSE, 0);
+
+	vary_check = gtk_check_button_new_with_mnemonic ("_Vary size up to");
+	gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (vary_check),
+	                              vals.vary_size);
+	g_signal_connect (vary_check, "toggled",
+	                  G_CALLBACK (gimp_toggle_button_update),
+	                  &vals.vary_size);
+	gtk_widget_show (vary_check);
+	gtk_box_pack_start (GTK_BOX (vary_hbox), vary_check, FALSE, FALSE, 6);
+
+	max_size_adj = (GtkWidget *) gtk_adjustment_new (vals.max_size,
+	                                                 2, 100, 1, 5, 0);
+	max_size_spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (max_size_adj),
+	                                           1, 0);
+	gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (max_size_spinbutton), TRUE);
+	g_signal_connect (max_size_adj, "value_changed",
+	                  G_CALLBACK (gimp_int_adjustment_update),
+	                  &vals.max_size);
+	gtk_widget_show (max_size_spinbutton);
+	gtk_box_pack_start (GTK_BOX (vary_hbox), max_size_spinbutton,
+	                    FALSE, FALSE, 6);
+
+	vary_label = gtk_label_new_with_mnemonic ("by layer");
+	gtk_widget_show (vary_label);
+	gtk_box_pack_start (GTK_BOX (vary_hbox), vary_label, FALSE, FALSE, 6);
+
+	size_map_combo = gimp_drawable_combo_box_new (
+	        dialog_size_map_constraint_func, drawable);
+	gimp_int_combo_box_connect (GIMP_INT_COMBO_BOX (size_map_combo),
+	                            vals.size_map,
+	                            G_CALLBACK (gimp_int_combo_box_get_active),
+	                            &vals.size_map);
+	gtk_widget_show (size_map_combo);
+	gtk_box_pack_start (GTK_BOX (vary_hbox), size_map_combo, TRUE, TRUE, 6);
+
+	/* Engine */
+	engine_hbox = gtk_hbox_new (FALSE, 0);
+	gtk_widget_show (engine_hbox);
+	gtk_box_pack_start (GTK_BOX (options_vbox), engine_hbox, FALSE, FALSE, 0);
+
+	engine_label = gtk_label_new_with_mnemonic ("_Engine:");
+	gtk_widget_show (engine_label);
+	gtk_box_pack_start (GTK_BOX (engine_hbox), engine_label, FALSE, FALSE, 6);
+
+	engine_combo = gimp_int_combo_box_new ("Dots (AM screen)", ENGINE_AM_SCREEN,
+	                                       "Dot diffusion",
+	                                       ENGINE_DOT_DIFFUSION,
+	                                       "Anti-aliased dots (screen proof)",
+	                                       ENGINE_COVERAGE,
+	                                       NULL);
+	gimp_int_combo_box_connect (GIMP_INT_COMBO_BOX (engine_combo),
+	                            vals.engine,
+	                            G_CALLBACK (gimp_int_combo_box_get_active),
+	                            &vals.engine);
+	gtk_widget_show (engine_combo);
+	gtk_box_pack_start (GTK_BOX (engine_hbox), engine_combo, FALSE, FALSE, 6);
+
+	/* Output: replace the selection or write a 1-bit file */
+	output_hbox = gtk_hbox_new (FALSE, 0);
+	gtk_widget_show (output_hbox);
+	gtk_box_pack_start (GTK_BOX (options_vbox), output_hbox, FALSE, FALSE, 0);
+
+	output_label = gtk_label_new_with_mnemonic ("_Output:");
+	gtk_widget_show (output_label);
+	gtk_box_pack_start (GTK_BOX (output_hbox), output_label, FALSE, FALSE, 6);
+
+	output_combo = gimp_int_combo_box_new ("Replace selection", OUTPUT_DRAWABLE,
+	                                       "New layer, transparent",
+	                                       OUTPUT_TRANSPARENT_LAYER,
+	                                       "New black and white image",
+	                                       OUTPUT_INDEXED_IMAGE,
+	                                       "PBM file",          OUTPUT_PBM,
+	                                       "TIFF G4 file",      OUTPUT_TIFF_G4,
+	                                       "SVG file",          OUTPUT_SVG,
+	                                       "PDF file",          OUTPUT_PDF,
+	                                       NULL);
+	gimp_int_combo_box_connect (GIMP_INT_COMBO_BOX (output_combo),
+	                            vals.output,
+	                            G_CALLBACK (gimp_int_combo_box_get_active),
+	                            &vals.output);
+	gtk_widget_show (output_combo);
+	gtk_box_pack_start (GTK_BOX (output_hbox), output_combo, FALSE, FALSE, 6);
+
+	filename_entry = gtk_entry_new ();
+	gtk_entry_set_text (GTK_ENTRY (filename_entry), vals.filename);
+	gtk_widget_show (filename_entry);
+	gtk_box_pack_start (GTK_BOX (output_hbox), filename_entry, TRUE, TRUE, 6);
+
+	update_check = gtk_check_button_new_with_mnemonic (
+	        "Update the _previous layer where the source has changed");
+	gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (update_check),
+	                              vals.update_layer);
+	g_signal_connect (update_check, "toggled",
+	                  G_CALLBACK (gimp_toggle_button_update),
+	                  &vals.update_layer);
+	gtk_widget_show (update_check);
+	gtk_box_pack_start (GTK_BOX (options_vbox), update_check, FALSE, FALSE, 6);
+
+	all_layers_check = gtk_check_button_new_with_mnemonic (
+	        "_All layers (files get the layer number)");
+	gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (all_layers_check),
+	                              vals.all_layers);
+	g_signal_connect (all_layers_check, "toggled",
+	                  G_CALLBACK (gimp_toggle_button_update),
+	                  &vals.all_layers);
+	gtk_widget_show (all_layers_check);
+	gtk_box_pack_start (GTK_BOX (options_vbox), all_layers_check,
+	                    FALSE, FALSE, 6);
+
+	/* Memory limit: larger images are rendered in stripes */
+	memory_hbox = gtk_hbox_new (FALSE, 0);
+	gtk_widget_show (memory_hbox);
+	gtk_box_pack_start (GTK_BOX (options_vbox), memory_hbox, FALSE, FALSE, 0);
+
+	memory_label = gtk_label_new_with_mnemonic ("_Memory limit (MB, 0 = none):");
+	gtk_widget_show (memory_label);
+	gtk_box_pack_start (GTK_BOX (memory_hbox), memory_label, FALSE, FALSE, 6);
+
+	memory_adj = (GtkWidget *) gtk_adjustment_new (vals.memory_limit,
+	                                               0, 65536, 16, 256, 0);
+	memory_spinbutton = gtk_spin_button_new (GTK_ADJUSTMENT (memory_adj),
+	                                         1, 0);
+	gtk_spin_button_set_numeric (GTK_SPIN_BUTTON (memory_spinbutton), TRUE);
+	g_signal_connect (memory_adj, "value_changed",
+	                  G_CALLBACK (gimp_int_adjustment_update),
+	                  &vals.memory_limit);
+	gtk_widget_show (memory_spinbutton);
+	gtk_box_pack_start (GTK_BOX (memory_hbox), memory_spinbutton,
+	                    FALSE, FALSE, 6);
 
 	gtk_widget_show(dialog);
 	
   	run = (gimp_dialog_run (GIMP_DIALOG (dialog)) == GTK_RESPONSE_OK);
+	g_strlcpy (vals.filename,
+	           gtk_entry_get_text (GTK_ENTRY (filename_entry)),
+	           sizeof (vals.filename));
 
 	gtk_widget_destroy (dialog);
 	return run;
@@ -344,532 +759,833 @@ dialog_image_constraint_func (gint32    image_id,
   return (gimp_image_base_type (image_id) == GIMP_RGB);
 }
 
+/* Size maps must cover the drawable pixel for pixel */
+static gboolean
+dialog_size_map_constraint_func (gint32    drawable_id,
+                                 gpointer  data)
+{
+  GimpDrawable *drawable = (GimpDrawable *) data;
+
+  return (gimp_drawable_width (drawable_id) == drawable->width
+          && gimp_drawable_height (drawable_id) == drawable->height);
+}
+
 /* Rendering */
 
-static void render(GimpDrawable * drawable)
+/*
+ * Renders the selection of drawable with *ctx. If *ctx is NULL,
+ * creates a new context there; the caller owns it either way.
+ * Returns the ID of the image created for OUTPUT_INDEXED_IMAGE, or -1.
+ */
+static gint32 render(GimpDrawable * drawable, HalftoneContext ** ctx)
 {
+	struct PluginIO io, size_map_io;
+	HalftoneSource source, size_map;
+	GimpDrawable * size_map_drawable = NULL;
+	HalftoneDots * dots;
+	GimpDrawable * target = NULL;
+	gint32 image_id = gimp_drawable_get_image(drawable->drawable_id);
+	gint32 new_image_id = -1;
+	gint width, height, out_channels, stripe_height;
+	gsize budget, dots_size, output_size, full_size;
+	gboolean ok;
+
+	halftone_memory_reset_peak();
+	stage_start_time = g_get_monotonic_time();
   	gimp_drawable_mask_bounds(drawable->drawable_id,
-  	        &area_x1, &area_y1,
-  	        &area_x2, &area_y2);
-	result_image.x_size = area_x2 - area_x1;
-	result_image.y_size = area_y2 - area_y1;
- 	channels = gimp_drawable_bpp(drawable->drawable_id);
- 	gimp_pixel_rgn_init (&rgn_in, drawable, area_x1, area_y1,
- 	        result_image.x_size, result_image.y_size, FALSE, FALSE);
- 	gimp_pixel_rgn_init (&rgn_out, drawable, area_x1, area_y1,
- 	        result_image.x_size, result_image.y_size, TRUE, TRUE);
-
-	if (prepare_dots(ui_value_size) == FALSE) {
+  	        &io.area_x1, &io.area_y1,
+  	        &io.area_x2, &io.area_y2);
+	width = io.area_x2 - io.area_x1;
+	height = io.area_y2 - io.area_y1;
+ 	io.channels = gimp_drawable_bpp(drawable->drawable_id);
+	io.read_time = 0;
+ 	gimp_pixel_rgn_init (&io.rgn_in, drawable, io.area_x1, io.area_y1,
+ 	        width, height, FALSE, FALSE);
+	size_tile_cache(&io);
+	check_shm();
+
+	source.width = width;
+	source.height = height;
+	source.channels = io.channels;
+	source.format = HALFTONE_FORMAT_U8;
+	source.get_row = get_row;
+	source.progress = update_progress;
+	source.user_data = &io;
+
+	if (vals.vary_size) {
+		if (vals.engine != ENGINE_AM_SCREEN
+		    || vals.output == OUTPUT_SVG
+		    || vals.output == OUTPUT_PDF) {
+			g_message("Printable Halftone: Varying size works only with "
+			          "the dot (AM screen) engine and bitmap output.");
+			return -1;
+		}
+		if (!gimp_drawable_is_valid(vals.size_map)
+		    || gimp_drawable_width(vals.size_map) != drawable->width
+		    || gimp_drawable_height(vals.size_map) != drawable->height) {
+			g_message("Printable Halftone: The size map layer must have "
+			          "the size of the drawable.");
+			return -1;
+		}
+		size_map_drawable = gimp_drawable_get(vals.size_map);
+		size_map_io = io;
+		size_map_io.channels = gimp_drawable_bpp(vals.size_map);
+		gimp_pixel_rgn_init (&size_map_io.rgn_in, size_map_drawable,
+		        io.area_x1, io.area_y1, width, height, FALSE, FALSE);
+		size_map = source;
+		size_map.channels = size_map_io.channels;
+		size_map.progress = NULL;
+		size_map.user_data = &size_map_io;
+	}
+
+	/* Vector output needs only the dot tables */
+	if (vals.output == OUTPUT_SVG || vals.output == OUTPUT_PDF) {
+		if (vals.engine == ENGINE_DOT_DIFFUSION) {
+			g_message("Printable Halftone: SVG and PDF output "
+			          "need dots, not dot diffusion.");
+			goto out;
+		}
+		dots = halftone_dots_cache_get(vals.size);
+		if (dots == NULL) {
+			g_message("Printable halftone: Out of memory.");
+		} else if (write_vector_file(image_id, dots, &source) == FALSE) {
+			g_message("Printable Halftone: Cannot write \"%s\".",
+			          output_filename);
+		}
+		halftone_dots_unref(dots);
+		goto out;
+	}
+
+	/* Gray levels would be lost in the 1-bit outputs */
+	if (vals.engine == ENGINE_COVERAGE
+	    && (vals.output == OUTPUT_PBM
+	        || vals.output == OUTPUT_TIFF_G4
+	        || vals.output == OUTPUT_INDEXED_IMAGE)) {
+		g_message("Printable Halftone: Anti-aliased dots can only "
+		          "replace the selection or go to a transparent layer.");
+		goto out;
+	}
+
+	dots = halftone_dots_cache_get(vals.size);
+	if (dots != NULL) {
+		if (*ctx == NULL) {
+			*ctx = halftone_context_new_for_dots(dots);
+		} else {
+			halftone_context_set_dots(*ctx, dots);
+		}
+		halftone_dots_unref(dots);
+	}
+	if (dots == NULL || *ctx == NULL) {
 		g_message("Printable halftone: Out of memory.");
-	} else {
-		if (render2() == FALSE) {
-			g_message("Printable Halftone: Out of memory.");
+		goto out;
+	}
+	log_memory_stage("dot tables");
+	if (vals.output == OUTPUT_TRANSPARENT_LAYER && vals.update_layer
+	    && vals.engine == ENGINE_AM_SCREEN && size_map_drawable == NULL) {
+		update_layer(drawable, &io, *ctx);
+		log_memory_stage("update layer");
+		goto out;
+	}
+
+	/* Over the memory limit, the dots engine renders in stripes.
+	 * Bitmap files then collect the stripes in a bit-packed canvas. */
+	stripe_height = height;
+	budget = (gsize) vals.memory_limit << 20;
+	if (budget > 0) {
+		dots_size = halftone_dots_size((*ctx)->dots);
+		output_size = (gsize) SCANLINE_AREA_HEIGHT * width * 4;
+		full_size = dots_size + output_size
+		            + halftone_render_size((*ctx)->dots, &source, height);
+		/* What the other engines take besides */
+		if (vals.engine == ENGINE_DOT_DIFFUSION) {
+			full_size += halftone_diffusion_size(&source);
+		} else if (vals.engine == ENGINE_COVERAGE) {
+			full_size += halftone_coverage_size((*ctx)->dots);
+		} else if (size_map_drawable != NULL) {
+			full_size += halftone_varying_size(&size_map,
+			        MIN(vals.size, vals.max_size),
+			        MAX(vals.size, vals.max_size));
+		}
+		if (full_size > budget
+		    && (vals.engine != ENGINE_AM_SCREEN
+		        || size_map_drawable != NULL)) {
+			g_message("Printable Halftone: This needs %" G_GSIZE_FORMAT
+			          " MB, more than the memory limit. Only the dots "
+			          "engine at one size can render in parts.",
+			          (full_size >> 20) + 1);
+			goto out;
+		}
+		if (full_size > budget) {
+			if (vals.output == OUTPUT_PBM || vals.output == OUTPUT_TIFF_G4) {
+				output_size = (gsize) (width + 7) / 8 * height + 2 * width;
+			}
+			stripe_height = 0;
+			if (dots_size + output_size < budget) {
+				stripe_height = halftone_stripe_height((*ctx)->dots, &source,
+				        budget - dots_size - output_size);
+			}
+			if (stripe_height == 0) {
+				g_message("Printable Halftone: The memory limit of %d MB "
+				          "is too small for this image.", vals.memory_limit);
+				goto out;
+			}
 		}
 	}
- 
- 	/* Update the modified region */
- 	gimp_drawable_flush (drawable);
- 	gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
- 	gimp_drawable_update (drawable->drawable_id,
- 	                      area_x1, area_y1,
-						  result_image.x_size, result_image.y_size);
-	cleanup_precalc();
-}
+	if (stripe_height < height) {
+		new_image_id = render_stripes(drawable, &io, &source, *ctx,
+		                              stripe_height);
+		log_memory_stage("render and output in stripes");
+		goto out;
+	}
 
-/* Private functions */
+	switch (vals.engine) {
+	case ENGINE_DOT_DIFFUSION:
+		ok = halftone_context_render_diffusion(*ctx, &source, 0);
+		break;
+	case ENGINE_COVERAGE:
+		ok = halftone_context_render_coverage(*ctx, &source);
+		break;
+	default:
+		if (size_map_drawable != NULL) {
+			ok = halftone_context_render_varying(*ctx, &source, &size_map,
+			        MIN(vals.size, vals.max_size),
+			        MAX(vals.size, vals.max_size));
+		} else {
+			ok = halftone_context_render_parallel(*ctx, &source, 0);
+		}
+		break;
+	}
+	log_memory_stage("render");
+	g_debug("Printable Halftone: reading the drawable: %.3f s",
+	        io.read_time / 1e6);
+	if (ok == FALSE) {
+		g_message("Printable Halftone: Out of memory.");
+		goto out;
+	}
 
-/*
- * Prepares everything for the actual filtering
- */
-static gboolean prepare_dots(const gint new_dot_spacing)
-{
-	if (list_pixels_of_dot(new_dot_spacing) == FALSE) {
-		return FALSE;
+	switch (vals.output) {
+	case OUTPUT_PBM:
+	case OUTPUT_TIFF_G4:
+		if (write_to_file(image_id, &(*ctx)->result_image, NULL) == FALSE) {
+			g_message("Printable Halftone: Cannot write \"%s\".",
+			          output_filename);
+		}
+		log_memory_stage("output");
+		goto out;
+	default:
+		break;
 	}
-	if (calibrate_dot_sizes() == FALSE) {
-		return FALSE;
+
+	target = init_output(drawable, &io, &out_channels, &new_image_id);
+	io.scanlines_out = (guchar *) halftone_try_malloc(SCANLINE_AREA_HEIGHT
+	                                                  * width * out_channels);
+	if (io.scanlines_out == NULL) {
+		g_message("Printable halftone: Out of memory.");
+	} else if (target == drawable) {
+		send_to_gimp(&io, &(*ctx)->result_image, 0);
+	} else {
+		send_to_new_drawable(&io, out_channels, &(*ctx)->result_image, 0, 0);
 	}
-	if (precalculate_dots() == FALSE) {
-		return FALSE;
+	halftone_free(io.scanlines_out, SCANLINE_AREA_HEIGHT * width * out_channels);
+	finish_output(drawable, target, &io);
+	log_memory_stage("output");
+
+out:
+	if (size_map_drawable != NULL) {
+		gimp_drawable_detach(size_map_drawable);
 	}
-	return TRUE;
+	return new_image_id;
 }
 
-static gint compare_BitmapPixels(const void * a, const void * b)
+/*
+ * Logs the time and the peak memory use of the renderer during a
+ * stage, for running GIMP with G_MESSAGES_DEBUG=all, and starts the
+ * next stage.
+ */
+static void log_memory_stage(const gchar * stage)
 {
-	struct BitmapPixel * pa = (struct BitmapPixel *)a,
-				* pb = (struct BitmapPixel *)b;	
-	gint distance_difference = pa->distance_from_center
-	        - pb->distance_from_center;
-	if (distance_difference > 0) {
-		return 1;
-	} else if (distance_difference < 0) {
-		return -1;
-	} else {
-		return 0;
-	}
+	gint64 now = g_get_monotonic_time();
+
+	g_debug("Printable Halftone: %s: %.3f s, peak %" G_GSIZE_FORMAT
+	        " bytes, %" G_GSIZE_FORMAT " bytes left in use",
+	        stage, (now - stage_start_time) / 1e6,
+	        halftone_memory_peak(), halftone_memory_in_use());
+	halftone_memory_reset_peak();
+	stage_start_time = now;
 }
 
 /*
- * Creates a list of pixels in the dot containing the x and y coordinates
- * and the distance from the center of the dot.
- * Pixels are sorted by their distance. The result is in *pixels_of_dot.
+ * Sizes the plug-in's tile cache for the selection. Without one, each
+ * gimp_pixel_rgn_get_row() is expected to fetch every tile under the
+ * row from the core again, for a row of pixels from each; this is not
+ * measured yet, see testit.txt. The renderer reads rows
+ * of one tile row before going down, and the output goes in
+ * SCANLINE_AREA_HEIGHT rows, which may straddle tile rows, both to the
+ * output and, when replacing the selection, from the input. So the
+ * cache needs that many tile rows, twice, across the selection.
  */
-static gboolean list_pixels_of_dot(const gint new_dot_spacing)
+static void size_tile_cache(const struct PluginIO * io)
 {
-	/* Create an array of max_dot_width x max_dot_width pixels,
-	 * representing bitmap of maximum-sized black dot.
-	 * Each pixel contains following information:
-	 * x and y position in bitmap and distance from the center
-	 * of the bitmap (~= the center of the dot).
-	 */
-	gint x, y, distance_x, distance_y;
-	gint dot_center_squared;
-	gint distance;
-
-	if (new_dot_spacing < 2) {
-		return FALSE;
-	}
+	gint tile_width = gimp_tile_width();
+	gint tiles_x = (io->area_x2 - 1) / tile_width - io->area_x1 / tile_width
+	               + 1;
+	gint tile_rows = (SCANLINE_AREA_HEIGHT - 1) / gimp_tile_height() + 2;
 
-	dot_spacing = new_dot_spacing;
-	max_dot_width = dot_spacing + 2;
-	if (max_dot_width %2 == 0)
-		max_dot_width += 1;
-	dot_center = (max_dot_width-1)/2;
-	dot_center_squared = dot_center * dot_center;
-	pixels_in_dot_bitmap = max_dot_width * max_dot_width;
+	gimp_tile_cache_ntiles(2 * tile_rows * tiles_x);
+}
 
-	/* Create a list of pixels in the dot */
-	pixels_of_dot = (struct BitmapPixel *) g_realloc(pixels_of_dot,
-			pixels_in_dot_bitmap * sizeof(struct BitmapPixel));
-	if (pixels_of_dot == NULL) {
-		cleanup_precalc();
-		return FALSE;
-	}
+/*
+ * Tiles go to and from the core through shared memory, unless the
+ * GIMP runs without it (gimp --no-shm, or no shared memory on the
+ * system). Then every tile is copied through the pipe, which takes
+ * longer than rendering. Reported once per process.
+ */
+static void check_shm(void)
+{
+	static gboolean reported = FALSE;
 
-	/* 
-	 * Measure pixels' distance from the center of the dot */
-	for (y = 0; y < max_dot_width; y++) {
-		for (x = 0; x < max_dot_width; x++) {
-			distance_x = x - dot_center;
-			distance_y = y - dot_center;
-			
-			/* Since distances are calculated only to sort pixels by
-			 * their distance, the square of the distance is enough;
-			 * (a > b) <=> (sqrt(a) > sqrt(b)), so no time-consuming
-			 * square rooting calculation is required. */
-			distance = distance_x * distance_x + distance_y * distance_y;
-			if (distance < dot_center_squared) {
-				pixels_of_dot[max_pixels_in_dot]
-					.x_position = distance_x;
-				pixels_of_dot[max_pixels_in_dot]
-					.y_position = distance_y;
-				pixels_of_dot[max_pixels_in_dot]
-					.distance_from_center = distance;
-				max_pixels_in_dot++;
-			}
-		}
+	if (gimp_shm_ID() == -1 && !reported) {
+		g_message("Printable Halftone: The GIMP is not sharing memory "
+		          "with plug-ins, so reading and writing the image is slow. "
+		          "Start it without --no-shm if possible.");
+		reported = TRUE;
 	}
-	qsort(pixels_of_dot, max_pixels_in_dot, sizeof(struct BitmapPixel),
-	      compare_BitmapPixels);
-
-	return TRUE;
 }
 
 /*
- * Assigns dot sizes to luminance values.
- * Fills pixel_count_of_luminance.
- * Paints five black dots on bitmap with size of dot_spacing X dot_spacing
- * and white background with four dots on each corner and one at the center,
- * growing dot sizes pixel by pixel and measuring white pixels / all pixels
- * ratio = final luminance.
+ * Renders with the dots engine stripe_height rows at a time, for images
+ * whose whole result does not fit in the memory limit. Drawables get
+ * each stripe as it is done; bitmap files are written from a bit-packed
+ * canvas at the end. Returns the new image for OUTPUT_INDEXED_IMAGE,
+ * or -1.
  */
-static gboolean calibrate_dot_sizes(void)
+static gint32 render_stripes(GimpDrawable * drawable, struct PluginIO * io,
+                             const HalftoneSource * source,
+                             HalftoneContext * ctx, gint stripe_height)
 {
-	struct BWBitmap test_image;
-	gint x, y, image_center;
-	gint n, black_pixels_in_bitmap, test_image_size;
-	gint shade, previous_shade, dot_pixel_size;
-	gint shade_ranges[LUMINANCES], shade_range_dot_sizes[LUMINANCES];
-	gint shade_range_count;
-	gint luminance, shade_range, range_max, range_min;
-	
-	test_image.x_size = dot_spacing;
-	test_image.y_size = dot_spacing;
-	test_image_size = test_image.x_size * test_image.y_size;
-	image_center = dot_spacing / 2;
-	test_image.pixels = (guchar *) g_malloc(test_image.x_size *
-			test_image.y_size);
-	if (test_image.pixels == NULL) {
-		return FALSE;
+	struct StripeOutput output;
+	struct BWPackedBitmap canvas;
+	gint32 new_image_id = -1;
+	gint width = source->width;
+	gsize canvas_size = (gsize) (width + 7) / 8 * source->height;
+	gsize scanlines_size = 0;
+	gboolean ok;
+
+	output.io = io;
+	output.drawable = drawable;
+	output.target = NULL;
+	output.canvas = NULL;
+	if (vals.output == OUTPUT_PBM || vals.output == OUTPUT_TIFF_G4) {
+		canvas.x_size = width;
+		canvas.y_size = source->height;
+		canvas.pixels = (guchar *) halftone_try_malloc(canvas_size);
+		output.canvas = &canvas;
+		ok = canvas.pixels != NULL;
+	} else {
+		output.target = init_output(drawable, io, &output.out_channels,
+		                            &new_image_id);
+		scanlines_size = (gsize) SCANLINE_AREA_HEIGHT * width
+		                 * output.out_channels;
+		io->scanlines_out = (guchar *) halftone_try_malloc(scanlines_size);
+		ok = io->scanlines_out != NULL;
 	}
-	memset(test_image.pixels, WHITE, test_image.x_size * test_image.y_size);	
-	/* Go through every dot size (in pixels)
-	 * beginning from luminance == 255 (white, dot size == 0)
-	 * and mark dot sizes where luminance changes
-	 * until luminance == 0 (black) is reached.
-	 * So n luminance ranges are found where
-	 * luminance(range 0) = white and luminance (range n-1) = black. */
-	black_pixels_in_bitmap = 0;
-	dot_pixel_size = 0;
-	previous_shade = WHITE;
-	shade_ranges[0] = 255;
-	shade_range_dot_sizes[0] = 0;
-	shade_range_count = 1;
-	for (dot_pixel_size = 0; dot_pixel_size < max_pixels_in_dot;) {
-		x = pixels_of_dot[dot_pixel_size].x_position;
-		y = pixels_of_dot[dot_pixel_size].y_position;
-		n = paint_pixel(&test_image, x, y);
-		n += paint_pixel(&test_image, dot_spacing + x, y);
-		n += paint_pixel(&test_image, x, dot_spacing + y);
-		n += paint_pixel(&test_image, dot_spacing + x, dot_spacing + y);
-		n += paint_pixel(&test_image, image_center + x, image_center + y);
-		black_pixels_in_bitmap += n;
-		dot_pixel_size++;
-		shade = WHITE - WHITE * black_pixels_in_bitmap / test_image_size;
-		if (shade < previous_shade) {
-			shade_ranges[shade_range_count] = shade;
-			shade_range_dot_sizes[shade_range_count] = dot_pixel_size;
-			shade_range_count++;
-			previous_shade = shade;
-		}
-		if (shade == 0) {
-			break;
-		}
+
+	ok = ok && halftone_context_render_stripes(ctx, source, stripe_height,
+	                                           send_stripe, &output);
+	if (ok == FALSE) {
+		g_message("Printable Halftone: Out of memory.");
 	}
-	/* Make the luminance ranges overlap so that one range changes
-	 * to another at the halfway of both ranges' luminances.
-	 * Example: luminances a = 199, b = 142, c = 85.
-	 * Range containing luminance b
-	 * is from (a + b) / 2 = (199 + 142) / 2 = 170
-	 *    to   (b + c) / 2 - 1 = (142 + 85) / 2 - 1 = 112.
-	 * After that the sum of all the output luminances
-	 * at input luminance = 0..255 is the same as
-	 * when output luminances = input luminances.
-	 */
-	/* last range: white only */
-	for (luminance = WHITE, range_min = (shade_ranges[1] + WHITE) / 2;
-			luminance > range_min; luminance--) {
-		pixel_count_of_luminance[luminance] = 0;
-	}
-	for (shade_range = 1; shade_range < shade_range_count - 1;
-			shade_range++) {
-		range_max = (shade_ranges[shade_range - 1] +
-		        shade_ranges[shade_range]) / 2;
-		range_min = (shade_ranges[shade_range + 1] +
-				shade_ranges[shade_range]) / 2;
-		for (luminance = range_max; luminance > range_min; luminance--) {
-			pixel_count_of_luminance[luminance] =
-				shade_range_dot_sizes[shade_range];
+	if (output.canvas != NULL) {
+		if (ok && write_to_file(gimp_drawable_get_image(
+		                                drawable->drawable_id),
+		                        NULL, &canvas) == FALSE) {
+			g_message("Printable Halftone: Cannot write \"%s\".",
+			          output_filename);
 		}
+		halftone_free(canvas.pixels, canvas_size);
+	} else {
+		halftone_free(io->scanlines_out, scanlines_size);
+		finish_output(drawable, output.target, io);
 	}
-	/* first range: black only. */
-	for (; luminance >= 0; luminance--) {
-		pixel_count_of_luminance[luminance] =
-			shade_range_dot_sizes[shade_range];
+	return new_image_id;
+}
+
+static gboolean send_stripe(gint y, const struct BWBitmap * stripe,
+                            gpointer user_data)
+{
+	struct StripeOutput * output = (struct StripeOutput *) user_data;
+	struct BWPackedBitmap * canvas = output->canvas;
+	gsize packed_width;
+	gint row;
+
+	if (canvas != NULL) {
+		packed_width = (canvas->x_size + 7) / 8;
+		for (row = 0; row < stripe->y_size; row++) {
+			halftone_pack_row(stripe->pixels + (gsize) row * stripe->x_size,
+			                  stripe->x_size,
+			                  canvas->pixels + (gsize) (y + row) * packed_width);
+		}
+	} else if (output->target == output->drawable) {
+		send_to_gimp(output->io, stripe, y);
+	} else {
+		send_to_new_drawable(output->io, output->out_channels, stripe, 0, y);
 	}
-	g_free(test_image.pixels);	
 	return TRUE;
 }
 
 /*
- * Tries to paint a black pixel in given bitmap
- * Returns number of white pixels changed to black (1 or 0)
+ * Sets up io->rgn_out for the outputs into drawables and returns the
+ * drawable written to: drawable itself, or a new one made by
+ * create_output_drawable().
  */
-static gint paint_pixel(struct BWBitmap * image, const gint x, const gint y)
+static GimpDrawable * init_output(GimpDrawable * drawable,
+                                  struct PluginIO * io, gint * out_channels,
+                                  gint32 * new_image_id)
 {
-	gint index;
-	if ((x >= 0) && (x < image->x_size) && (y >= 0) && (y < image->y_size)) {
-		index = y * image->x_size + x;
-		if (image->pixels[index] == WHITE) {
-			image->pixels[index] = BLACK;
-			return 1;
-		}
+	GimpDrawable * target;
+	gint width = io->area_x2 - io->area_x1;
+	gint height = io->area_y2 - io->area_y1;
+
+	if (vals.output == OUTPUT_INDEXED_IMAGE
+	    || vals.output == OUTPUT_TRANSPARENT_LAYER) {
+		target = create_output_drawable(drawable, io, new_image_id);
+		*out_channels = gimp_drawable_bpp(target->drawable_id);
+		gimp_pixel_rgn_init (&io->rgn_out, target, 0, 0,
+		        width, height, TRUE, FALSE);
+	} else {
+		target = drawable;
+		*out_channels = io->channels;
+	 	gimp_pixel_rgn_init (&io->rgn_out, drawable, io->area_x1, io->area_y1,
+	 	        width, height, TRUE, TRUE);
 	}
-	return 0;
+	return target;
 }
 
 /*
- * Generates precalculated dot images used in actual filtering
+ * Update the modified region
  */
-static gboolean precalculate_dots(void)
+static void finish_output(GimpDrawable * drawable, GimpDrawable * target,
+                          const struct PluginIO * io)
 {
-	gint luminance, dot_pixel_size, x, y, index, base_index;
-
-	precalculated_dots = (guchar *) g_realloc(precalculated_dots,
-	        pixels_in_dot_bitmap * LUMINANCES);
-	if (precalculated_dots == NULL) {
-		cleanup_precalc();
-		return FALSE;
-	}
-
-	/* Generate bitmap with white background.
-	 * Generally, copy bitmap to next luminance value
-	 * and add some black pixels each round. */
-	dot_pixel_size = 0;
-	base_index = WHITE * pixels_in_dot_bitmap;
-	memset(precalculated_dots + base_index, WHITE, pixels_in_dot_bitmap);
-	
-	for (luminance = WHITE; luminance >= BLACK;
-	        luminance--, base_index -= pixels_in_dot_bitmap) {
-		while (dot_pixel_size < pixel_count_of_luminance[luminance]) {
-			x = dot_center + pixels_of_dot[dot_pixel_size].x_position;
-			y = dot_center + pixels_of_dot[dot_pixel_size].y_position;
-			index = y * max_dot_width + x;
-			precalculated_dots[base_index + index] = BLACK;
-			dot_pixel_size++;
-		}
-		if (luminance > 0) {
-			memcpy(precalculated_dots + base_index - pixels_in_dot_bitmap,
-			        precalculated_dots + base_index,
-			        pixels_in_dot_bitmap);
-		}
+	gint width = io->area_x2 - io->area_x1;
+	gint height = io->area_y2 - io->area_y1;
+
+	gimp_drawable_flush (target);
+	if (target == drawable) {
+	 	gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
+	 	gimp_drawable_update (drawable->drawable_id,
+	 	                      io->area_x1, io->area_y1, width, height);
+	} else {
+		gimp_drawable_update (target->drawable_id, 0, 0, width, height);
+		gimp_drawable_detach (target);
 	}
-	return TRUE;
 }
 
 /*
- * Does the actual filtering
+ * Creates the drawable for OUTPUT_INDEXED_IMAGE (a new two-color image)
+ * or OUTPUT_TRANSPARENT_LAYER (a new layer above drawable, placed over
+ * the selection). *new_image_id is set to the new image, if any.
  */
-static gboolean render2(void)
+static GimpDrawable * create_output_drawable(GimpDrawable * drawable,
+                                             const struct PluginIO * io,
+                                             gint32 * new_image_id)
 {
-	guchar * scanline;
-	gint x, y, index;
-	gint index_step = dot_spacing * channels;
-	guchar luminance;
-	gint phase;
-
-	result_image.pixels = (guchar *) g_malloc(result_image.x_size
-	                                          * result_image.y_size);
-	scanline = (guchar *) g_malloc(result_image.x_size * channels);
-	scanlines_out = (guchar *) g_malloc(SCANLINE_AREA_HEIGHT
-	                                   * result_image.x_size * channels);
-	if (result_image.pixels == NULL || scanline == NULL
-		|| scanlines_out == NULL) {
-		g_free(result_image.pixels);
-		g_free(scanline);
-		g_free(scanlines_out);
-		return FALSE;
-	}
-	memset(result_image.pixels, WHITE,
-	       result_image.x_size * result_image.y_size);
-#if 1
-	// yksi for(phase) lisää ei näytä hidastavan huomattavasti
-	// gimp_pixel_rgn_get_row vie 70% suoritusajasta
-	// pistekoosta riippumatta.
-	// optimointi: muuta gimp_pixel_rgn_get_row
-	// gimp_pixel_rgb_get_rectiksi, y-koko maks. 64
-	//
-	// paint_dot vie 10% suoritusajasta (koolla 8)
-	//   koolla 6 2x ajan vrt koolla 8
-	//   koolla 5 2.5x ajan vrt koolla 8
-	//   koolla 4 8x ajan vrt koolla 8
-	//   koolla 2 9x ajan vrt koolla 8
-	// optimointi hankalaa nimenomaan pienellä pistekoolla
-    //
-	for (phase = 0; phase < 2; phase++) {
-	for (y = phase * dot_spacing / 2;
-			y < result_image.y_size; y += dot_spacing) {
-		gimp_pixel_rgn_get_row (&rgn_in, scanline, area_x1, area_y1 + y,
-		        result_image.x_size);
-		for (x = phase * dot_spacing / 2, index = 0; x < result_image.x_size;
-		        x += dot_spacing, index += index_step) {
-			if (channels < 3) {
-				luminance = scanline[index];
-			} else {
-				luminance = (30 * scanline[index] +
-				             59 * scanline[index + 1] +
-							 11 * scanline[index + 2]) / 100;
-			}
-			paint_dot(x, y, luminance);
-		}
-		gimp_progress_update((gdouble)y / (gdouble)result_image.y_size
-		                     * 0.5 + (gdouble)phase * 0.5);
-	}
-	}
-#else
-	/* Unoptimized version */
-
-	for (y = 0; y < result_image.y_size; y += dot_spacing) {
-		gimp_pixel_rgn_get_row (&rgn_in, scanline, area_x1, area_y1 + y,
-		        result_image.x_size);
-		for (x = 0, index = 0; x < result_image.x_size;
-		        x += dot_spacing, index += index_step) {
-			if (channels < 3) {
-				luminance = scanline[index];
-			} else {
-				luminance = (30 * scanline[index] +
-				             59 * scanline[index + 1] +
-							 11 * scanline[index + 2]) / 100;
-			}
-			paint_dot(x, y, luminance);
-		}
-		gimp_progress_update((gdouble)y / (gdouble)result_image.y_size
-		                     * 0.5);
-	}
-	for (y = dot_spacing / 2; y < result_image.y_size; y += dot_spacing) {
-		gimp_pixel_rgn_get_row (&rgn_in, scanline, area_x1, area_y1 + y,
-		        result_image.x_size);
-		for (x = dot_spacing / 2, index = 0; x < result_image.x_size;
-		        x += dot_spacing, index += index_step) {
-			if (channels < 3) {
-				luminance = scanline[index];
-			} else {
-				luminance = (30 * scanline[index] +
-				             59 * scanline[index + 1] +
-							 11 * scanline[index + 2]) / 100;
-			}
-			paint_dot(x, y, luminance);
-		}
-		gimp_progress_update((gdouble)y / (gdouble)result_image.y_size
-		                     * 0.5 + 0.5);
+	static const guchar colormap[] = { 0, 0, 0,  255, 255, 255 };
+	gint32 image_id = gimp_drawable_get_image(drawable->drawable_id);
+	gint32 layer_id;
+	gint width = io->area_x2 - io->area_x1;
+	gint height = io->area_y2 - io->area_y1;
+	gint offset_x, offset_y;
+	gdouble x_resolution, y_resolution;
+
+	if (vals.output == OUTPUT_INDEXED_IMAGE) {
+		*new_image_id = gimp_image_new(width, height, GIMP_INDEXED);
+		gimp_image_set_colormap(*new_image_id, colormap, 2);
+		gimp_image_get_resolution(image_id, &x_resolution, &y_resolution);
+		gimp_image_set_resolution(*new_image_id, x_resolution, y_resolution);
+		layer_id = gimp_layer_new(*new_image_id, "Halftone", width, height,
+		                          GIMP_INDEXED_IMAGE, 100, GIMP_NORMAL_MODE);
+		gimp_image_add_layer(*new_image_id, layer_id, -1);
+	} else {
+		layer_id = gimp_layer_new(image_id, "Halftone", width, height,
+		                          gimp_drawable_is_gray(drawable->drawable_id)
+		                          ? GIMP_GRAYA_IMAGE : GIMP_RGBA_IMAGE,
+		                          100, GIMP_NORMAL_MODE);
+		gimp_drawable_offsets(drawable->drawable_id, &offset_x, &offset_y);
+		gimp_layer_set_offsets(layer_id, offset_x + io->area_x1,
+		                       offset_y + io->area_y1);
+		gimp_image_add_layer(image_id, layer_id, -1);
 	}
-#endif
+	return gimp_drawable_get(layer_id);
+}
 
-	g_free(scanline);
-	send_to_gimp();
-	g_free(result_image.pixels);
-	g_free(scanlines_out);
+/* Private functions */
+
+static gboolean get_row(gint y, guchar * row, gpointer user_data)
+{
+	struct PluginIO * io = (struct PluginIO *) user_data;
+	gint64 start = g_get_monotonic_time();
+
+	gimp_pixel_rgn_get_row (&io->rgn_in, row, io->area_x1, io->area_y1 + y,
+	        io->area_x2 - io->area_x1);
+	io->read_time += g_get_monotonic_time() - start;
 	return TRUE;
 }
 
+static void update_progress(gdouble fraction, gpointer user_data)
+{
+	gimp_progress_update(fraction);
+}
+
 /*
- * Paints black dots into result_image.
+ * Copies result_image to rgn_out from row y_offset on,
+ * preserves alpha channel.
  */
-static void paint_dot(const gint x, const gint y, const gint luminance)
+static void send_to_gimp(struct PluginIO * io,
+                         const struct BWBitmap * result_image, gint y_offset)
 {
-	/* xi, yi, begin_x, begin_y, end_x, end_y are coordinates
-	 * the origin of which is in the center of the dot
-	 * (in the both bitmaps precalculated_dots and result_image */
-
-	/* Counters etc. */
-	gint in_x, in_y, out_x, out_y;
-	gint index_in, index_out;
-
-	/* Beginning and end coordinates for precalculated_dots */
-	gint in_x1 = 0;
-	gint in_y1 = 0;
-	gint in_x2 = max_dot_width;
-	gint in_y2 = max_dot_width;
-
-	/* Beginning and end coordinates for result_image */
-	gint out_x1 = x - dot_center;
-	gint out_y1 = y - dot_center;
-	gint out_x2 = out_x1 + max_dot_width;
-	gint out_y2 = out_y1 + max_dot_width;
+	guchar * scanlines_out = io->scanlines_out;
+	gint channels = io->channels;
+	gint area_height = SCANLINE_AREA_HEIGHT;
+	gint area_size = result_image->x_size * SCANLINE_AREA_HEIGHT;
+	gint y_left;
+	gint y;
 	
-	if (out_x1 < 0) {
-		in_x1 -= out_x1;
-		out_x1 = 0;
-	}
-	if (out_y1 < 0) {
-		in_y1 -= out_y1;
-		out_y1 = 0;
-	}
-	if (out_x2 > result_image.x_size) {
-		in_x2 -= out_x2 - result_image.x_size;
-		out_x2 = result_image.x_size;
-	}
-	if (out_y2 > result_image.y_size) {
-		in_y2 -= out_y2 - result_image.y_size;
-		out_y2 = result_image.y_size;
-	}
-
-	/* Original version */
-//	for (in_y = in_y1, out_y = out_y1;
-//         in_y < in_y2;
-//         in_y++, out_y++)
-//    {
-//		for (in_x = in_x1, out_x = out_x1;
-//             in_x < in_x2;
-//             in_x++, out_x++)
-//        {
-//			index_in = luminance * pixels_in_dot_bitmap
-//			           + in_y * max_dot_width + in_x;
-//
-//			index_out = out_y * result_image.x_size + out_x;
-//
-//			if (precalculated_dots[index_in] == BLACK) {
-//				result_image.pixels[index_out] = BLACK;
-//			}
-//		}
-//	}
-	/* Optimized version */
-	guchar * src = precalculated_dots + luminance * pixels_in_dot_bitmap
-                                      + in_y1 * max_dot_width;
-	guchar * dest = result_image.pixels + out_y1 * result_image.x_size;
-	for (in_y = in_y1; in_y < in_y2; in_y++)
-    {
-		for (in_x = in_x1, out_x = out_x1;
-             in_x < in_x2;
-             in_x++, out_x++)
-        {
-			dest[out_x] = (dest[out_x]) & (src[in_x]);
+	for (y = 0, y_left = result_image->y_size;
+	        y < result_image->y_size;
+			y += area_height, y_left -= area_height) {
+		if (y_left < area_height) {
+			area_height = y_left;
+			area_size = result_image->x_size * area_height;
+		}
+		if (channels != 1) {
+			gimp_pixel_rgn_get_rect (&io->rgn_in, scanlines_out,
+			        io->area_x1, io->area_y1 + y_offset + y,
+		            result_image->x_size, area_height);
 		}
-		src += max_dot_width;
-		dest += result_image.x_size;
+		halftone_expand_row(result_image->pixels + y * result_image->x_size,
+		                    area_size, channels, scanlines_out);
+		gimp_pixel_rgn_set_rect (&io->rgn_out, scanlines_out,
+		        io->area_x1, io->area_y1 + y_offset + y,
+		        result_image->x_size, area_height);
 	}
 }
 
 /*
- * Copies result_image to rgn_out, preserves alpha channel.
+ * Copies result_image to (x, y) of rgn_out of a new drawable, which has
+ * nothing to preserve. 1 channel: indexes into the black and white
+ * colormap. 2 or 4 channels: black dots on transparent.
  */
-static void send_to_gimp(void)
+static void send_to_new_drawable(struct PluginIO * io, gint channels,
+                                 const struct BWBitmap * result_image,
+                                 gint x_offset, gint y_offset)
 {
+	guchar * scanlines_out = io->scanlines_out;
 	gint area_height = SCANLINE_AREA_HEIGHT;
-	gint area_size = result_image.x_size * SCANLINE_AREA_HEIGHT;
+	gint area_size = result_image->x_size * SCANLINE_AREA_HEIGHT;
 	gint y_left;
-	gint x, y, index1, index2;
-	
-	for (y = 0, y_left = result_image.y_size;
-	        y < result_image.y_size;
+	gint y;
+
+	for (y = 0, y_left = result_image->y_size;
+	        y < result_image->y_size;
 			y += area_height, y_left -= area_height) {
 		if (y_left < area_height) {
 			area_height = y_left;
-			area_size = result_image.x_size * SCANLINE_AREA_HEIGHT;
+			area_size = result_image->x_size * area_height;
 		}
-		if (channels != 1) {
-			gimp_pixel_rgn_get_rect (&rgn_in, scanlines_out, area_x1, area_y1 + y,
-		        result_image.x_size, area_height);
+		halftone_expand_mask_row(result_image->pixels
+		                         + y * result_image->x_size,
+		                         area_size, channels, scanlines_out);
+		gimp_pixel_rgn_set_rect (&io->rgn_out, scanlines_out,
+		        x_offset, y_offset + y, result_image->x_size, area_height);
+	}
+}
+
+/*
+ * OUTPUT_TRANSPARENT_LAYER, repainting only what has changed.
+ *
+ * The hashes of the source tiles are kept in a parasite of drawable
+ * together with the render parameters and the tattoo of the result
+ * layer. If the parameters are the same and the layer still exists,
+ * only the tiles whose hash has changed are repainted, with their
+ * neighbors within the reach of a dot. Otherwise a new layer is
+ * painted in full. Tiles are rendered with
+ * halftone_context_render_region(), so they fit together either way.
+ */
+static void update_layer(GimpDrawable * drawable, struct PluginIO * io,
+                         HalftoneContext * ctx)
+{
+	gint32 image_id = gimp_drawable_get_image(drawable->drawable_id);
+	gint width = io->area_x2 - io->area_x1;
+	gint height = io->area_y2 - io->area_y1;
+	gint margin = halftone_region_margin(ctx->dots);
+	gint halo = (margin + TILE_SIZE - 1) / TILE_SIZE;
+	struct TileHashesHeader header;
+	const struct TileHashesHeader * old_header;
+	const guint64 * old_hashes = NULL;
+	struct RegionIO region;
+	HalftoneSource source;
+	GimpParasite * parasite;
+	GimpDrawable * layer = NULL;
+	gint32 layer_id = -1, new_image_id;
+	guint64 * hashes;
+	gboolean * repaint;
+	guchar * tile_buffer;
+	gsize parasite_size;
+	gint tile_count, tile, repainted, to_repaint;
+	gint tile_x, tile_y, x, y, tile_width, tile_height, neighbor_x, neighbor_y;
+	gint out_channels;
+	gint update_x1 = width, update_y1 = height, update_x2 = 0, update_y2 = 0;
+	gboolean failed = FALSE;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = TILE_HASHES_MAGIC;
+	header.dot_spacing = ctx->dots->dot_spacing;
+	header.channels = io->channels;
+	header.area_x1 = io->area_x1;
+	header.area_y1 = io->area_y1;
+	header.area_x2 = io->area_x2;
+	header.area_y2 = io->area_y2;
+	header.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+	header.tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+	tile_count = header.tiles_x * header.tiles_y;
+	parasite_size = sizeof(header) + tile_count * sizeof(guint64);
+
+	hashes = g_try_new(guint64, tile_count);
+	repaint = g_try_new0(gboolean, tile_count);
+	tile_buffer = (guchar *) g_try_malloc(TILE_SIZE * TILE_SIZE
+	                                      * io->channels);
+	io->scanlines_out = (guchar *) g_try_malloc(SCANLINE_AREA_HEIGHT
+	                                            * TILE_SIZE * 4);
+	if (hashes == NULL || repaint == NULL || tile_buffer == NULL
+	    || io->scanlines_out == NULL) {
+		g_message("Printable halftone: Out of memory.");
+		goto out;
+	}
+
+	for (tile = 0; tile < tile_count; tile++) {
+		x = tile % header.tiles_x * TILE_SIZE;
+		y = tile / header.tiles_x * TILE_SIZE;
+		hashes[tile] = hash_tile(io, tile_buffer, x, y,
+		                         MIN(TILE_SIZE, width - x),
+		                         MIN(TILE_SIZE, height - y));
+	}
+
+	parasite = gimp_drawable_parasite_find(drawable->drawable_id,
+	                                       PARASITE_KEY);
+	if (parasite != NULL
+	    && gimp_parasite_data_size(parasite) == (glong) parasite_size) {
+		old_header = (const struct TileHashesHeader *)
+		             gimp_parasite_data(parasite);
+		if (memcmp(old_header, &header,
+		           G_STRUCT_OFFSET(struct TileHashesHeader,
+		                           layer_tattoo)) == 0) {
+			layer_id = gimp_image_get_layer_by_tattoo(image_id,
+			                                   old_header->layer_tattoo);
 		}
-		switch (channels) {
-		case 1: /* Greyscale */
-			memcpy(scanlines_out, result_image.pixels + y*result_image.x_size,
-			        area_size);
-			break;
-		case 2: /* Greyscale + alpha */
-			for (x = 0, index1 = 0, index2 = y * result_image.x_size;
-			        x < area_size; x++, index1 += channels, index2++) {
-				scanlines_out[index1] = result_image.pixels[index2];
-			}
-			break;
-		case 3: /* RGB */
-		case 4: /* RGB + alpha */
-			for (x = 0, index1 = 0, index2 = y * result_image.x_size;
-			        x < area_size; x++, index1 += channels, index2++) {
-				scanlines_out[index1] = result_image.pixels[index2];
-				scanlines_out[index1 + 1] = result_image.pixels[index2];
-				scanlines_out[index1 + 2] = result_image.pixels[index2];
+		if (layer_id != -1 && gimp_drawable_width(layer_id) == width
+		    && gimp_drawable_height(layer_id) == height) {
+			old_hashes = (const guint64 *) (old_header + 1);
+		}
+	}
+
+	/* A changed source tile changes the dots centered in it,
+	 * which reach halo tiles further */
+	for (tile = 0; tile < tile_count; tile++) {
+		if (old_hashes != NULL && old_hashes[tile] == hashes[tile]) {
+			continue;
+		}
+		tile_x = tile % header.tiles_x;
+		tile_y = tile / header.tiles_x;
+		for (neighbor_y = MAX(tile_y - halo, 0);
+		        neighbor_y <= MIN(tile_y + halo, header.tiles_y - 1);
+		        neighbor_y++) {
+			for (neighbor_x = MAX(tile_x - halo, 0);
+			        neighbor_x <= MIN(tile_x + halo, header.tiles_x - 1);
+			        neighbor_x++) {
+				repaint[neighbor_y * header.tiles_x + neighbor_x] = TRUE;
 			}
-			break;
-		default:
+		}
+	}
+	if (parasite != NULL) {
+		gimp_parasite_free(parasite);
+	}
+
+	if (old_hashes != NULL) {
+		layer = gimp_drawable_get(layer_id);
+	} else {
+		layer = create_output_drawable(drawable, io, &new_image_id);
+	}
+	out_channels = gimp_drawable_bpp(layer->drawable_id);
+	gimp_pixel_rgn_init (&io->rgn_out, layer, 0, 0,
+	        width, height, TRUE, FALSE);
+
+	to_repaint = 0;
+	for (tile = 0; tile < tile_count; tile++) {
+		to_repaint += repaint[tile];
+	}
+	for (tile = 0, repainted = 0; tile < tile_count; tile++) {
+		if (!repaint[tile]) {
+			continue;
+		}
+		x = tile % header.tiles_x * TILE_SIZE;
+		y = tile / header.tiles_x * TILE_SIZE;
+		tile_width = MIN(TILE_SIZE, width - x);
+		tile_height = MIN(TILE_SIZE, height - y);
+
+		region.io = io;
+		region.x = x - margin;
+		region.y = y - margin;
+		region.width = tile_width + 2 * margin;
+		source.width = region.width;
+		source.height = tile_height + 2 * margin;
+		source.channels = io->channels;
+		source.format = HALFTONE_FORMAT_U8;
+		source.get_row = get_region_row;
+		source.progress = NULL;
+		source.user_data = &region;
+		if (halftone_context_render_region(ctx, &source, x, y,
+		        tile_width, tile_height) == FALSE) {
+			g_message("Printable Halftone: Out of memory.");
+			failed = TRUE;
 			break;
 		}
-		gimp_pixel_rgn_set_rect (&rgn_out, scanlines_out, area_x1, area_y1 + y,
-		        result_image.x_size, area_height);
+		send_to_new_drawable(io, out_channels, &ctx->result_image, x, y);
+
+		update_x1 = MIN(update_x1, x);
+		update_y1 = MIN(update_y1, y);
+		update_x2 = MAX(update_x2, x + tile_width);
+		update_y2 = MAX(update_y2, y + tile_height);
+		gimp_progress_update((gdouble) ++repainted / to_repaint);
 	}
+
+	gimp_drawable_flush (layer);
+	if (update_x2 > update_x1) {
+		gimp_drawable_update (layer->drawable_id, update_x1, update_y1,
+		                      update_x2 - update_x1, update_y2 - update_y1);
+	}
+
+	/* Remember what the layer now shows. After a failure some tiles
+	 * are stale, so the next run paints the layer in full. */
+	header.layer_tattoo = gimp_drawable_get_tattoo(layer->drawable_id);
+	g_free(tile_buffer);
+	tile_buffer = NULL;
+	if (failed) {
+		gimp_drawable_parasite_detach(drawable->drawable_id, PARASITE_KEY);
+	} else {
+		tile_buffer = (guchar *) g_try_malloc(parasite_size);
+	}
+	if (tile_buffer != NULL) {
+		memcpy(tile_buffer, &header, sizeof(header));
+		memcpy(tile_buffer + sizeof(header), hashes,
+		       tile_count * sizeof(guint64));
+		parasite = gimp_parasite_new(PARASITE_KEY, GIMP_PARASITE_PERSISTENT,
+		                             parasite_size, tile_buffer);
+		gimp_drawable_parasite_attach(drawable->drawable_id, parasite);
+		gimp_parasite_free(parasite);
+	}
+	gimp_drawable_detach (layer);
+
+out:
+	g_free(io->scanlines_out);
+	g_free(tile_buffer);
+	g_free(repaint);
+	g_free(hashes);
 }
 
-static void cleanup_precalc(void)
+/*
+ * FNV-1a hash of the source pixels of one tile.
+ */
+static guint64 hash_tile(struct PluginIO * io, guchar * buffer,
+                         gint x, gint y, gint width, gint height)
 {
-	if (pixels_of_dot != NULL) {
-		g_free(pixels_of_dot);
-		pixels_of_dot = NULL;
-		pixels_in_dot_bitmap = 0;
+	guint64 hash = G_GUINT64_CONSTANT(14695981039346656037);
+	gsize i, size = (gsize) width * height * io->channels;
+
+	gimp_pixel_rgn_get_rect (&io->rgn_in, buffer,
+	        io->area_x1 + x, io->area_y1 + y, width, height);
+	for (i = 0; i < size; i++) {
+		hash ^= buffer[i];
+		hash *= G_GUINT64_CONSTANT(1099511628211);
 	}
-	if (precalculated_dots != NULL) {
-		g_free(precalculated_dots);
-		precalculated_dots = NULL;
+	return hash;
+}
+
+static gboolean get_region_row(gint y, guchar * row, gpointer user_data)
+{
+	struct RegionIO * region = (struct RegionIO *) user_data;
+	struct PluginIO * io = region->io;
+	gint channels = io->channels;
+	gint x1 = MAX(region->x, 0);
+	gint x2 = MIN(region->x + region->width, io->area_x2 - io->area_x1);
+
+	y += region->y;
+	if (y < 0 || y >= io->area_y2 - io->area_y1) {
+		memset(row, WHITE, (gsize) region->width * channels);
+		return TRUE;
 	}
+	memset(row, WHITE, (x1 - region->x) * channels);
+	memset(row + (x2 - region->x) * channels, WHITE,
+	       (region->x + region->width - x2) * channels);
+	gimp_pixel_rgn_get_row (&io->rgn_in, row + (x1 - region->x) * channels,
+	        io->area_x1 + x1, io->area_y1 + y, x2 - x1);
+	return TRUE;
 }
 
+/*
+ * Writes result_image, or canvas if result_image is NULL,
+ * to output_filename as PBM or TIFF G4.
+ */
+static gboolean write_to_file(gint32 image_id,
+                              const struct BWBitmap * result_image,
+                              const struct BWPackedBitmap * canvas)
+{
+	FILE * file;
+	gdouble x_resolution, y_resolution;
+	gboolean ok;
+
+	file = fopen(output_filename, "wb");
+	if (file == NULL) {
+		return FALSE;
+	}
+	gimp_image_get_resolution(image_id, &x_resolution, &y_resolution);
+	if (vals.output == OUTPUT_PBM && result_image != NULL) {
+		ok = halftone_write_pbm(file, result_image);
+	} else if (vals.output == OUTPUT_PBM) {
+		ok = halftone_write_pbm_packed(file, canvas);
+	} else if (result_image != NULL) {
+		ok = halftone_write_tiff_g4(file, result_image, x_resolution);
+	} else {
+		ok = halftone_write_tiff_g4_packed(file, canvas, x_resolution);
+	}
+	if (fclose(file) != 0) {
+		ok = FALSE;
+	}
+	return ok;
+}
+
+/*
+ * Writes the dots of source to output_filename as SVG or PDF.
+ */
+static gboolean write_vector_file(gint32 image_id, const HalftoneDots * dots,
+                                  const HalftoneSource * source)
+{
+	FILE * file;
+	gdouble x_resolution, y_resolution;
+	gboolean ok;
+
+	file = fopen(output_filename, "wb");
+	if (file == NULL) {
+		return FALSE;
+	}
+	gimp_image_get_resolution(image_id, &x_resolution, &y_resolution);
+	if (vals.output == OUTPUT_SVG) {
+		ok = halftone_write_svg(file, dots, source, x_resolution);
+	} else {
+		ok = halftone_write_pdf(file, dots, source, x_resolution);
+	}
+	if (fclose(file) != 0) {
+		ok = FALSE;
+	}
+	return ok;
+}